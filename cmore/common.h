@@ -5,6 +5,27 @@
 
 #define LOG_MODULE( level, module, log, ... ) printf( #level " (" #module "): " log "\n", ##__VA_ARGS__ );
 
+// Assumed cache line size, used for padding shared data apart to avoid false sharing
+#define POM_CACHE_LINE_SIZE 64
+
+// Memory orderings for the lock-free code, each the weakest that's correct where it's
+// used. Define POM_STRICT_MEMORY_ORDER to make them all seq_cst, e.g. to rule out an
+// ordering bug while debugging
+#ifdef POM_STRICT_MEMORY_ORDER
+#define POM_MO_RELAXED memory_order_seq_cst
+#define POM_MO_ACQUIRE memory_order_seq_cst
+#define POM_MO_RELEASE memory_order_seq_cst
+#define POM_MO_ACQ_REL memory_order_seq_cst
+#else
+#define POM_MO_RELAXED memory_order_relaxed
+#define POM_MO_ACQUIRE memory_order_acquire
+#define POM_MO_RELEASE memory_order_release
+#define POM_MO_ACQ_REL memory_order_acq_rel
+#endif
+// Hazard pointer stores, and the loads that re-check a pointer after protecting it,
+// need store-load ordering in either mode
+#define POM_MO_SEQ_CST memory_order_seq_cst
+
 #ifdef UNUSED
 #elif defined(__GNUC__)
 # define UNUSED(x) UNUSED_ ## x __attribute__((unused))
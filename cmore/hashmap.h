@@ -4,22 +4,66 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include "hazard_ptr.h"
 
 typedef struct PomMapBucket PomMapBucket;
 typedef struct PomMapDataHeap PomMapDataHeap;
 
+// Non-owning view of a string stored in the map. `str` is still NUL-terminated
+typedef struct PomMapStrView{
+    const char *str;
+    size_t len;
+}PomMapStrView;
+
+// Key/value pair for bulk loading
+typedef struct PomMapPair{
+    const char *key;
+    const char *value;
+}PomMapPair;
+
+// Iterator for bulk loading. Fill in the next pair and return true, or return
+// false once there are no pairs left
+typedef bool (*PomMapPairIter)( void *_arg, const char **_key, const char **_value );
+
+// Hash function used for keys. Should give a well-distributed 64-bit hash, since
+// both the low bits (control tags) and higher bits (bucket index) are used
+typedef uint64_t (*PomMapHashFunc)( const char *_key, size_t _keyLen, uint64_t _seed );
+
+// Open-addressed map. Entries live in a single contiguous bucket array, with a
+// parallel array of control bytes recording whether each bucket is empty,
+// deleted (tombstone) or full, along with a 7-bit hash tag for full buckets.
+// Lookups scan the control bytes a group at a time and only compare keys on tag
+// matches. Key/value data lives in the data heap.
 typedef struct PomMapCtx{
     uint32_t numBuckets;
     uint32_t numNodes;
+    uint32_t numTombstones;
     PomMapBucket *buckets;
+    uint8_t *ctrl;
     PomMapDataHeap *dataHeap;
+    PomMapHashFunc hashFunc;
+    uint64_t seed;
+    // Table being migrated from during an incremental resize (NULL otherwise)
+    PomMapBucket *oldBuckets;
+    uint8_t *oldCtrl;
+    uint32_t oldNumBuckets;
+    uint32_t oldNumNodes;
+    uint32_t migrateIdx;
+    bool incrementalResize;
     bool initialised;
 }PomMapCtx;
 
 // Initialise the map with optional starting size suggestion
 int pomMapInit( PomMapCtx *_ctx, uint32_t _size );
 
-// Get a key if it exists, return `_default` otherwise
+// Initialise the map with a hash function (NULL for the default) and seed.
+// Use `pomMapRandomSeed` for a per-map random seed
+int pomMapInitHash( PomMapCtx *_ctx, uint32_t _size, PomMapHashFunc _hashFunc, uint64_t _seed );
+
+// Get a key if it exists, return `_default` otherwise. Returned values stay valid
+// until the key is set again or removed, or until compaction moves it. Compaction
+// only runs from `pomMapCompactStep`/`pomMapOptimise`, unless automatic compaction
+// is turned on (see `pomMapSetCompaction`)
 const char* pomMapGet( PomMapCtx *_ctx, const char * _key, const char * _default );
 
 // Set a key to a given value
@@ -31,16 +75,267 @@ const char* pomMapGetSet( PomMapCtx *_ctx, const char * _key, const char * _defa
 // Remove a key
 int pomMapRemove( PomMapCtx *_ctx, const char * _key );
 
+// Length-taking versions of the above, for keys/values that aren't NUL-terminated
+// (e.g. slices of a larger buffer). Lengths exclude any terminator. Stored copies
+// are always NUL-terminated
+const char* pomMapGetN( PomMapCtx *_ctx, const char * _key, size_t _keyLen, const char * _default );
+const char* pomMapSetN( PomMapCtx *_ctx, const char * _key, size_t _keyLen, const char * _value, size_t _valueLen );
+const char* pomMapGetSetN( PomMapCtx *_ctx, const char * _key, size_t _keyLen,
+                           const char * _default, size_t _defaultLen );
+int pomMapRemoveN( PomMapCtx *_ctx, const char * _key, size_t _keyLen );
+
+// Get a view of a key's value, including its length. Returns false if the key doesn't exist
+bool pomMapGetView( PomMapCtx *_ctx, const char * _key, size_t _keyLen, PomMapStrView *_value );
+
+// Set many keys at once. The table and data heap are grown once up front to fit
+// every pair, rather than as they fill. Later pairs win for repeated keys
+int pomMapSetMany( PomMapCtx *_ctx, const PomMapPair *_pairs, size_t _numPairs );
+
+// Set every pair produced by `_iter`. The strings it gives must stay valid until
+// this returns, since all pairs are gathered before the map is sized and filled
+int pomMapSetManyIter( PomMapCtx *_ctx, PomMapPairIter _iter, void *_arg );
+
 // Clean up the map
 int pomMapClear( PomMapCtx *_ctx );
 
 // Suggest a resize to the map
 int pomMapResize( PomMapCtx *_ctx, uint32_t _size );
 
-// Try optimise the data stored to help with caching
+// Enable/disable incremental resizing. When enabled, growing the table keeps the
+// old table alongside the new one, and moves a few buckets across on each
+// Set/GetSet/Remove rather than rehashing everything in one go. Lookups check both
+// tables while a migration is in progress. Disabling finishes any migration
+int pomMapSetIncrementalResize( PomMapCtx *_ctx, bool _incremental );
+
+// Try optimise the data stored to help with caching. Compacts the whole data heap
+// into a single chunk in one go
 int pomMapOptimise( PomMapCtx *_ctx );
 
-// Request an immutable pointer to the data heap
+// Set the compaction policy. The data heap wants compacting once dead data
+// (overwritten/removed pairs) is more than `_deadPercent` of it. Compaction
+// evacuates one heap chunk at a time, in bounded steps, which run from
+// `pomMapCompactStep`, e.g. during idle time. Setting `_automatic` opts in to a
+// small step on every write (set/get-set/bulk set/remove) while compaction is
+// wanted. Those steps move other keys' data, so any value returned earlier may be
+// invalidated by any write. Defaults to 50%, not automatic
+int pomMapSetCompaction( PomMapCtx *_ctx, uint32_t _deadPercent, bool _automatic );
+
+// Whether the heap is over the compaction threshold, or part way through compacting
+bool pomMapNeedsCompact( PomMapCtx *_ctx );
+
+// Run compaction for roughly `_budgetBytes` of heap data. Returns true if there's
+// more compaction left to do
+bool pomMapCompactStep( PomMapCtx *_ctx, size_t _budgetBytes );
+
+// Get the bytes of the data heap in use, allocated, and in use by dead data
+int pomMapHeapStats( PomMapCtx *_ctx, size_t *_heapUsed, size_t *_heapSize, size_t *_heapDead );
+
+// Request an immutable pointer to the data heap, along with the bytes used and
+// allocated in it. Returns NULL if the heap is spread over several chunks; call
+// `pomMapOptimise` first to pack it into one, or walk it with `pomMapGetDataHeapChunk`.
+// The heap holds a sequence of records: a header of key and value lengths (uint32_t
+// each, the key's top bit marking dead records), followed by the NUL-terminated key
+// and value
 const char * pomMapGetDataHeap( PomMapCtx *_ctx, size_t *_heapUsed, size_t *_heapSize );
 
+// Request an immutable pointer to one of the data heap's chunks as they are, along
+// with the bytes used and allocated in it. Chunks hold records in the same layout
+// as above. Returns NULL for freed chunks, and once `_chunk` is past the last chunk
+const char * pomMapGetDataHeapChunk( PomMapCtx *_ctx, uint32_t _chunk, size_t *_chunkUsed, size_t *_chunkSize );
+
+// Iteration order. Heap order walks the data heap sequentially, which is fastest
+// for visiting everything. Bucket order follows the table
+typedef enum PomMapIterOrder{
+    POM_MAP_ITER_HEAP,
+    POM_MAP_ITER_BUCKET
+}PomMapIterOrder;
+
+// Iterator over a map's live entries. The only change allowed to the map while
+// iterating is removing the current entry with `pomMapIterRemove`
+typedef struct PomMapIter{
+    PomMapCtx *map;
+    PomMapIterOrder order;
+    uint32_t section;   // Heap chunk or table
+    size_t pos;         // Position in the chunk, or bucket index
+    PomMapStrView key;
+    PomMapStrView value;
+}PomMapIter;
+
+// Start iterating over the map
+int pomMapIterInit( PomMapCtx *_ctx, PomMapIter *_iter, PomMapIterOrder _order );
+
+// Move to the next entry, filling in the iterator's key/value. Returns false once
+// every entry has been visited, and clears the key/value
+bool pomMapIterNext( PomMapIter *_iter );
+
+// Remove the current entry. Fails if the iterator isn't on an entry, i.e. before
+// the first `pomMapIterNext` or after it returns false
+int pomMapIterRemove( PomMapIter *_iter );
+
+// Fill `_histogram` with the number of entries found after probing 0, 1, 2... groups
+// past their home position. The last entry counts anything at or beyond it
+int pomMapProbeStats( PomMapCtx *_ctx, uint32_t *_histogram, uint32_t _histogramSize );
+
+// Default hash function. Word-at-a-time 64-bit hash (wyhash-based)
+uint64_t pomMapHashDefault( const char *_key, size_t _keyLen, uint64_t _seed );
+
+// Original byte-at-a-time sdbm hash, kept for comparison
+uint64_t pomMapHashSdbm( const char *_key, size_t _keyLen, uint64_t _seed );
+
+// Generate a seed for `pomMapInitHash` from cheap entropy sources (time, addresses)
+uint64_t pomMapRandomSeed( void );
+
+/*******************************************
+* Frozen version - minimal perfect hash
+********************************************/
+
+/*
+Immutable snapshot of a map for read-mostly data. Entries are placed with a
+minimal perfect hash (hash-and-displace), so a lookup is one displacement read,
+one tag byte read and, unless the tag rules the key out, one slot read and one key
+compare. The table and its key/value data live in one
+contiguous block addressed by offsets. Nothing is written after freezing, so a
+frozen map can be shared between threads without synchronisation.
+Since the block is position-independent it can be saved to a file as-is, and
+loaded back by mapping the file straight into memory.
+*/
+
+typedef struct PomMapFrozenSlot PomMapFrozenSlot;
+
+typedef struct PomMapFrozenCtx{
+    uint8_t *block;
+    size_t blockSize;
+    PomMapHashFunc hashFunc;
+    uint64_t seed;
+    uint64_t salt;
+    uint32_t numSlots;
+    uint32_t numGroups;
+    const uint32_t *displacements;
+    const uint8_t *tags;
+    const PomMapFrozenSlot *slots;
+    const char *data;
+    bool mapped; // Block is a file mapping rather than an allocation
+}PomMapFrozenCtx;
+
+// Build a frozen copy of the map's current contents. The source map is untouched,
+// and can be cleared afterwards. Returns 1 if a perfect hash couldn't be found
+// (only expected if distinct keys share a full 64-bit hash)
+int pomMapFreeze( PomMapCtx *_ctx, PomMapFrozenCtx *_frozen );
+
+// Get a key if it exists, return `_default` otherwise
+const char* pomMapFrozenGet( const PomMapFrozenCtx *_frozen, const char * _key, const char * _default );
+
+// Write the frozen map to a file
+int pomMapFrozenSave( const PomMapFrozenCtx *_frozen, const char *_path );
+
+// Load a frozen map saved with `pomMapFrozenSave`. Memory-maps the file where
+// supported (lookups then read the file's pages directly), otherwise reads it in.
+// `_hashFunc` must be the hash function the map was built with (NULL for the
+// default). Returns 1 if the file can't be read or doesn't match
+int pomMapFrozenLoad( PomMapFrozenCtx *_frozen, const char *_path, PomMapHashFunc _hashFunc );
+
+// Clean up the frozen map
+int pomMapFrozenClear( PomMapFrozenCtx *_frozen );
+
+/*******************************************
+* Generic version - fixed-size keys/values
+********************************************/
+
+/*
+Map from fixed-size keys to fixed-size values, both stored inline in the table.
+Keys are hashed/compared with the given callbacks, or as raw bytes if they're NULL.
+4 and 8 byte keys without callbacks are treated as integers, which skips the
+callbacks entirely.
+Value pointers returned from the map are valid until the next insertion.
+*/
+
+typedef uint64_t (*PomGMapHashFunc)( const void *_key, size_t _keySize, uint64_t _seed );
+typedef bool (*PomGMapEqualFunc)( const void *_a, const void *_b, size_t _keySize );
+
+typedef struct PomGMapCtx{
+    uint32_t numBuckets;
+    uint32_t numNodes;
+    uint32_t numTombstones;
+    uint32_t keySize, valueSize;
+    uint32_t valueOffset, slotSize;
+    uint8_t *slots;
+    uint8_t *ctrl;
+    PomGMapHashFunc hashFunc;
+    PomGMapEqualFunc equalFunc;
+    uint64_t seed;
+    bool intKeys;
+}PomGMapCtx;
+
+// Initialise the map for the given key/value sizes. Callbacks may be NULL
+int pomGMapInit( PomGMapCtx *_ctx, uint32_t _size, uint32_t _keySize, uint32_t _valueSize,
+                 PomGMapHashFunc _hashFunc, PomGMapEqualFunc _equalFunc, uint64_t _seed );
+
+// Get a pointer to a key's value, or NULL if it doesn't exist
+void * pomGMapGet( PomGMapCtx *_ctx, const void *_key );
+
+// Set a key to a copy of `_value`, returning a pointer to the stored value
+void * pomGMapSet( PomGMapCtx *_ctx, const void *_key, const void *_value );
+
+// Get a key's value if it exists, otherwise add it with a copy of `_default`
+void * pomGMapGetSet( PomGMapCtx *_ctx, const void *_key, const void *_default );
+
+// Remove a key
+int pomGMapRemove( PomGMapCtx *_ctx, const void *_key );
+
+// Clean up the map
+int pomGMapClear( PomGMapCtx *_ctx );
+
+/*******************************************
+* Thread-safe version - striped locks
+********************************************/
+
+/*
+Concurrent string map. Readers never lock: each bucket is an immutable snapshot of
+its entries, replaced wholesale (copy-on-write) by writers and protected from
+reclamation with hazard pointers. Writers lock one of a fixed set of stripes, chosen
+from the key's hash, so writers to different stripes don't contend. Resizing takes
+every stripe. Retired snapshots are recycled through per-stripe pools rather than
+going back to malloc.
+Each thread using the map must call `pomMapTsThreadInit` with its own local context
+first, and `pomMapTsThreadClear` once all threads are done with the map.
+*/
+
+typedef struct PomMapTsTable PomMapTsTable;
+typedef struct PomMapTsStripe PomMapTsStripe;
+
+typedef struct PomMapTsCtx{
+    PomMapTsTable * _Atomic table;
+    PomMapTsStripe *stripes;
+    PomHpGlobalCtx hpCtx;
+    _Atomic uint32_t numNodes;
+    PomMapHashFunc hashFunc;
+    uint64_t seed;
+}PomMapTsCtx;
+
+// Initialise the map with optional starting size suggestion, hash function (NULL for
+// the default) and seed
+int pomMapTsInit( PomMapTsCtx *_ctx, uint32_t _size, PomMapHashFunc _hashFunc, uint64_t _seed );
+
+// Initialise the calling thread's context for the map (call once per thread)
+int pomMapTsThreadInit( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx );
+
+// Get a key if it exists, return `_default` otherwise. A returned value stays valid
+// until the thread's next call into the map, or `pomMapTsRelease`
+const char* pomMapTsGet( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx, const char * _key, const char * _default );
+
+// Release the value returned by the last `pomMapTsGet`
+int pomMapTsRelease( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx );
+
+// Set a key to a given value
+int pomMapTsSet( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx, const char * _key, const char * _value );
+
+// Remove a key
+int pomMapTsRemove( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx, const char * _key );
+
+// Clear the calling thread's context. Call once all threads are finished with the map
+int pomMapTsThreadClear( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx );
+
+// Clean up the map
+int pomMapTsClear( PomMapTsCtx *_ctx );
+
 #endif // HASHMAP_H
\ No newline at end of file
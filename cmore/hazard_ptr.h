@@ -12,10 +12,13 @@ typedef struct PomHpLocalCtx PomHpLocalCtx;
 
 typedef struct PomHpStackCtx PomHpStackCtx;
 
+typedef void (*PomHpReleaseFunc)( PomCommonNode *_node );
+
 struct PomHpGlobalCtx{
     PomHpRec * _Atomic hpHead; // Atomic pointer to a hp record
     _Atomic size_t rNodeThreshold;
     PomHpStackCtx * releasedPtrs;
+    PomHpReleaseFunc releaseFunc; // Optional handler for nodes that are no longer hazards
     _Atomic int allocCntr, freeCntr;
 };
 
@@ -45,7 +48,17 @@ int pomHpThreadClear( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx );
 // Clear the global hazard pointer data
 int pomHpGlobalClear( PomHpGlobalCtx *_ctx );
 
-// Request a node from the released list. Returns NULL if none available
+// Request a new node. Never reuses released nodes, since taking one off the released
+// list safely needs the thread's context (see `pomHpRequestNodeLocal`)
 PomCommonNode *pomHpRequestNode( PomHpGlobalCtx *_ctx );
 
+// Request a node from the released list, or a new one if none are available. Popping
+// uses a hazard pointer reserved for it, so the thread's own hazards are left alone
+PomCommonNode *pomHpRequestNodeLocal( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx );
+
+// Hand retired nodes to `_releaseFunc` once they're no longer hazards, instead of
+// keeping them on the released list. Lets the owner free nodes that aren't plain
+// `PomCommonNode` allocations. Set before any nodes are retired
+int pomHpSetReleaseFunc( PomHpGlobalCtx *_ctx, PomHpReleaseFunc _releaseFunc );
+
 #endif
\ No newline at end of file
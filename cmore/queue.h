@@ -4,10 +4,51 @@
 #include <stddef.h>
 #include "hazard_ptr.h"
 #include <stdint.h>
+#include "common.h"
+#include <stdbool.h>
+#include <time.h>
+#if defined(__STDC_NO_THREADS__) || defined(_WIN32) || defined(__CYGWIN__)
+#include "tinycthread.h"
+#else
+#include <threads.h>
+#endif
 
 
 //typedef struct PomQueueNode PomQueueNode;
 typedef struct PomQueueCtx PomQueueCtx;
+typedef struct PomEventCountCtx PomEventCountCtx;
+
+/*
+Event count, for parking threads until some lock-free condition changes without
+putting a lock on the fast path. A waiter registers with `pomEventCountPrepareWait`,
+re-checks its condition, and then either cancels or commits to the wait. Notifiers
+only take the lock (and make a syscall) if someone is registered as waiting.
+*/
+struct PomEventCountCtx{
+    _Atomic uint32_t numWaiters;
+    _Atomic uint32_t epoch;
+    mtx_t mtx;
+    cnd_t cnd;
+};
+
+// Initialise the event count
+int pomEventCountInit( PomEventCountCtx *_ctx );
+
+// Register as a waiter. Returns a key to pass to `pomEventCountWait`
+uint32_t pomEventCountPrepareWait( PomEventCountCtx *_ctx );
+
+// Deregister after `pomEventCountPrepareWait`, if the condition became true after all
+void pomEventCountCancelWait( PomEventCountCtx *_ctx );
+
+// Sleep until notified after the `pomEventCountPrepareWait` that gave `_key`, or
+// until the absolute (TIME_UTC) `_deadline` if it's not NULL. Returns false on timeout
+bool pomEventCountWait( PomEventCountCtx *_ctx, uint32_t _key, const struct timespec *_deadline );
+
+// Wake one waiter, or all of them
+void pomEventCountNotify( PomEventCountCtx *_ctx, bool _all );
+
+// Clean up the event count
+int pomEventCountClear( PomEventCountCtx *_ctx );
 
 /*
 struct PomQueueNode {
@@ -16,10 +57,18 @@ struct PomQueueNode {
 };
 */
 
+// Consumers only touch the head's cache line and producers only the tail's. The length
+// is tracked as separate push/pop counts on those same lines, so counting doesn't add
+// another contended line. Over-aligned, so heap-allocate with aligned_alloc
 struct PomQueueCtx{
-    PomCommonNode * _Atomic head;
-    PomCommonNode * _Atomic tail;
-    _Atomic uint32_t queueLength;
+    bool trackLength;
+    _Alignas( POM_CACHE_LINE_SIZE ) PomCommonNode * _Atomic head;
+    _Atomic uint32_t numPopped;
+    _Alignas( POM_CACHE_LINE_SIZE ) PomCommonNode * _Atomic tail;
+    _Atomic uint32_t numPushed;
+    // Producers check this on every push when blocking is enabled
+    _Alignas( POM_CACHE_LINE_SIZE ) PomEventCountCtx consumers;
+    bool blocking;
 };
 
 // Initialise the thread-safe queue
@@ -31,9 +80,157 @@ int pomQueuePush( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpgctx, PomHpLocalCtx *_hp
 // Pop an item from the queue
 void * pomQueuePop( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_hplctx );
 
+// Pop an item, sleeping until one's pushed if the queue's empty. Gives up after
+// `_timeout` (relative), or waits indefinitely if it's NULL. Can also return NULL
+// early, if woken by `pomQueueWakeAll` or if another consumer got to the item first.
+// Needs blocking enabled with `pomQueueSetBlocking`
+void * pomQueuePopWait( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_hplctx,
+                        const struct timespec *_timeout );
+
+// Enable/disable blocking pops (off by default). When enabled, pushes wake a sleeping
+// consumer, which costs a fence and a load when nobody's asleep. Set before the queue
+// is used
+int pomQueueSetBlocking( PomQueueCtx *_ctx, bool _blocking );
+
+// Wake every consumer sleeping in `pomQueuePopWait`, e.g. to shut them down
+int pomQueueWakeAll( PomQueueCtx *_ctx );
+
+// Add `_count` items to the queue in order. They're linked up first and appended with
+// a single CAS, so they appear in the queue together
+int pomQueuePushMany( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpgctx, PomHpLocalCtx *_hplctx,
+                      void * const *_data, uint32_t _count );
+
+// Pop up to `_maxCount` items from the queue into `_data` with a single CAS. Returns
+// the number of items popped
+uint32_t pomQueuePopMany( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_hplctx,
+                          void **_data, uint32_t _maxCount );
+
 // Clean up the queue
 int pomQueueClear( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_hplctx );
 
+// Approximate number of items in the queue; it can be briefly off while pushes/pops
+// are in flight. Always 0 if length tracking is disabled
 uint32_t pomQueueLength( PomQueueCtx *_ctx );
 
+// Enable/disable length tracking (on by default). Saves an atomic add per push/pop
+// when nothing needs `pomQueueLength`. Set before the queue is used
+int pomQueueSetTrackLength( PomQueueCtx *_ctx, bool _track );
+
+// Check whether the queue is empty, without needing the length. Only a snapshot if
+// other threads are pushing/popping
+bool pomQueueIsEmpty( PomQueueCtx *_ctx );
+
+/*******************************************
+* Bounded MPMC ring buffer
+********************************************/
+
+/*
+Fixed-capacity multi-producer/multi-consumer queue (after Dmitry Vyukov's bounded
+queue). Items live in one array of cells, each with a sequence number telling
+producers and consumers whose turn the cell is, so there's no per-item allocation
+and no need for hazard pointers. Capacity is rounded up to a power of two.
+*/
+
+typedef struct PomQueueMpmcCell PomQueueMpmcCell;
+typedef struct PomQueueMpmcCtx PomQueueMpmcCtx;
+
+struct PomQueueMpmcCell{
+    _Atomic size_t sequence;
+    void *data;
+};
+
+struct PomQueueMpmcCtx{
+    PomQueueMpmcCell *cells;
+    size_t mask;
+    // Producer and consumer positions get a cache line each
+    _Alignas( POM_CACHE_LINE_SIZE ) _Atomic size_t enqueuePos;
+    _Alignas( POM_CACHE_LINE_SIZE ) _Atomic size_t dequeuePos;
+};
+
+// Initialise the ring with room for at least `_capacity` items
+int pomQueueMpmcInit( PomQueueMpmcCtx *_ctx, size_t _capacity );
+
+// Add an item to the ring. Returns 1 if the ring is full
+int pomQueueMpmcPush( PomQueueMpmcCtx *_ctx, void * _data );
+
+// Pop an item from the ring, or NULL if it's empty
+void * pomQueueMpmcPop( PomQueueMpmcCtx *_ctx );
+
+// Free the ring. Any items still in it are dropped
+int pomQueueMpmcClear( PomQueueMpmcCtx *_ctx );
+
+/*******************************************
+* Bounded SPSC ring buffer
+********************************************/
+
+/*
+Fixed-capacity queue for exactly one producer thread and one consumer thread. Only
+needs acquire/release loads and stores, no read-modify-writes. Each side keeps a
+cached copy of the other side's index on its own cache line, so it only touches the
+other side's line when the cached copy says the ring is full/empty.
+*/
+
+typedef struct PomQueueSpscCtx PomQueueSpscCtx;
+
+struct PomQueueSpscCtx{
+    void **cells;
+    size_t mask;
+    // Producer's line
+    _Alignas( POM_CACHE_LINE_SIZE ) _Atomic size_t tail;
+    size_t cachedHead;
+    // Consumer's line
+    _Alignas( POM_CACHE_LINE_SIZE ) _Atomic size_t head;
+    size_t cachedTail;
+};
+
+// Initialise the ring with room for at least `_capacity` items
+int pomQueueSpscInit( PomQueueSpscCtx *_ctx, size_t _capacity );
+
+// Add an item to the ring. Returns 1 if the ring is full. Producer thread only
+int pomQueueSpscPush( PomQueueSpscCtx *_ctx, void * _data );
+
+// Pop an item from the ring, or NULL if it's empty. Consumer thread only
+void * pomQueueSpscPop( PomQueueSpscCtx *_ctx );
+
+// Free the ring. Any items still in it are dropped
+int pomQueueSpscClear( PomQueueSpscCtx *_ctx );
+
+/*******************************************
+* Work-stealing deque
+********************************************/
+
+/*
+Fixed-capacity Chase-Lev deque, for work-stealing schedulers. The owner thread pushes
+and pops at the bottom (LIFO) without any read-modify-writes, except when racing a
+thief for the last item. Any other thread can steal from the top (FIFO). Capacity
+is rounded up to a power of two, and pushes fail rather than grow, so the caller can
+fall back on another queue.
+*/
+
+typedef struct PomQueueWsCtx PomQueueWsCtx;
+
+struct PomQueueWsCtx{
+    void * _Atomic *cells;
+    int64_t mask;
+    // Thieves' line
+    _Alignas( POM_CACHE_LINE_SIZE ) _Atomic int64_t top;
+    // Owner's line
+    _Alignas( POM_CACHE_LINE_SIZE ) _Atomic int64_t bottom;
+};
+
+// Initialise the deque with room for at least `_capacity` items
+int pomQueueWsInit( PomQueueWsCtx *_ctx, size_t _capacity );
+
+// Add an item to the bottom of the deque. Returns 1 if it's full. Owner thread only
+int pomQueueWsPush( PomQueueWsCtx *_ctx, void * _data );
+
+// Pop the most recently pushed item, or NULL if the deque's empty. Owner thread only
+void * pomQueueWsPop( PomQueueWsCtx *_ctx );
+
+// Steal the oldest item, or NULL if the deque's empty. Any thread
+void * pomQueueWsSteal( PomQueueWsCtx *_ctx );
+
+// Free the deque. Any items still in it are dropped
+int pomQueueWsClear( PomQueueWsCtx *_ctx );
+
 #endif // QUEUE_H
\ No newline at end of file
@@ -2,6 +2,7 @@
 #define THREADPOOL_H
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "queue.h"
 #if defined(__STDC_NO_THREADS__) || defined(_WIN32) || defined(__CYGWIN__)
 #include "tinycthread.h"
@@ -11,31 +12,116 @@
 
 typedef struct PomThreadpoolCtx PomThreadpoolCtx;
 typedef struct PomThreadpoolThreadCtx PomThreadpoolThreadCtx;
+typedef struct PomThreadpoolExtCtx PomThreadpoolExtCtx;
 
 typedef struct PomThreadpoolJob PomThreadpoolJob;
+typedef struct PomThreadpoolGroup PomThreadpoolGroup;
+typedef struct PomThreadpoolFuture PomThreadpoolFuture;
 
 struct PomThreadpoolJob{
     void (*func)(void*);
     void *args;
+    // Set by `pomThreadpoolGroupScheduleJob`, leave NULL otherwise
+    PomThreadpoolGroup *group;
+};
+
+// A set of jobs that can be waited on by themselves, without waiting for everything
+// else in the pool
+struct PomThreadpoolGroup{
+    PomThreadpoolCtx *pool;
+    _Atomic uint32_t numPending;
+};
+
+// A job with a result, to be collected with `pomThreadpoolFutureGet`
+struct PomThreadpoolFuture{
+    PomThreadpoolGroup group;
+    PomThreadpoolJob job;
+    void * (*func)(void*);
+    void *args;
+    void *result;
 };
 
 
+// Each worker has its own work-stealing deque for jobs scheduled from inside jobs,
+// and steals from the others when it runs out. Jobs scheduled from other threads go
+// through the shared job queue. Any thread can schedule jobs; threads from outside
+// the pool get registered with it (for hazard pointers) the first time they do
 struct PomThreadpoolCtx{
     uint16_t numThreads;
+    // Unique to this pool, even after it's cleared
+    uint64_t id;
     PomQueueCtx * _Atomic jobQueue;
     PomThreadpoolThreadCtx *threadData;
     PomHpGlobalCtx *hpgctx;
-    cnd_t tWaitCond, tJoinCond;
+    // Threads from outside the pool that have used it
+    PomThreadpoolExtCtx * _Atomic externals;
+    // Jobs scheduled but not finished yet
+    _Atomic uint32_t numPending;
+    // Idle workers sleep on this
+    PomEventCountCtx idle;
+    // pomThreadpoolJoinAll and group waits sleep on this
+    PomEventCountCtx joiners;
 };
 
 // Initialise the threadpool
 int pomThreadpoolInit( PomThreadpoolCtx *_ctx, uint16_t _numThreads );
 
-// Block the calling thread until the current jobqueue is empty.
+// Block the calling thread until every scheduled job has finished, helping to run
+// them in the meantime. Don't call from inside a job, use a group instead
 int pomThreadpoolJoinAll( PomThreadpoolCtx *_ctx );
 
 int pomThreadpoolClear( PomThreadpoolCtx *_ctx );
 
+// Schedule a job. Safe from any thread. From inside a job, it goes on the current
+// worker's own deque
 int pomThreadpoolScheduleJob( PomThreadpoolCtx *_ctx, PomThreadpoolJob *_job );
 
+// Initialise an empty group of jobs on the pool
+int pomThreadpoolGroupInit( PomThreadpoolGroup *_group, PomThreadpoolCtx *_ctx );
+
+// Schedule a job as part of the group. A job can only be in one group at a time
+int pomThreadpoolGroupScheduleJob( PomThreadpoolGroup *_group, PomThreadpoolJob *_job );
+
+// Block until every job in the group has finished, helping to run jobs in the
+// meantime. Can be called from inside a job, to wait on jobs it scheduled
+int pomThreadpoolGroupWait( PomThreadpoolGroup *_group );
+
+// Run `_func( _args )` on the pool. The future must stay alive until it's collected
+int pomThreadpoolFutureSchedule( PomThreadpoolFuture *_future, PomThreadpoolCtx *_ctx,
+                                 void * (*_func)(void*), void *_args );
+
+// Check whether the future's result is ready, without blocking
+bool pomThreadpoolFutureIsReady( PomThreadpoolFuture *_future );
+
+// Wait for the future's result (helping to run jobs in the meantime) and return it
+void * pomThreadpoolFutureGet( PomThreadpoolFuture *_future );
+
+/*******************************************
+* Parallel loops
+********************************************/
+
+// Handles indices [_begin, _end)
+typedef void (*PomParallelForFunc)( size_t _begin, size_t _end, void *_arg );
+
+// Folds indices [_begin, _end) into `_result`, which starts out as a copy of the identity
+typedef void (*PomParallelReduceFunc)( size_t _begin, size_t _end, void *_arg, void *_result );
+
+// Folds `_other` into `_result`. `_other` covers the indices after `_result`'s, so
+// the operation only needs to be associative, not commutative
+typedef void (*PomParallelCombineFunc)( void *_result, const void *_other, void *_arg );
+
+// Run `_func` over [_begin, _end) on the pool, returning once it's all done. The range
+// is split in half until the pieces are no bigger than `_grain` (or an automatic size,
+// at least 64, if it's 0); one half is left for other workers to steal while the caller carries
+// on with the other, so the calling thread does its share. Ranges that fit in one
+// grain are just run inline
+int pomParallelFor( PomThreadpoolCtx *_ctx, size_t _begin, size_t _end, size_t _grain,
+                    PomParallelForFunc _func, void *_arg );
+
+// As `pomParallelFor`, but folding the range into `_result` (of `_resultSize` bytes)
+// with `_func`, merging the pieces with `_combine`
+int pomParallelReduce( PomThreadpoolCtx *_ctx, size_t _begin, size_t _end, size_t _grain,
+                       PomParallelReduceFunc _func, PomParallelCombineFunc _combine, void *_arg,
+                       void *_result, size_t _resultSize, const void *_identity );
+
 #endif // THREADPOOL_H
\ No newline at end of file
@@ -4,37 +4,157 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "common.h"
 
+#if defined(__unix__) || defined(__APPLE__)
+#define POM_MAP_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 //#define LOG( log, ... ) LOG_MODULE( DEBUG, hashmap, log, ##__VA_ARGS__ )
 #define LOG( log, ... )
 
-#define POM_MAP_DEFAULT_SIZE 32 // Default number of buckets in list
-#define POM_MAP_HEAP_SIZE 256   // Default size of the data heaps
+#define POM_MAP_DEFAULT_SIZE 32 // Default number of buckets in table
+#define POM_MAP_HEAP_SIZE 256   // Size of the first data heap chunk
+#define POM_MAP_HEAP_INIT_CHUNKS 8 // Starting capacity of the chunk table, which doubles as needed
+// New chunks are at least 1/POM_MAP_HEAP_GROWTH_DIV of the heap, so live chunks grow
+// geometrically. n live chunks hold at least 256 * (9/8)^(n-1) bytes, so even a
+// 2^48-byte heap takes under 300 of them, nowhere near POM_MAP_HEAP_MAX_CHUNKS
+#define POM_MAP_HEAP_GROWTH_DIV 8
+
+// Heap offsets store the chunk index in the top 16 bits and the position in the chunk below it
+#define POM_MAP_HEAP_CHUNK_SHIFT 48
+#define POM_MAP_HEAP_MAX_CHUNKS ( 1u << ( 64 - POM_MAP_HEAP_CHUNK_SHIFT ) )
+#define POM_MAP_HEAP_OFFSET( chunk, idx ) ( ( (uint64_t) (chunk) << POM_MAP_HEAP_CHUNK_SHIFT ) | (idx) )
+#define POM_MAP_HEAP_CHUNK( offset ) ( (uint32_t) ( (offset) >> POM_MAP_HEAP_CHUNK_SHIFT ) )
+#define POM_MAP_HEAP_INDEX( offset ) ( (offset) & ( ( 1ull << POM_MAP_HEAP_CHUNK_SHIFT ) - 1 ) )
+
+// Grow the table once live + deleted buckets exceed 7/8 of the table
+#define POM_MAP_MAX_LOAD_NUM 7
+#define POM_MAP_MAX_LOAD_DEN 8
+
+// Bucket control byte states. Full buckets store the low 7 bits of the key's hash
+// (the tag) in their control byte, so the top bit is only set for empty/deleted buckets
+#define POM_MAP_CTRL_EMPTY      0x80
+#define POM_MAP_CTRL_DELETED    0xFE
+#define POM_MAP_CTRL_IS_FULL( c ) ( ( (c) & 0x80 ) == 0 )
+
+// Hash is split into a bucket index (H1) and 7-bit control tag (H2)
+#define POM_MAP_H1( hash ) ( (hash) >> 7 )
+#define POM_MAP_H2( hash ) ( (uint8_t) ( (hash) & 0x7F ) )
+
+#define POM_MAP_NOT_FOUND UINT32_MAX
+
+// Pairs hashed together during a bulk load, so their buckets can be fetched while
+// the rest of the block is hashed
+#define POM_MAP_BULK_BLOCK 64
+#if defined(__GNUC__)
+#define POM_MAP_PREFETCH( addr ) __builtin_prefetch( addr )
+#else
+#define POM_MAP_PREFETCH( addr )
+#endif
+
+// Number of old buckets moved across per operation during an incremental resize.
+// Must be comfortably more than 1, so migration finishes before the table fills again
+#define POM_MAP_MIGRATE_STEP 8
+#define POM_MAP_MAX_TABLES 2
 
-typedef struct PomMapNode{
-    //const char * key;
-    //const char * value;
-    size_t keyOffset;
-    size_t valueOffset;
-    struct PomMapNode * next;
-}PomMapNode;
+/*
+Control bytes are scanned a group at a time, with each scan producing a bitmask
+of matching buckets in the group. With SSE2 a group is 16 buckets and each bucket
+gets one bit of the mask. Otherwise a group is 8 buckets packed in a uint64_t and
+each bucket gets the top bit of its byte in the mask.
+The control array has an extra group's worth of bytes at the end which mirror the
+start of the array, so a group can be loaded from any bucket without wrapping.
+*/
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define POM_MAP_GROUP_WIDTH 16
+#define POM_MAP_MASK_SHIFT 0
+#else
+#define POM_MAP_GROUP_WIDTH 8
+#define POM_MAP_MASK_SHIFT 3
+#define POM_MAP_LSBS 0x0101010101010101ull
+#define POM_MAP_MSBS 0x8080808080808080ull
+#endif
 
+typedef uint64_t PomMapGroupMask;
+
+// A single entry in the open-addressed table. Buckets are stored contiguously,
+// so a probe sequence walks sequential memory rather than a pointer chain.
+// The full hash and string lengths (excluding terminators) are cached so that
+// rehashing and heap accounting never need to re-read the key/value data
 struct PomMapBucket{
-    PomMapNode * listHead;
+    uint64_t hash;
+    uint32_t keyLen;
+    uint32_t valueLen;
+    uint64_t keyOffset;
+    uint64_t valueOffset;
 };
 
+// Each key/value pair in the heap is a record: a header followed by the key and
+// value, both NUL-terminated. Records are marked dead when their pair is
+// overwritten/removed, so compaction can walk a chunk and skip dead data
+typedef struct PomMapRecord{
+    uint32_t keyLen; // Top bit marks a dead record
+    uint32_t valueLen;
+}PomMapRecord;
+
+#define POM_MAP_RECORD_DEAD 0x80000000u
+#define POM_MAP_RECORD_SIZE( keyLen, valueLen ) ( sizeof( PomMapRecord ) + (size_t) (keyLen) + (valueLen) + 2 )
+
+// Compact once dead data makes up this percentage of the heap by default
+#define POM_MAP_COMPACT_PERCENT 50
+// Bytes of heap walked by the compaction step run automatically on each set/remove
+#define POM_MAP_COMPACT_STEP 4096
+#define POM_MAP_NO_CHUNK UINT32_MAX
+
+// Records are appended to the active chunk. Chunks never move once allocated, so
+// data pointers stay valid as the heap grows. Each new chunk is at least as big as
+// all the live data in the heap, and a fraction of the whole heap, so growth is geometric.
+// Compaction evacuates one chunk at a time, copying its live records into the
+// active chunk, then frees it. Freed chunk slots are reused by later chunks. The
+// chunk table only holds pointers to the chunks, so it can be reallocated freely
 struct PomMapDataHeap{
-    char * heap;
-    uint32_t numHeapBlocks;
+    char ** chunks;
+    size_t * chunkSizes;
+    size_t * chunkUsed;
+    size_t * chunkDead;
+    uint32_t numChunks;     // Chunk slots in use, including freed ones
+    uint32_t chunkCapacity; // Chunk slots allocated
+    uint32_t activeChunk;
     size_t heapUsed;
+    size_t heapSize;
     size_t fragmentedData;
+    // Compaction policy and progress
+    uint32_t compactPercent;
+    bool compactAuto;
+    uint32_t compactChunk;  // Chunk being evacuated, or POM_MAP_NO_CHUNK
+    size_t compactPos;
 };
 
 inline uint32_t pomNextPwrTwo( uint32_t _size );
-inline uint32_t pomMapHashFunc( PomMapCtx *_ctx, const char * key );
-inline const char * pomMapGetNodeKey( PomMapCtx * _ctx, PomMapNode * _node );
-inline const char * pomMapGetNodeValue( PomMapCtx * _ctx, PomMapNode * _node );
+inline void pomMapMul128( uint64_t *_a, uint64_t *_b );
+inline uint64_t pomMapMum( uint64_t _a, uint64_t _b );
+inline uint64_t pomMapRead8( const uint8_t *_p );
+inline uint64_t pomMapRead4( const uint8_t *_p );
+inline PomMapGroupMask pomMapGroupMatch( const uint8_t *_ctrl, uint8_t _tag );
+inline PomMapGroupMask pomMapGroupMatchEmpty( const uint8_t *_ctrl );
+inline PomMapGroupMask pomMapGroupMatchFree( const uint8_t *_ctrl );
+inline uint32_t pomMapMaskLowest( PomMapGroupMask _mask );
+inline uint32_t pomMapMaskLeading( PomMapGroupMask _mask );
+inline void pomMapSetCtrl( uint8_t *_ctrlArr, uint32_t _numBuckets, uint32_t _idx, uint8_t _ctrl );
+inline char * pomMapHeapPtr( PomMapDataHeap *_heap, uint64_t _offset );
+void pomMapHeapAddChunk( PomMapDataHeap *_heap, size_t _size );
+void pomMapHeapGrowTable( PomMapDataHeap *_heap );
+int pomMapEraseNode( PomMapCtx *_ctx, const char * _key, size_t _keyLen, uint64_t _hash );
+inline const char * pomMapGetNodeKey( PomMapCtx * _ctx, PomMapBucket * _node );
+inline const char * pomMapGetNodeValue( PomMapCtx * _ctx, PomMapBucket * _node );
 
 uint32_t pomNextPwrTwo( uint32_t _size ){
     // From bit-twiddling hacks (Stanford)
@@ -48,266 +168,874 @@ uint32_t pomNextPwrTwo( uint32_t _size ){
     return _size;
 }
 
-uint32_t pomMapHashFunc( PomMapCtx *_ctx, const char * key ){
+// Original byte-at-a-time sdbm hash, with the seed as the starting value
+uint64_t pomMapHashSdbm( const char * _key, size_t _keyLen, uint64_t _seed ){
     
     // Use sbdm hashing function
-    uint32_t hash = 0;
-    int c = *key;
+    uint32_t hash = (uint32_t) _seed;
 
-    while( c ){
+    for( size_t i = 0; i < _keyLen; i++ ){
+        uint8_t c = (uint8_t) _key[ i ];
         hash = c + (hash << 6) + (hash << 16) - hash;
-        c = *key++;
     }
 
-    // Mask off for the number of buckets we actually can index
-    return hash & ( _ctx->numBuckets - 1 );
+    return hash;
+}
+
+// Multiply two 64-bit values to 128 bits, returning the low half in `_a` and the high half in `_b`
+void pomMapMul128( uint64_t *_a, uint64_t *_b ){
+#if defined(__SIZEOF_INT128__)
+    __uint128_t r = (__uint128_t) *_a * *_b;
+    *_a = (uint64_t) r;
+    *_b = (uint64_t) ( r >> 64 );
+#else
+    uint64_t ha = *_a >> 32, hb = *_b >> 32, la = (uint32_t) *_a, lb = (uint32_t) *_b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + ( rm0 << 32 );
+    uint64_t c = t < rl;
+    uint64_t lo = t + ( rm1 << 32 );
+    c += lo < t;
+    *_a = lo;
+    *_b = rh + ( rm0 >> 32 ) + ( rm1 >> 32 ) + c;
+#endif
+}
+
+// Multiply two 64-bit values to 128 bits, and fold the halves together
+uint64_t pomMapMum( uint64_t _a, uint64_t _b ){
+    pomMapMul128( &_a, &_b );
+    return _a ^ _b;
+}
+
+uint64_t pomMapRead8( const uint8_t *_p ){
+    uint64_t v;
+    memcpy( &v, _p, sizeof( v ) );
+    return v;
+}
+
+uint64_t pomMapRead4( const uint8_t *_p ){
+    uint32_t v;
+    memcpy( &v, _p, sizeof( v ) );
+    return v;
+}
+
+// Default hash function. Word-at-a-time 64-bit hash based on wyhash (public domain)
+uint64_t pomMapHashDefault( const char * _key, size_t _keyLen, uint64_t _seed ){
+    static const uint64_t secret[ 4 ] = {
+        0xa0761d6478bd642full, 0xe7037ed1a0b428dbull,
+        0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull
+    };
+    const uint8_t *p = (const uint8_t*) _key;
+    uint64_t a, b;
+
+    _seed ^= pomMapMum( _seed ^ secret[ 0 ], secret[ 1 ] );
+    if( _keyLen <= 16 ){
+        if( _keyLen >= 4 ){
+            // Two (possibly overlapping) 4-byte reads from each end cover everything
+            size_t mid = ( _keyLen >> 3 ) << 2;
+            a = ( pomMapRead4( p ) << 32 ) | pomMapRead4( p + mid );
+            b = ( pomMapRead4( p + _keyLen - 4 ) << 32 ) | pomMapRead4( p + _keyLen - 4 - mid );
+        }
+        else if( _keyLen > 0 ){
+            a = ( (uint64_t) p[ 0 ] << 16 ) | ( (uint64_t) p[ _keyLen >> 1 ] << 8 ) | p[ _keyLen - 1 ];
+            b = 0;
+        }
+        else{
+            a = b = 0;
+        }
+    }
+    else{
+        size_t i = _keyLen;
+        if( i > 48 ){
+            // Three independent lanes for long keys
+            uint64_t seed1 = _seed, seed2 = _seed;
+            do{
+                _seed = pomMapMum( pomMapRead8( p ) ^ secret[ 1 ], pomMapRead8( p + 8 ) ^ _seed );
+                seed1 = pomMapMum( pomMapRead8( p + 16 ) ^ secret[ 2 ], pomMapRead8( p + 24 ) ^ seed1 );
+                seed2 = pomMapMum( pomMapRead8( p + 32 ) ^ secret[ 3 ], pomMapRead8( p + 40 ) ^ seed2 );
+                p += 48;
+                i -= 48;
+            }while( i > 48 );
+            _seed ^= seed1 ^ seed2;
+        }
+        while( i > 16 ){
+            _seed = pomMapMum( pomMapRead8( p ) ^ secret[ 1 ], pomMapRead8( p + 8 ) ^ _seed );
+            p += 16;
+            i -= 16;
+        }
+        a = pomMapRead8( p + i - 16 );
+        b = pomMapRead8( p + i - 8 );
+    }
+    a ^= secret[ 1 ];
+    b ^= _seed;
+    pomMapMul128( &a, &b );
+    return pomMapMum( a ^ secret[ 0 ] ^ _keyLen, b ^ secret[ 1 ] );
+}
+
+// Mix some cheap sources of entropy into a seed. Not suitable for cryptographic use
+uint64_t pomMapRandomSeed( void ){
+    static _Atomic uint64_t counter = 0;
+    uint64_t seed = (uint64_t) time( NULL );
+    seed = pomMapMum( seed ^ (uint64_t) clock(), 0x9E3779B97F4A7C15ull );
+    seed = pomMapMum( seed ^ (uint64_t) (uintptr_t) &seed, 0xD6E8FEB86659FD93ull );
+    seed = pomMapMum( seed ^ atomic_fetch_add( &counter, 1 ), 0x9E3779B97F4A7C15ull );
+    return seed;
+}
+
+#if defined(__SSE2__)
+
+// Mask of buckets in the group whose tag matches `_tag`
+PomMapGroupMask pomMapGroupMatch( const uint8_t *_ctrl, uint8_t _tag ){
+    __m128i group = _mm_loadu_si128( (const __m128i*) _ctrl );
+    __m128i match = _mm_cmpeq_epi8( group, _mm_set1_epi8( (char) _tag ) );
+    return (uint32_t) _mm_movemask_epi8( match );
+}
+
+// Mask of empty buckets in the group
+PomMapGroupMask pomMapGroupMatchEmpty( const uint8_t *_ctrl ){
+    return pomMapGroupMatch( _ctrl, POM_MAP_CTRL_EMPTY );
+}
+
+// Mask of empty or deleted buckets in the group
+PomMapGroupMask pomMapGroupMatchFree( const uint8_t *_ctrl ){
+    __m128i group = _mm_loadu_si128( (const __m128i*) _ctrl );
+    return (uint32_t) _mm_movemask_epi8( group );
+}
+
+#else
+
+uint64_t pomMapGroupLoad( const uint8_t *_ctrl ){
+    uint64_t group;
+    memcpy( &group, _ctrl, sizeof( group ) );
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    group = __builtin_bswap64( group );
+#endif
+    return group;
+}
+
+// Mask of buckets in the group whose tag matches `_tag`.
+// May give false positives for full buckets, but never for empty/deleted ones
+PomMapGroupMask pomMapGroupMatch( const uint8_t *_ctrl, uint8_t _tag ){
+    uint64_t group = pomMapGroupLoad( _ctrl ) ^ ( POM_MAP_LSBS * _tag );
+    return ( group - POM_MAP_LSBS ) & ~group & POM_MAP_MSBS;
+}
+
+// Mask of empty buckets in the group. Empty has the top bit set and bit 1 cleared
+PomMapGroupMask pomMapGroupMatchEmpty( const uint8_t *_ctrl ){
+    uint64_t group = pomMapGroupLoad( _ctrl );
+    return group & ~( group << 6 ) & POM_MAP_MSBS;
+}
+
+// Mask of empty or deleted buckets in the group
+PomMapGroupMask pomMapGroupMatchFree( const uint8_t *_ctrl ){
+    return pomMapGroupLoad( _ctrl ) & POM_MAP_MSBS;
+}
+
+#endif
+
+// Index within the group of the lowest set bucket in a (non-zero) mask
+uint32_t pomMapMaskLowest( PomMapGroupMask _mask ){
+#if defined(__GNUC__)
+    return __builtin_ctzll( _mask ) >> POM_MAP_MASK_SHIFT;
+#else
+    uint32_t bit = 0;
+    while( !( _mask & 1 ) ){
+        _mask >>= 1;
+        bit++;
+    }
+    return bit >> POM_MAP_MASK_SHIFT;
+#endif
+}
+
+// Number of unset buckets at the top of a (non-zero) mask
+uint32_t pomMapMaskLeading( PomMapGroupMask _mask ){
+    const uint32_t unusedBits = 64 - ( POM_MAP_GROUP_WIDTH << POM_MAP_MASK_SHIFT );
+#if defined(__GNUC__)
+    uint32_t bit = __builtin_clzll( _mask );
+#else
+    uint32_t bit = 0;
+    while( !( _mask & ( 1ull << 63 ) ) ){
+        _mask <<= 1;
+        bit++;
+    }
+#endif
+    return ( bit - unusedBits ) >> POM_MAP_MASK_SHIFT;
+}
+
+// Set a bucket's control byte, keeping the mirrored group at the end up to date
+void pomMapSetCtrl( uint8_t *_ctrlArr, uint32_t _numBuckets, uint32_t _idx, uint8_t _ctrl ){
+    _ctrlArr[ _idx ] = _ctrl;
+    if( _idx < POM_MAP_GROUP_WIDTH ){
+        _ctrlArr[ _numBuckets + _idx ] = _ctrl;
+    }
+}
+
+// Mark a full bucket as removed. Returns 1 if a tombstone had to be left, 0 otherwise
+int pomMapEraseCtrl( uint8_t *_ctrlArr, uint32_t _numBuckets, uint32_t _idx ){
+    // If there's no window of a full group of non-empty buckets around this one then
+    // no probe could have passed over it, so it can be marked empty rather than
+    // leaving a tombstone
+    uint32_t idxBefore = ( _idx - POM_MAP_GROUP_WIDTH ) & ( _numBuckets - 1 );
+    PomMapGroupMask emptyAfter = pomMapGroupMatchEmpty( _ctrlArr + _idx );
+    PomMapGroupMask emptyBefore = pomMapGroupMatchEmpty( _ctrlArr + idxBefore );
+    if( emptyAfter && emptyBefore &&
+        pomMapMaskLowest( emptyAfter ) + pomMapMaskLeading( emptyBefore ) < POM_MAP_GROUP_WIDTH ){
+        pomMapSetCtrl( _ctrlArr, _numBuckets, _idx, POM_MAP_CTRL_EMPTY );
+        return 0;
+    }
+    pomMapSetCtrl( _ctrlArr, _numBuckets, _idx, POM_MAP_CTRL_DELETED );
+    return 1;
+}
+
+// Find the first empty or deleted bucket along the probe sequence for `_hash`
+uint32_t pomMapFindFree( const uint8_t *_ctrlArr, uint32_t _numBuckets, uint64_t _hash ){
+    uint32_t mask = _numBuckets - 1;
+    uint32_t pos = POM_MAP_H1( _hash ) & mask;
+    uint32_t stride = 0;
+
+    // Table is never full, so we're guaranteed to find a free bucket
+    while( 1 ){
+        PomMapGroupMask freeMask = pomMapGroupMatchFree( _ctrlArr + pos );
+        if( freeMask ){
+            return ( pos + pomMapMaskLowest( freeMask ) ) & mask;
+        }
+        // Triangular probing over groups visits every group for power-of-2 sizes
+        stride += POM_MAP_GROUP_WIDTH;
+        pos = ( pos + stride ) & mask;
+    }
+}
+
+// Work out the table size to grow to when inserting a new entry would exceed the
+// maximum load. Returns 0 if there's still space
+uint32_t pomMapGrowSize( uint32_t _numBuckets, uint32_t _numNodes, uint32_t _numTombstones ){
+    if( ( _numNodes + _numTombstones + 1 ) * POM_MAP_MAX_LOAD_DEN <= _numBuckets * POM_MAP_MAX_LOAD_NUM ){
+        return 0;
+    }
+    // Table is getting full. If it's mostly tombstones then just rebuild at the
+    // current size, otherwise double it
+    if( ( _numNodes + 1 ) * 2 > _numBuckets ){
+        return _numBuckets << 1;
+    }
+    return _numBuckets;
+}
+
+// Allocate a control array for `_size` buckets with all buckets marked empty
+uint8_t * pomMapAllocCtrl( uint32_t _size ){
+    uint8_t * ctrl = (uint8_t*) malloc( _size + POM_MAP_GROUP_WIDTH );
+    memset( ctrl, POM_MAP_CTRL_EMPTY, _size + POM_MAP_GROUP_WIDTH );
+    return ctrl;
 }
 
-const char * pomMapGetNodeKey( PomMapCtx * _ctx, PomMapNode * _node ){
-    return (const char *) (_ctx->dataHeap->heap + _node->keyOffset);
+const char * pomMapGetNodeKey( PomMapCtx * _ctx, PomMapBucket * _node ){
+    return pomMapHeapPtr( _ctx->dataHeap, _node->keyOffset );
 }
 
-const char * pomMapGetNodeValue( PomMapCtx * _ctx, PomMapNode * _node ){
-    return (const char *) (_ctx->dataHeap->heap + _node->valueOffset);
+const char * pomMapGetNodeValue( PomMapCtx * _ctx, PomMapBucket * _node ){
+    return pomMapHeapPtr( _ctx->dataHeap, _node->valueOffset );
 }
 
 // Initialise the map with optional starting size suggestion
 int pomMapInit( PomMapCtx *_ctx, uint32_t _size ){
+    return pomMapInitHash( _ctx, _size, NULL, 0 );
+}
+
+// Initialise the map with a specific hash function and seed
+int pomMapInitHash( PomMapCtx *_ctx, uint32_t _size, PomMapHashFunc _hashFunc, uint64_t _seed ){
     if( _size == 0 ){
         _size = POM_MAP_DEFAULT_SIZE;
     }
 
-    // Round size to next power of 2
+    // Round size to next power of 2, and make sure there's at least one full group
     _size = pomNextPwrTwo( _size );
+    if( _size < POM_MAP_GROUP_WIDTH ){
+        _size = POM_MAP_GROUP_WIDTH;
+    }
     
-    // Allocate space for buckets, and zero the memory (set all list heads to NULL)
-    _ctx->buckets = (PomMapBucket*) calloc( _size, sizeof( PomMapBucket ) );
-    _ctx->dataHeap = (PomMapDataHeap*) calloc( _size, sizeof( PomMapDataHeap ) );
-    _ctx->dataHeap->heap = (char*) calloc( POM_MAP_HEAP_SIZE, sizeof( char ) );
-    _ctx->dataHeap->numHeapBlocks = 1;
-    _ctx->dataHeap->heapUsed = 0;
-    _ctx->dataHeap->fragmentedData = 0;
+    // Allocate space for buckets, and mark all buckets empty
+    _ctx->buckets = (PomMapBucket*) malloc( _size * sizeof( PomMapBucket ) );
+    _ctx->ctrl = pomMapAllocCtrl( _size );
+    _ctx->dataHeap = (PomMapDataHeap*) calloc( 1, sizeof( PomMapDataHeap ) );
+    _ctx->dataHeap->compactPercent = POM_MAP_COMPACT_PERCENT;
+    _ctx->dataHeap->compactAuto = false;
+    _ctx->dataHeap->compactChunk = POM_MAP_NO_CHUNK;
+    pomMapHeapAddChunk( _ctx->dataHeap, POM_MAP_HEAP_SIZE );
     _ctx->initialised = true;
     _ctx->numBuckets = _size;
     _ctx->numNodes = 0;
+    _ctx->numTombstones = 0;
+    _ctx->hashFunc = _hashFunc ? _hashFunc : pomMapHashDefault;
+    _ctx->seed = _seed;
+    _ctx->oldBuckets = NULL;
+    _ctx->oldCtrl = NULL;
+    _ctx->oldNumBuckets = 0;
+    _ctx->oldNumNodes = 0;
+    _ctx->migrateIdx = 0;
+    _ctx->incrementalResize = false;
     LOG( "Map initialised with heap size %i", 1 );
 
     return 0;
 }
 
 
-int pomMapAddData( PomMapCtx *_ctx, const char **_key, const char **_value ){
-    // TODO add error handling in this function
-
-    size_t curSize = _ctx->dataHeap->numHeapBlocks * POM_MAP_HEAP_SIZE;
-    size_t curUsed = _ctx->dataHeap->heapUsed;
-    size_t keyLen = strlen( *_key ) + 1;
-    size_t valLen = strlen( *_value ) + 1;
-    size_t newDataLen = keyLen + valLen;
-    size_t newHeapUsed = curUsed + newDataLen;
-
-    //LOG( "Adding data %s:%s to heap", *_key, *_value );
-
-    if( newHeapUsed > curSize ){
-        // Check if it's worth optimising to remove fragmented data
-        if( _ctx->dataHeap->fragmentedData >= newDataLen ){
-            LOG( "New pair can fit in fragmented data, so optimising" );
-            pomMapOptimise( _ctx );
-            return pomMapAddData( _ctx, _key, _value );
-        }
-        // Increase block size
-        _ctx->dataHeap->numHeapBlocks++;
-        size_t newHeapSize = _ctx->dataHeap->numHeapBlocks * POM_MAP_HEAP_SIZE;
-        LOG( "Increasing heap size to %zu", newHeapSize );
-        // TODO check for error on realloc
-        _ctx->dataHeap->heap = realloc( _ctx->dataHeap->heap, newHeapSize );
-        // Call recursively in case the new key/value pair exceeds block size
-        // TODO change this from recursive to just checking for that here
-         return pomMapAddData( _ctx, _key, _value );
-        
-        // Data is all in heap, but address may have changed so node key/value pointers are invalid. Need to update.
-        // (or zero the memory and re-allocate everything)
-    }
-    // From here we have enough space in the heap for the new data
-    char * keyLoc = _ctx->dataHeap->heap + curUsed;
-    memcpy( keyLoc, *_key, keyLen );
-    curUsed += keyLen;
-    char * valLoc = _ctx->dataHeap->heap + curUsed;
-    memcpy( valLoc, *_value, valLen );
-    _ctx->dataHeap->heapUsed = curUsed + valLen;
-
-    // Return the new data locations in the original params
-    *_key = keyLoc;
-    *_value = valLoc;
+char * pomMapHeapPtr( PomMapDataHeap *_heap, uint64_t _offset ){
+    return _heap->chunks[ POM_MAP_HEAP_CHUNK( _offset ) ] + POM_MAP_HEAP_INDEX( _offset );
+}
 
-    return 0;
+// Double the number of chunk slots
+void pomMapHeapGrowTable( PomMapDataHeap *_heap ){
+    uint32_t capacity = _heap->chunkCapacity ? _heap->chunkCapacity * 2 : POM_MAP_HEAP_INIT_CHUNKS;
+    LOG( "Growing heap chunk table to %u slots", capacity );
+    _heap->chunks = (char**) realloc( _heap->chunks, capacity * sizeof( char* ) );
+    _heap->chunkSizes = (size_t*) realloc( _heap->chunkSizes, capacity * sizeof( size_t ) );
+    _heap->chunkUsed = (size_t*) realloc( _heap->chunkUsed, capacity * sizeof( size_t ) );
+    _heap->chunkDead = (size_t*) realloc( _heap->chunkDead, capacity * sizeof( size_t ) );
+    _heap->chunkCapacity = capacity;
+}
+
+// Add a chunk with room for at least `_size` bytes, and make it the active chunk
+void pomMapHeapAddChunk( PomMapDataHeap *_heap, size_t _size ){
+    // Sized from the live data, so growth is geometric without compaction churn
+    // inflating the heap
+    size_t liveData = _heap->heapUsed - _heap->fragmentedData;
+    size_t chunkSize = liveData > POM_MAP_HEAP_SIZE ? liveData : POM_MAP_HEAP_SIZE;
+    if( chunkSize < _heap->heapSize / POM_MAP_HEAP_GROWTH_DIV ){
+        // Dead data that hasn't been compacted away still counts, so chunks can't pile up
+        chunkSize = _heap->heapSize / POM_MAP_HEAP_GROWTH_DIV;
+    }
+    if( chunkSize < _size ){
+        chunkSize = _size;
+    }
+    uint32_t chunk = 0;
+    while( chunk < _heap->numChunks && _heap->chunks[ chunk ] ){
+        chunk++;
+    }
+    if( chunk == _heap->numChunks ){
+        if( _heap->numChunks == _heap->chunkCapacity ){
+            pomMapHeapGrowTable( _heap );
+        }
+        _heap->numChunks++;
+    }
+    LOG( "Adding heap chunk %u of size %zu", chunk, chunkSize );
+    _heap->chunks[ chunk ] = (char*) malloc( chunkSize );
+    _heap->chunkSizes[ chunk ] = chunkSize;
+    _heap->chunkUsed[ chunk ] = 0;
+    _heap->chunkDead[ chunk ] = 0;
+    _heap->heapSize += chunkSize;
+    _heap->activeChunk = chunk;
 }
 
-PomMapNode * pomMapCreateNode( PomMapCtx *_ctx, const char *_key, const char *_value ){
-    pomMapAddData( _ctx, &_key, &_value );
-    // Need to get the key/value offsets into the heap
-    size_t keyOffset = _key - _ctx->dataHeap->heap;
-    size_t valueOffset = _value - _ctx->dataHeap->heap;
+// Reserve `_size` contiguous bytes at the end of the active chunk, returning their offset
+uint64_t pomMapHeapAlloc( PomMapDataHeap *_heap, size_t _size ){
+    uint32_t chunk = _heap->activeChunk;
+    if( _heap->chunkUsed[ chunk ] + _size > _heap->chunkSizes[ chunk ] ){
+        // Whatever's left at the end of the old chunk goes unused
+        pomMapHeapAddChunk( _heap, _size );
+        chunk = _heap->activeChunk;
+    }
+    uint64_t offset = POM_MAP_HEAP_OFFSET( chunk, _heap->chunkUsed[ chunk ] );
+    _heap->chunkUsed[ chunk ] += _size;
+    _heap->heapUsed += _size;
+    return offset;
+}
 
-    // Now create the new node
-    PomMapNode * newNode = (PomMapNode*) malloc( sizeof( PomMapNode ) );
-    //newNode->key = _key;
-    //newNode->value = _value;
-    newNode->keyOffset = keyOffset;
-    newNode->valueOffset = valueOffset;
-    newNode->next = NULL;
-    
-    return newNode;
-}
-
-// Return a double pointer to either a true node, or a reference to
-// a node (ie `next` ptr in linked list)
-PomMapNode ** pomMapGetNodeRef( PomMapCtx *_ctx, const char *_key ){
-    uint32_t idx = pomMapHashFunc( _ctx, _key );
-    PomMapBucket * bucket = &_ctx->buckets[ idx ];
-    PomMapNode ** node = &(bucket->listHead);
-    while( *node ){
-        const char * nodeKeyStr = pomMapGetNodeKey( _ctx, *node );
-        if( strcmp( _key, nodeKeyStr ) == 0 ){
-            return node;
-            break;
+void pomMapHeapFreeChunk( PomMapDataHeap *_heap, uint32_t _chunk ){
+    LOG( "Freeing heap chunk %u", _chunk );
+    free( _heap->chunks[ _chunk ] );
+    _heap->chunks[ _chunk ] = NULL;
+    _heap->heapUsed -= _heap->chunkUsed[ _chunk ];
+    _heap->heapSize -= _heap->chunkSizes[ _chunk ];
+    _heap->fragmentedData -= _heap->chunkDead[ _chunk ];
+    _heap->chunkSizes[ _chunk ] = 0;
+    _heap->chunkUsed[ _chunk ] = 0;
+    _heap->chunkDead[ _chunk ] = 0;
+}
+
+// Write a record for the pair at `_dst`, with lengths excluding the terminators
+void pomMapWriteRecord( char *_dst, const char *_key, size_t _keyLen, const char *_value, size_t _valueLen ){
+    PomMapRecord record = { (uint32_t) _keyLen, (uint32_t) _valueLen };
+    memcpy( _dst, &record, sizeof( PomMapRecord ) );
+    char * keyLoc = _dst + sizeof( PomMapRecord );
+    memcpy( keyLoc, _key, _keyLen );
+    keyLoc[ _keyLen ] = '\0';
+    char * valLoc = keyLoc + _keyLen + 1;
+    memcpy( valLoc, _value, _valueLen );
+    valLoc[ _valueLen ] = '\0';
+}
+
+// Copy a key/value pair into the data heap and point the bucket at it. Lengths
+// exclude the terminators
+void pomMapSetNodeData( PomMapCtx *_ctx, PomMapBucket *_node, const char *_key, size_t _keyLen,
+                        const char *_value, size_t _valueLen ){
+    uint64_t offset = pomMapHeapAlloc( _ctx->dataHeap, POM_MAP_RECORD_SIZE( _keyLen, _valueLen ) );
+    pomMapWriteRecord( pomMapHeapPtr( _ctx->dataHeap, offset ), _key, _keyLen, _value, _valueLen );
+    _node->keyOffset = offset + sizeof( PomMapRecord );
+    _node->valueOffset = _node->keyOffset + _keyLen + 1;
+    _node->keyLen = (uint32_t) _keyLen;
+    _node->valueLen = (uint32_t) _valueLen;
+}
+
+// Mark a bucket's current key/value data as no longer used
+void pomMapFragmentNodeData( PomMapCtx *_ctx, PomMapBucket *_node ){
+    PomMapDataHeap *heap = _ctx->dataHeap;
+    char * recordLoc = pomMapHeapPtr( heap, _node->keyOffset ) - sizeof( PomMapRecord );
+    PomMapRecord record;
+    memcpy( &record, recordLoc, sizeof( PomMapRecord ) );
+    record.keyLen |= POM_MAP_RECORD_DEAD;
+    memcpy( recordLoc, &record, sizeof( PomMapRecord ) );
+
+    size_t recordSize = POM_MAP_RECORD_SIZE( _node->keyLen, _node->valueLen );
+    heap->chunkDead[ POM_MAP_HEAP_CHUNK( _node->keyOffset ) ] += recordSize;
+    heap->fragmentedData += recordSize;
+}
+
+// Get the buckets/control bytes of the current table (0) or the table being
+// migrated from (1). Returns the number of buckets, or 0 if the table doesn't exist
+uint32_t pomMapGetTable( PomMapCtx *_ctx, int _table, PomMapBucket **_buckets, uint8_t **_ctrlArr ){
+    if( _table == 0 ){
+        *_buckets = _ctx->buckets;
+        *_ctrlArr = _ctx->ctrl;
+        return _ctx->numBuckets;
+    }
+    *_buckets = _ctx->oldBuckets;
+    *_ctrlArr = _ctx->oldCtrl;
+    return _ctx->oldBuckets ? _ctx->oldNumBuckets : 0;
+}
+
+// Find the bucket holding `_key` in the given table, returning POM_MAP_NOT_FOUND if it doesn't exist
+uint32_t pomMapFindInTable( PomMapCtx *_ctx, PomMapBucket *_buckets, const uint8_t *_ctrlArr, uint32_t _numBuckets,
+                            const char *_key, size_t _keyLen, uint64_t _hash ){
+    uint8_t tag = POM_MAP_H2( _hash );
+    uint32_t mask = _numBuckets - 1;
+    uint32_t pos = POM_MAP_H1( _hash ) & mask;
+    uint32_t stride = 0;
+
+    while( 1 ){
+        // Only buckets with a matching tag need their key compared
+        PomMapGroupMask match = pomMapGroupMatch( _ctrlArr + pos, tag );
+        while( match ){
+            uint32_t idx = ( pos + pomMapMaskLowest( match ) ) & mask;
+            PomMapBucket * node = &_buckets[ idx ];
+            // Check the cached hash and length before touching the heap
+            if( node->hash == _hash && node->keyLen == _keyLen &&
+                memcmp( _key, pomMapGetNodeKey( _ctx, node ), _keyLen ) == 0 ){
+                return idx;
+            }
+            match &= match - 1;
+        }
+        // Any empty bucket in the group ends the probe sequence
+        if( pomMapGroupMatchEmpty( _ctrlArr + pos ) ){
+            return POM_MAP_NOT_FOUND;
+        }
+        stride += POM_MAP_GROUP_WIDTH;
+        pos = ( pos + stride ) & mask;
+    }
+}
+
+// Find the bucket holding `_key` in the current table, or the first free bucket on
+// its probe sequence if it isn't there. Keys are only compared on tag hits
+uint32_t pomMapFindOrFree( PomMapCtx *_ctx, const char *_key, size_t _keyLen, uint64_t _hash, bool *_found ){
+    uint8_t tag = POM_MAP_H2( _hash );
+    uint32_t mask = _ctx->numBuckets - 1;
+    uint32_t pos = POM_MAP_H1( _hash ) & mask;
+    uint32_t stride = 0;
+    uint32_t freeIdx = POM_MAP_NOT_FOUND;
+
+    while( 1 ){
+        PomMapGroupMask match = pomMapGroupMatch( _ctx->ctrl + pos, tag );
+        while( match ){
+            uint32_t idx = ( pos + pomMapMaskLowest( match ) ) & mask;
+            PomMapBucket * node = &_ctx->buckets[ idx ];
+            if( node->hash == _hash && node->keyLen == _keyLen &&
+                memcmp( _key, pomMapGetNodeKey( _ctx, node ), _keyLen ) == 0 ){
+                *_found = true;
+                return idx;
+            }
+            match &= match - 1;
+        }
+        if( freeIdx == POM_MAP_NOT_FOUND ){
+            PomMapGroupMask freeMask = pomMapGroupMatchFree( _ctx->ctrl + pos );
+            if( freeMask ){
+                freeIdx = ( pos + pomMapMaskLowest( freeMask ) ) & mask;
+            }
+        }
+        // Any empty bucket in the group ends the probe sequence
+        if( pomMapGroupMatchEmpty( _ctx->ctrl + pos ) ){
+            *_found = false;
+            return freeIdx;
+        }
+        stride += POM_MAP_GROUP_WIDTH;
+        pos = ( pos + stride ) & mask;
+    }
+}
+
+// Find the node for `_key`, checking the table being migrated from if there is one
+PomMapBucket * pomMapFindNode( PomMapCtx *_ctx, const char *_key, size_t _keyLen, uint64_t _hash ){
+    uint32_t idx = pomMapFindInTable( _ctx, _ctx->buckets, _ctx->ctrl, _ctx->numBuckets, _key, _keyLen, _hash );
+    if( idx != POM_MAP_NOT_FOUND ){
+        return &_ctx->buckets[ idx ];
+    }
+    if( _ctx->oldBuckets ){
+        idx = pomMapFindInTable( _ctx, _ctx->oldBuckets, _ctx->oldCtrl, _ctx->oldNumBuckets, _key, _keyLen, _hash );
+        if( idx != POM_MAP_NOT_FOUND ){
+            return &_ctx->oldBuckets[ idx ];
+        }
+    }
+    return NULL;
+}
+
+// Move a full bucket from the old table into the current one. The current table
+// can't already hold the key
+void pomMapMigrateBucket( PomMapCtx *_ctx, uint32_t _idx ){
+    PomMapBucket * oldNode = &_ctx->oldBuckets[ _idx ];
+    uint32_t idx = pomMapFindFree( _ctx->ctrl, _ctx->numBuckets, oldNode->hash );
+    if( _ctx->ctrl[ idx ] == POM_MAP_CTRL_DELETED ){
+        _ctx->numTombstones--;
+    }
+    pomMapSetCtrl( _ctx->ctrl, _ctx->numBuckets, idx, POM_MAP_H2( oldNode->hash ) );
+    _ctx->buckets[ idx ] = *oldNode;
+    // Leave a tombstone so lookups in the old table don't find the stale copy,
+    // but can still probe past it
+    pomMapSetCtrl( _ctx->oldCtrl, _ctx->oldNumBuckets, _idx, POM_MAP_CTRL_DELETED );
+    _ctx->oldNumNodes--;
+}
+
+// Migrate up to `_numBuckets` buckets from the old table, freeing it once it's empty
+void pomMapMigrateStep( PomMapCtx *_ctx, uint32_t _numBuckets ){
+    if( !_ctx->oldBuckets ){
+        return;
+    }
+    // Clamp to the end of the old table without overflowing `migrateIdx + _numBuckets`
+    uint32_t remaining = _ctx->oldNumBuckets - _ctx->migrateIdx;
+    uint32_t end = ( _numBuckets >= remaining ) ? _ctx->oldNumBuckets : _ctx->migrateIdx + _numBuckets;
+    for( uint32_t i = _ctx->migrateIdx; i < end; i++ ){
+        if( POM_MAP_CTRL_IS_FULL( _ctx->oldCtrl[ i ] ) ){
+            pomMapMigrateBucket( _ctx, i );
+        }
+    }
+    _ctx->migrateIdx = end;
+    if( end == _ctx->oldNumBuckets ){
+        if( _ctx->oldNumNodes != 0 ){
+            LOG( "Finished migration with %i nodes left behind", _ctx->oldNumNodes );
+        }
+        LOG( "Finished migrating %i buckets", _ctx->oldNumBuckets );
+        free( _ctx->oldBuckets );
+        free( _ctx->oldCtrl );
+        _ctx->oldBuckets = NULL;
+        _ctx->oldCtrl = NULL;
+        _ctx->oldNumBuckets = 0;
+        _ctx->oldNumNodes = 0;
+        _ctx->migrateIdx = 0;
+    }
+}
+
+// Rebuild the table with `_size` buckets. Also clears out any tombstones.
+// In incremental mode this only allocates the new table, and the entries are
+// moved over a few buckets at a time by later operations
+int pomMapRehash( PomMapCtx *_ctx, uint32_t _size ){
+    // Only one migration can be in flight at once
+    pomMapMigrateStep( _ctx, UINT32_MAX );
+
+    _ctx->oldBuckets = _ctx->buckets;
+    _ctx->oldCtrl = _ctx->ctrl;
+    _ctx->oldNumBuckets = _ctx->numBuckets;
+    _ctx->oldNumNodes = _ctx->numNodes;
+    _ctx->migrateIdx = 0;
+
+    _ctx->buckets = (PomMapBucket*) malloc( _size * sizeof( PomMapBucket ) );
+    _ctx->ctrl = pomMapAllocCtrl( _size );
+    _ctx->numBuckets = _size;
+    _ctx->numTombstones = 0;
+
+    if( !_ctx->incrementalResize ){
+        pomMapMigrateStep( _ctx, UINT32_MAX );
+    }
+    return 0;
+}
+
+// Add a new key/value pair to the table. The key must not already exist in the map.
+// Returns the new bucket
+PomMapBucket * pomMapInsertNode( PomMapCtx *_ctx, uint64_t _hash, const char *_key, size_t _keyLen,
+                                 const char *_value, size_t _valueLen ){
+    uint32_t insertIdx = pomMapFindFree( _ctx->ctrl, _ctx->numBuckets, _hash );
+    if( _ctx->ctrl[ insertIdx ] == POM_MAP_CTRL_EMPTY ){
+        // Load only counts nodes in the current table
+        uint32_t tableNodes = _ctx->numNodes - _ctx->oldNumNodes;
+        uint32_t newSize = pomMapGrowSize( _ctx->numBuckets, tableNodes, _ctx->numTombstones );
+        if( newSize ){
+            pomMapRehash( _ctx, newSize );
+            insertIdx = pomMapFindFree( _ctx->ctrl, _ctx->numBuckets, _hash );
         }
-        node = &(*node)->next;
     }
-    return node;
+
+    if( _ctx->ctrl[ insertIdx ] == POM_MAP_CTRL_DELETED ){
+        _ctx->numTombstones--;
+    }
+    PomMapBucket * bucket = &_ctx->buckets[ insertIdx ];
+    bucket->hash = _hash;
+    pomMapSetNodeData( _ctx, bucket, _key, _keyLen, _value, _valueLen );
+    pomMapSetCtrl( _ctx->ctrl, _ctx->numBuckets, insertIdx, POM_MAP_H2( _hash ) );
+    _ctx->numNodes++;
+
+    return bucket;
 }
 
 // Get a value if it exists, return `_default` otherwise
 const char* pomMapGet( PomMapCtx *_ctx, const char * _key, const char * _default ){
+    return pomMapGetN( _ctx, _key, strlen( _key ), _default );
+}
 
-    PomMapNode ** node = pomMapGetNodeRef( _ctx, _key );
-    if( !*node ){
+const char* pomMapGetN( PomMapCtx *_ctx, const char * _key, size_t _keyLen, const char * _default ){
+    uint64_t hash = _ctx->hashFunc( _key, _keyLen, _ctx->seed );
+    PomMapBucket * node = pomMapFindNode( _ctx, _key, _keyLen, hash );
+    if( !node ){
         // Node was not found
         return _default;
     }
     // Node was found, return its value
-    return pomMapGetNodeValue( _ctx, *node );
+    return pomMapGetNodeValue( _ctx, node );
 }
 
 // Set a key to a given value
 const char* pomMapSet( PomMapCtx *_ctx, const char * _key, const char * _value ){
-    PomMapNode ** node = pomMapGetNodeRef( _ctx, _key );
-    if( *node ){
-        // Node exists, so set data
-        LOG( "Setting existing key %s", _key );
-        // Get node's current memory footprint and add it to fragmented data record
-        size_t currKeyLen = strlen( pomMapGetNodeKey( _ctx, *node ) ) + 1;
-        size_t currValLen = strlen( pomMapGetNodeValue( _ctx, *node ) ) + 1;
-        _ctx->dataHeap->fragmentedData += currKeyLen + currValLen;
-
-        // Add new key/value pair to list
-        pomMapAddData( _ctx, &_key, &_value );
-        size_t keyOffset = _key - _ctx->dataHeap->heap;
-        size_t valueOffset = _value - _ctx->dataHeap->heap;
-        (*node)->keyOffset = keyOffset;
-        (*node)->valueOffset = valueOffset;
-        //(*node)->key = _key;
-        //(*node)->value = _value;
-        return _value;
-    }
-
-    // Node doesn't exist so needs to be added
-    PomMapNode * newNode = pomMapCreateNode( _ctx, _key, _value );
-    // Node points to the `next` ptr in the linked list of a given bucket
-    *node = newNode;
-    _ctx->numNodes++;
+    return pomMapSetN( _ctx, _key, strlen( _key ), _value, strlen( _value ) );
+}
 
-    // Check if we need to resize
-    if( _ctx->numNodes > _ctx->numBuckets ){
-        // Resize the bucket array
-        uint32_t newSize = _ctx->numBuckets << 1;
-        pomMapResize( _ctx, newSize );
+bool pomMapGetView( PomMapCtx *_ctx, const char * _key, size_t _keyLen, PomMapStrView *_value ){
+    uint64_t hash = _ctx->hashFunc( _key, _keyLen, _ctx->seed );
+    PomMapBucket * node = pomMapFindNode( _ctx, _key, _keyLen, hash );
+    if( !node ){
+        return false;
     }
+    _value->str = pomMapGetNodeValue( _ctx, node );
+    _value->len = node->valueLen;
+    return true;
+}
 
-    // Resize may have shuffled data around, so return a valid value pointer
-    return pomMapGetNodeValue( _ctx, newNode );
+const char* pomMapSetN( PomMapCtx *_ctx, const char * _key, size_t _keyLen, const char * _value, size_t _valueLen ){
+    uint64_t hash = _ctx->hashFunc( _key, _keyLen, _ctx->seed );
+    PomMapBucket * node = pomMapFindNode( _ctx, _key, _keyLen, hash );
+    if( node ){
+        // Node exists, so set data
+        LOG( "Setting existing key %.*s", (int) _keyLen, _key );
+        // Add node's current memory footprint to fragmented data record, and
+        // add the new key/value pair to the heap
+        pomMapFragmentNodeData( _ctx, node );
+        pomMapSetNodeData( _ctx, node, _key, _keyLen, _value, _valueLen );
+    }
+    else{
+        // Node doesn't exist so needs to be added
+        node = pomMapInsertNode( _ctx, hash, _key, _keyLen, _value, _valueLen );
+    }
+    if( _ctx->dataHeap->compactAuto ){
+        pomMapCompactStep( _ctx, POM_MAP_COMPACT_STEP );
+    }
+    const char * value = pomMapGetNodeValue( _ctx, node );
+    pomMapMigrateStep( _ctx, POM_MAP_MIGRATE_STEP );
+    return value;
 }
 
 // Get a key if it exists, otherwise add a new node with value `_default`
 const char* pomMapGetSet( PomMapCtx *_ctx, const char * _key, const char * _default ){
-    PomMapNode ** node = pomMapGetNodeRef( _ctx, _key );
-    if( *node ){
+    return pomMapGetSetN( _ctx, _key, strlen( _key ), _default, strlen( _default ) );
+}
+
+const char* pomMapGetSetN( PomMapCtx *_ctx, const char * _key, size_t _keyLen,
+                           const char * _default, size_t _defaultLen ){
+    uint64_t hash = _ctx->hashFunc( _key, _keyLen, _ctx->seed );
+    PomMapBucket * node = pomMapFindNode( _ctx, _key, _keyLen, hash );
+    if( node ){
         // Node exists, so return data
-        return pomMapGetNodeValue( _ctx, *node );
+        return pomMapGetNodeValue( _ctx, node );
     }
 
     // Node doesn't exist so needs to be added
-    PomMapNode * newNode = pomMapCreateNode( _ctx, _key, _default );
-    // Node points to the `next` ptr in the linked list of a given bucket
-    *node = newNode;
-    _ctx->numNodes++;
-
-    // Check if we need to resize
-    if( _ctx->numNodes > _ctx->numBuckets ){
-        // Resize the bucket array
-        uint32_t newSize = _ctx->numBuckets << 1;
-        pomMapResize( _ctx, newSize );
+    node = pomMapInsertNode( _ctx, hash, _key, _keyLen, _default, _defaultLen );
+    if( _ctx->dataHeap->compactAuto ){
+        pomMapCompactStep( _ctx, POM_MAP_COMPACT_STEP );
     }
-
-    // Resize may have shuffled data around, so return a valid value pointer
-    return pomMapGetNodeValue( _ctx, newNode );
+    const char * value = pomMapGetNodeValue( _ctx, node );
+    pomMapMigrateStep( _ctx, POM_MAP_MIGRATE_STEP );
+    return value;
 }
 
 
 // Remove a key
 int pomMapRemove( PomMapCtx *_ctx, const char * _key ){
-    PomMapNode ** node = pomMapGetNodeRef( _ctx, _key );
-    if( !*node ){
+    return pomMapRemoveN( _ctx, _key, strlen( _key ) );
+}
+
+int pomMapRemoveN( PomMapCtx *_ctx, const char * _key, size_t _keyLen ){
+    uint64_t hash = _ctx->hashFunc( _key, _keyLen, _ctx->seed );
+    if( pomMapEraseNode( _ctx, _key, _keyLen, hash ) ){
         // Node doesn't exist so exit
         return 1;
     }
-    LOG( "Removing node %s", _key );
-    size_t currKeyLen = strlen( pomMapGetNodeKey( _ctx, *node ) ) + 1;
-    size_t currValLen = strlen( pomMapGetNodeValue( _ctx, *node ) ) + 1;
-    _ctx->dataHeap->fragmentedData += currKeyLen + currValLen;
-    PomMapNode **nodeToDel = node;
-    *node = (*node)->next;
-    free( *nodeToDel );
+    pomMapMigrateStep( _ctx, POM_MAP_MIGRATE_STEP );
+    if( _ctx->dataHeap->compactAuto ){
+        pomMapCompactStep( _ctx, POM_MAP_COMPACT_STEP );
+    }
+    return 0;
+}
+
+// Remove a key's bucket and mark its data dead, without moving any other
+// entries. Returns 1 if the key doesn't exist
+int pomMapEraseNode( PomMapCtx *_ctx, const char * _key, size_t _keyLen, uint64_t _hash ){
+    uint32_t idx = pomMapFindInTable( _ctx, _ctx->buckets, _ctx->ctrl, _ctx->numBuckets, _key, _keyLen, _hash );
+    if( idx != POM_MAP_NOT_FOUND ){
+        LOG( "Removing node %.*s", (int) _keyLen, _key );
+        pomMapFragmentNodeData( _ctx, &_ctx->buckets[ idx ] );
+        _ctx->numTombstones += pomMapEraseCtrl( _ctx->ctrl, _ctx->numBuckets, idx );
+    }
+    else if( _ctx->oldBuckets &&
+             ( idx = pomMapFindInTable( _ctx, _ctx->oldBuckets, _ctx->oldCtrl, _ctx->oldNumBuckets,
+                                        _key, _keyLen, _hash ) ) != POM_MAP_NOT_FOUND ){
+        // Old table is going away, so no need to track its tombstones
+        LOG( "Removing node %.*s from old table", (int) _keyLen, _key );
+        pomMapFragmentNodeData( _ctx, &_ctx->oldBuckets[ idx ] );
+        pomMapEraseCtrl( _ctx->oldCtrl, _ctx->oldNumBuckets, idx );
+        _ctx->oldNumNodes--;
+    }
+    else{
+        return 1;
+    }
+    _ctx->numNodes--;
+    return 0;
+}
+
+// Lengths and hash of a pair, worked out before bulk loading
+typedef struct PomMapPairInfo{
+    uint64_t hash;
+    size_t keyLen;
+    size_t valueLen;
+}PomMapPairInfo;
+
+int pomMapSetMany( PomMapCtx *_ctx, const PomMapPair *_pairs, size_t _numPairs ){
+    // Size the table once, assuming every key is new. Any migration is finished off
+    // here too, since the whole table is being rebuilt anyway
+    uint64_t required = ( (uint64_t) _ctx->numNodes + _numPairs + 1 ) * POM_MAP_MAX_LOAD_DEN / POM_MAP_MAX_LOAD_NUM + 1;
+    uint32_t size = required > ( 1u << 31 ) ? ( 1u << 31 ) : pomNextPwrTwo( (uint32_t) required );
+    if( size > _ctx->numBuckets ){
+        pomMapRehash( _ctx, size );
+    }
+    pomMapMigrateStep( _ctx, UINT32_MAX );
+
+    // Likewise the heap gets a single block for every record, written in order
+    size_t dataSize = 0;
+    for( size_t i = 0; i < _numPairs; i++ ){
+        dataSize += POM_MAP_RECORD_SIZE( strlen( _pairs[ i ].key ), strlen( _pairs[ i ].value ) );
+    }
+    uint64_t offset = pomMapHeapAlloc( _ctx->dataHeap, dataSize );
+    char * dst = pomMapHeapPtr( _ctx->dataHeap, offset );
+
+    // The table can't grow from here on, so each pair takes a single probe. If the
+    // map started out empty nothing is removed from the table during the load, so an
+    // empty home bucket means no pair with that home has been placed yet, and the
+    // pair can go straight in without probing
+    uint32_t mask = _ctx->numBuckets - 1;
+    bool fresh = _ctx->numNodes == 0 && _ctx->numTombstones == 0;
+    PomMapPairInfo info[ POM_MAP_BULK_BLOCK ];
+    for( size_t base = 0; base < _numPairs; base += POM_MAP_BULK_BLOCK ){
+        size_t count = _numPairs - base < POM_MAP_BULK_BLOCK ? _numPairs - base : POM_MAP_BULK_BLOCK;
+        const PomMapPair *pairs = _pairs + base;
+
+        // Hash the block, starting the fetch of each home bucket as its hash is known
+        for( size_t i = 0; i < count; i++ ){
+            info[ i ].keyLen = strlen( pairs[ i ].key );
+            info[ i ].valueLen = strlen( pairs[ i ].value );
+            info[ i ].hash = _ctx->hashFunc( pairs[ i ].key, info[ i ].keyLen, _ctx->seed );
+            uint32_t home = POM_MAP_H1( info[ i ].hash ) & mask;
+            POM_MAP_PREFETCH( _ctx->ctrl + home );
+            POM_MAP_PREFETCH( &_ctx->buckets[ home ] );
+        }
+
+        for( size_t i = 0; i < count; i++ ){
+            bool found = false;
+            uint32_t idx = POM_MAP_H1( info[ i ].hash ) & mask;
+            if( !fresh || _ctx->ctrl[ idx ] != POM_MAP_CTRL_EMPTY ){
+                idx = pomMapFindOrFree( _ctx, pairs[ i ].key, info[ i ].keyLen, info[ i ].hash, &found );
+            }
+            PomMapBucket * node = &_ctx->buckets[ idx ];
+            if( found ){
+                pomMapFragmentNodeData( _ctx, node );
+            }
+            else{
+                if( _ctx->ctrl[ idx ] == POM_MAP_CTRL_DELETED ){
+                    _ctx->numTombstones--;
+                }
+                node->hash = info[ i ].hash;
+                pomMapSetCtrl( _ctx->ctrl, _ctx->numBuckets, idx, POM_MAP_H2( info[ i ].hash ) );
+                _ctx->numNodes++;
+            }
+            pomMapWriteRecord( dst, pairs[ i ].key, info[ i ].keyLen, pairs[ i ].value, info[ i ].valueLen );
+            node->keyOffset = offset + sizeof( PomMapRecord );
+            node->valueOffset = node->keyOffset + info[ i ].keyLen + 1;
+            node->keyLen = (uint32_t) info[ i ].keyLen;
+            node->valueLen = (uint32_t) info[ i ].valueLen;
+            size_t recordSize = POM_MAP_RECORD_SIZE( info[ i ].keyLen, info[ i ].valueLen );
+            offset += recordSize;
+            dst += recordSize;
+        }
+    }
+    if( _ctx->dataHeap->compactAuto ){
+        pomMapCompactStep( _ctx, POM_MAP_COMPACT_STEP );
+    }
     return 0;
 }
 
-// TODO - keep track of unnecessary strings (from removed/updated key/values),
-// then when requiring a resize of the heap check if its useful to also optimise
-// the heap to take out the old strings (i.e. if you'd free more than 10% of the heap)
+int pomMapSetManyIter( PomMapCtx *_ctx, PomMapPairIter _iter, void *_arg ){
+    size_t numPairs = 0;
+    size_t maxPairs = POM_MAP_DEFAULT_SIZE;
+    PomMapPair *pairs = (PomMapPair*) malloc( maxPairs * sizeof( PomMapPair ) );
+    while( _iter( _arg, &pairs[ numPairs ].key, &pairs[ numPairs ].value ) ){
+        if( ++numPairs == maxPairs ){
+            maxPairs *= 2;
+            pairs = (PomMapPair*) realloc( pairs, maxPairs * sizeof( PomMapPair ) );
+        }
+    }
+    int ret = pomMapSetMany( _ctx, pairs, numPairs );
+    free( pairs );
+    return ret;
+}
 
+// Enable/disable incremental resizing
+int pomMapSetIncrementalResize( PomMapCtx *_ctx, bool _incremental ){
+    _ctx->incrementalResize = _incremental;
+    if( !_incremental ){
+        // Finish off any migration that's in progress
+        pomMapMigrateStep( _ctx, UINT32_MAX );
+    }
+    return 0;
+}
 
 // Clean up the map
 int pomMapClear( PomMapCtx *_ctx ){
     LOG( "Clearing hashmap" );
-    uint32_t freeCnt = 0;
-    for( uint32_t i = 0; i < _ctx->numBuckets; i++ ){
-        PomMapBucket * curBucket = &_ctx->buckets[ i ];
-        PomMapNode * curNode = curBucket->listHead;
-        PomMapNode * nextNode = NULL;
-        while( curNode ){
-            nextNode = curNode->next;
-            free( curNode );
-            curNode = nextNode;
-            freeCnt++;
-        }
-    }
     free( _ctx->buckets );
-    LOG( "Cleared %i buckets and %i nodes", _ctx->numBuckets, freeCnt );
-    if( freeCnt != _ctx->numNodes ){
-        LOG( "Number of freed nodes (%i) not equal to number of recorded nodes (%i)", freeCnt, _ctx->numNodes );
+    free( _ctx->ctrl );
+    free( _ctx->oldBuckets );
+    free( _ctx->oldCtrl );
+    _ctx->oldBuckets = NULL;
+    _ctx->oldCtrl = NULL;
+    _ctx->oldNumBuckets = 0;
+    _ctx->oldNumNodes = 0;
+    LOG( "Cleared %i buckets and %i nodes", _ctx->numBuckets, _ctx->numNodes );
+    for( uint32_t c = 0; c < _ctx->dataHeap->numChunks; c++ ){
+        free( _ctx->dataHeap->chunks[ c ] );
     }
-    free( _ctx->dataHeap->heap );
-    LOG( "Freed data heap of size %i", _ctx->dataHeap->numHeapBlocks * POM_MAP_HEAP_SIZE );
+    LOG( "Freed data heap of size %zu", _ctx->dataHeap->heapSize );
+    free( _ctx->dataHeap->chunks );
+    free( _ctx->dataHeap->chunkSizes );
+    free( _ctx->dataHeap->chunkUsed );
+    free( _ctx->dataHeap->chunkDead );
     free( _ctx->dataHeap );
     _ctx->numNodes = 0;
     _ctx->numBuckets = 0;
+    _ctx->numTombstones = 0;
     _ctx->initialised = false;
     return 0;
 }
 
 // Suggest a resize to the map
 int pomMapResize( PomMapCtx *_ctx, uint32_t _size ){
-    // TODO - optimise the data heap here
     if( !_ctx->initialised || _size <= _ctx->numBuckets ){
         // No need to resize
         LOG( "Not resizing" );
@@ -316,136 +1044,1309 @@ int pomMapResize( PomMapCtx *_ctx, uint32_t _size ){
 
     // Round `_size` to a power of 2
     _size = pomNextPwrTwo( _size );
+    if( _size < POM_MAP_GROUP_WIDTH ){
+        _size = POM_MAP_GROUP_WIDTH;
+    }
     LOG( "Resizing map to %i", _size );
 
-    // Construct long linked list from all nodes
-    PomMapNode * nodeHead = NULL;
-    PomMapNode * lastNode = NULL;
-    uint32_t nodesCounted = 0;
-    for( uint32_t i = 0; i < _ctx->numBuckets; i++ ){
-        PomMapBucket * curBucket = &_ctx->buckets[ i ];
-        PomMapNode * nodeIter = curBucket->listHead;
-        if( !nodeIter ){
-            // Empty bucket
-            continue;
-        }
-        if( !nodeHead ){
-            // First node in the big list
-            nodeHead = nodeIter;
-            nodesCounted++;
-        }
-        else{
-            // Connect up first node in this bucket to last node in last bucket
-            lastNode->next = nodeIter;
-            nodesCounted++;
+    return pomMapRehash( _ctx, _size );
+}
+
+
+int pomMapOptimise( PomMapCtx *_ctx ){
+    // Count the required bytes of all nodes
+    size_t totalBytesReq = 0;
+    PomMapBucket * buckets;
+    uint8_t * ctrl;
+    for( int t = 0; t < POM_MAP_MAX_TABLES; t++ ){
+        uint32_t numBuckets = pomMapGetTable( _ctx, t, &buckets, &ctrl );
+        for( uint32_t i = 0; i < numBuckets; i++ ){
+            if( !POM_MAP_CTRL_IS_FULL( ctrl[ i ] ) ){
+                continue;
+            }
+            PomMapBucket * node = &buckets[ i ];
+            totalBytesReq += POM_MAP_RECORD_SIZE( node->keyLen, node->valueLen );
         }
-        while( nodeIter->next ){
-            // Cycle through to find the last node in this bucket
-            nodeIter = nodeIter->next;
-            nodesCounted++;
+    }
+
+    // Live data is packed into a single chunk
+    size_t newHeapSize = totalBytesReq > POM_MAP_HEAP_SIZE ? totalBytesReq : POM_MAP_HEAP_SIZE;
+    LOG( "Current heap size: %zu. Total bytes required %zu", _ctx->dataHeap->heapSize, totalBytesReq );
+    char * newHeap = (char*) malloc( sizeof( char ) * newHeapSize );
+    size_t currOffset = 0;
+    LOG( "Reordering hashmap" );
+    // Copy the data to the new buffer and update the key/value offsets
+    for( int t = 0; t < POM_MAP_MAX_TABLES; t++ ){
+        uint32_t numBuckets = pomMapGetTable( _ctx, t, &buckets, &ctrl );
+        for( uint32_t i = 0; i < numBuckets; i++ ){
+            if( !POM_MAP_CTRL_IS_FULL( ctrl[ i ] ) ){
+                continue;
+            }
+            PomMapBucket * node = &buckets[ i ];
+            pomMapWriteRecord( newHeap + currOffset, pomMapGetNodeKey( _ctx, node ), node->keyLen,
+                               pomMapGetNodeValue( _ctx, node ), node->valueLen );
+            node->keyOffset = POM_MAP_HEAP_OFFSET( 0, currOffset + sizeof( PomMapRecord ) );
+            node->valueOffset = node->keyOffset + node->keyLen + 1;
+            currOffset += POM_MAP_RECORD_SIZE( node->keyLen, node->valueLen );
         }
-        lastNode = nodeIter;
     }
-    if( nodesCounted != _ctx->numNodes ){
-        LOG( "Counted %i nodes, but have %i on record", nodesCounted, _ctx->numNodes );
+    // Free up the old chunks and replace them with the new one
+    PomMapDataHeap *heap = _ctx->dataHeap;
+    for( uint32_t c = 0; c < heap->numChunks; c++ ){
+        free( heap->chunks[ c ] );
+        heap->chunks[ c ] = NULL;
     }
-    // Now reallocate the bucket array with the new size and zero it
-    _ctx->buckets = (PomMapBucket*) realloc( _ctx->buckets, sizeof( PomMapBucket ) * _size );
-    memset( _ctx->buckets, 0, sizeof( PomMapBucket ) *_size );
-    _ctx->numBuckets = _size;
+    heap->chunks[ 0 ] = newHeap;
+    heap->chunkSizes[ 0 ] = newHeapSize;
+    heap->chunkUsed[ 0 ] = totalBytesReq;
+    heap->chunkDead[ 0 ] = 0;
+    heap->numChunks = 1;
+    heap->activeChunk = 0;
+    heap->heapUsed = totalBytesReq;
+    heap->heapSize = newHeapSize;
+    heap->fragmentedData = 0;
+    heap->compactChunk = POM_MAP_NO_CHUNK;
 
-    // Add all nodes from linked list to new bucket array
-    PomMapNode * curNode = nodeHead;
-    while( curNode ){
-        PomMapNode * nextNode = curNode->next;
-        // Break apart the list as we go
-        curNode->next = NULL;
-        const char * currNodeKey = pomMapGetNodeKey( _ctx, curNode );
-        //uint32_t idx = pomMapHashFunc( _ctx, curNode->key );
-        uint32_t idx = pomMapHashFunc( _ctx, currNodeKey );
-        PomMapBucket * bucket = &_ctx->buckets[ idx ];
-        PomMapNode ** node = &(bucket->listHead);
+    return 0;
+}
 
-        // Cycle to the end of the bucket's list
-        while( *node ){
-            node = &((*node)->next);
-        }
-        // Add the current node to the end of the bucket's list
-        *node = curNode;
+int pomMapSetCompaction( PomMapCtx *_ctx, uint32_t _deadPercent, bool _automatic ){
+    _ctx->dataHeap->compactPercent = _deadPercent;
+    _ctx->dataHeap->compactAuto = _automatic;
+    return 0;
+}
 
-        curNode = nextNode;
+bool pomMapNeedsCompact( PomMapCtx *_ctx ){
+    PomMapDataHeap *heap = _ctx->dataHeap;
+    if( heap->compactChunk != POM_MAP_NO_CHUNK ){
+        return true;
     }
+    return heap->fragmentedData > POM_MAP_HEAP_SIZE &&
+           heap->fragmentedData * 100 > heap->heapUsed * heap->compactPercent;
+}
 
-    return 0;
+// Pick the chunk with the most dead data to evacuate next. If that's the active
+// chunk, a new active chunk is started so the old one can be emptied
+void pomMapCompactPickChunk( PomMapDataHeap *_heap ){
+    uint32_t victim = _heap->activeChunk;
+    for( uint32_t c = 0; c < _heap->numChunks; c++ ){
+        if( _heap->chunks[ c ] && _heap->chunkDead[ c ] > _heap->chunkDead[ victim ] ){
+            victim = c;
+        }
+    }
+    if( victim == _heap->activeChunk ){
+        pomMapHeapAddChunk( _heap, _heap->chunkUsed[ victim ] - _heap->chunkDead[ victim ] );
+    }
+    LOG( "Evacuating heap chunk %u (%zu of %zu bytes dead)", victim, _heap->chunkDead[ victim ],
+         _heap->chunkUsed[ victim ] );
+    _heap->compactChunk = victim;
+    _heap->compactPos = 0;
 }
 
+bool pomMapCompactStep( PomMapCtx *_ctx, size_t _budgetBytes ){
+    PomMapDataHeap *heap = _ctx->dataHeap;
+    while( _budgetBytes > 0 && pomMapNeedsCompact( _ctx ) ){
+        if( heap->compactChunk == POM_MAP_NO_CHUNK ){
+            pomMapCompactPickChunk( heap );
+        }
+        uint32_t chunk = heap->compactChunk;
+        if( heap->compactPos >= heap->chunkUsed[ chunk ] ){
+            // Everything left in the chunk is dead
+            pomMapHeapFreeChunk( heap, chunk );
+            heap->compactChunk = POM_MAP_NO_CHUNK;
+            continue;
+        }
 
-int pomMapOptimise( PomMapCtx *_ctx ){
-    // Count the required bytes of all nodes
-    size_t totalBytesReq = 0;
-    for( uint32_t i = 0; i < _ctx->numBuckets; i++ ){
-        PomMapBucket * curBucket = &_ctx->buckets[ i ];
-        PomMapNode * nodeIter = curBucket->listHead;
-        while( nodeIter ){
-            const char * key = pomMapGetNodeKey( _ctx, nodeIter );
-            const char * val = pomMapGetNodeValue( _ctx, nodeIter );
-            size_t keyLen = strlen( key ) + 1;
-            size_t valLen = strlen( val ) + 1;
-            totalBytesReq += keyLen + valLen;
-            nodeIter = nodeIter->next;
+        char * recordLoc = heap->chunks[ chunk ] + heap->compactPos;
+        PomMapRecord record;
+        memcpy( &record, recordLoc, sizeof( PomMapRecord ) );
+        uint32_t keyLen = record.keyLen & ~POM_MAP_RECORD_DEAD;
+        size_t recordSize = POM_MAP_RECORD_SIZE( keyLen, record.valueLen );
+        if( !( record.keyLen & POM_MAP_RECORD_DEAD ) ){
+            // Live record, so find its bucket and move it to the active chunk
+            const char * key = recordLoc + sizeof( PomMapRecord );
+            uint64_t hash = _ctx->hashFunc( key, keyLen, _ctx->seed );
+            PomMapBucket * node = pomMapFindNode( _ctx, key, keyLen, hash );
+            pomMapFragmentNodeData( _ctx, node );
+            pomMapSetNodeData( _ctx, node, key, keyLen, key + keyLen + 1, record.valueLen );
         }
+        heap->compactPos += recordSize;
+        _budgetBytes = _budgetBytes > recordSize ? _budgetBytes - recordSize : 0;
     }
-    
-    // Check if we can downsize the heap
-    // Rounding up by x/y -> (x+y-1)/y
-    uint32_t blocksReq = ( totalBytesReq + POM_MAP_HEAP_SIZE - 1 ) / POM_MAP_HEAP_SIZE;
-    size_t newHeapSize = blocksReq * POM_MAP_HEAP_SIZE;
-    LOG( "Current heap size: %zu. Total bytes required %zu",
-         _ctx->dataHeap->numHeapBlocks * POM_MAP_HEAP_SIZE,
-         newHeapSize );
-    // Create new heap to copy data into
-    char * newHeap = (char*) malloc( sizeof( char ) * newHeapSize );
-    size_t currOffset = 0;
-    LOG( "Reordering hashmap" );
-    // Copy the data to the new buffer and update the key/value pointers
-    for( uint32_t i = 0; i < _ctx->numBuckets; i++ ){
-        PomMapBucket * curBucket = &_ctx->buckets[ i ];
-        PomMapNode * nodeIter = curBucket->listHead;
-        while( nodeIter ){
-            const char * key = pomMapGetNodeKey( _ctx, nodeIter );
-            const char * val = pomMapGetNodeValue( _ctx, nodeIter );
-            size_t keyLen = strlen( key ) + 1;
-            size_t valLen = strlen( val ) + 1;
-            char * newKey = newHeap + currOffset;
-            char * newVal = newKey + keyLen;
-
-            memcpy( newKey, key, keyLen );
-            memcpy( newVal, val, valLen );
-
-            size_t keyOffset = newKey - newHeap;
-            size_t valOffset = newVal - newHeap;
-            nodeIter->keyOffset = keyOffset;
-            nodeIter->valueOffset = valOffset;
-            nodeIter = nodeIter->next;
-            currOffset += keyLen + valLen;            
-        }
-    }
-    _ctx->dataHeap->heapUsed = totalBytesReq;
-    // Free up the old heap and update the context with the new heap
-    free( _ctx->dataHeap->heap );
-    _ctx->dataHeap->heap = newHeap;
-    _ctx->dataHeap->numHeapBlocks = blocksReq;
-    _ctx->dataHeap->fragmentedData = 0;
-
-    return 0;
+    return pomMapNeedsCompact( _ctx );
 }
 
-const char * pomMapGetDataHeap( PomMapCtx *_ctx, size_t *_heapUsed, size_t *_heapSize ){
+int pomMapHeapStats( PomMapCtx *_ctx, size_t *_heapUsed, size_t *_heapSize, size_t *_heapDead ){
     if( _heapUsed ){
         *_heapUsed = _ctx->dataHeap->heapUsed;
     }
     if( _heapSize ){
-        *_heapSize = _ctx->dataHeap->numHeapBlocks * POM_MAP_HEAP_SIZE;
+        *_heapSize = _ctx->dataHeap->heapSize;
+    }
+    if( _heapDead ){
+        *_heapDead = _ctx->dataHeap->fragmentedData;
+    }
+    return 0;
+}
+
+const char * pomMapGetDataHeap( PomMapCtx *_ctx, size_t *_heapUsed, size_t *_heapSize ){
+    PomMapDataHeap *heap = _ctx->dataHeap;
+    uint32_t liveChunk = POM_MAP_NO_CHUNK;
+    for( uint32_t c = 0; c < heap->numChunks; c++ ){
+        if( !heap->chunks[ c ] ){
+            continue;
+        }
+        if( liveChunk != POM_MAP_NO_CHUNK ){
+            // Spread over several chunks
+            return NULL;
+        }
+        liveChunk = c;
+    }
+    return pomMapGetDataHeapChunk( _ctx, liveChunk, _heapUsed, _heapSize );
+}
+
+const char * pomMapGetDataHeapChunk( PomMapCtx *_ctx, uint32_t _chunk, size_t *_chunkUsed, size_t *_chunkSize ){
+    if( _chunk >= _ctx->dataHeap->numChunks ){
+        return NULL;
+    }
+    if( _chunkUsed ){
+        *_chunkUsed = _ctx->dataHeap->chunkUsed[ _chunk ];
+    }
+    if( _chunkSize ){
+        *_chunkSize = _ctx->dataHeap->chunkSizes[ _chunk ];
+    }
+    return _ctx->dataHeap->chunks[ _chunk ];
+}
+
+int pomMapProbeStats( PomMapCtx *_ctx, uint32_t *_histogram, uint32_t _histogramSize ){
+    memset( _histogram, 0, _histogramSize * sizeof( uint32_t ) );
+    PomMapBucket * buckets;
+    uint8_t * ctrl;
+    for( int t = 0; t < POM_MAP_MAX_TABLES; t++ ){
+        uint32_t numBuckets = pomMapGetTable( _ctx, t, &buckets, &ctrl );
+        uint32_t mask = numBuckets - 1;
+        for( uint32_t i = 0; i < numBuckets; i++ ){
+            if( !POM_MAP_CTRL_IS_FULL( ctrl[ i ] ) ){
+                continue;
+            }
+            // Walk the probe sequence from the entry's home position until we reach a
+            // group containing its bucket
+            uint32_t pos = POM_MAP_H1( buckets[ i ].hash ) & mask;
+            uint32_t stride = 0;
+            uint32_t numProbes = 0;
+            while( ( ( i - pos ) & mask ) >= POM_MAP_GROUP_WIDTH ){
+                stride += POM_MAP_GROUP_WIDTH;
+                pos = ( pos + stride ) & mask;
+                numProbes++;
+            }
+            if( numProbes >= _histogramSize ){
+                numProbes = _histogramSize - 1;
+            }
+            _histogram[ numProbes ]++;
+        }
     }
-    return _ctx->dataHeap->heap;
-}
\ No newline at end of file
+    return 0;
+}
+
+
+int pomMapIterInit( PomMapCtx *_ctx, PomMapIter *_iter, PomMapIterOrder _order ){
+    _iter->map = _ctx;
+    _iter->order = _order;
+    _iter->section = 0;
+    _iter->pos = 0;
+    _iter->key = (PomMapStrView){ NULL, 0 };
+    _iter->value = (PomMapStrView){ NULL, 0 };
+    return 0;
+}
+
+// Walk the heap chunks' records in memory order, skipping dead ones
+bool pomMapIterNextHeap( PomMapIter *_iter ){
+    PomMapDataHeap *heap = _iter->map->dataHeap;
+    while( _iter->section < heap->numChunks ){
+        uint32_t chunk = _iter->section;
+        if( !heap->chunks[ chunk ] || _iter->pos >= heap->chunkUsed[ chunk ] ){
+            _iter->section++;
+            _iter->pos = 0;
+            continue;
+        }
+        const char * recordLoc = heap->chunks[ chunk ] + _iter->pos;
+        PomMapRecord record;
+        memcpy( &record, recordLoc, sizeof( PomMapRecord ) );
+        uint32_t keyLen = record.keyLen & ~POM_MAP_RECORD_DEAD;
+        _iter->pos += POM_MAP_RECORD_SIZE( keyLen, record.valueLen );
+        if( record.keyLen & POM_MAP_RECORD_DEAD ){
+            continue;
+        }
+        _iter->key = (PomMapStrView){ recordLoc + sizeof( PomMapRecord ), keyLen };
+        _iter->value = (PomMapStrView){ _iter->key.str + keyLen + 1, record.valueLen };
+        return true;
+    }
+    return false;
+}
+
+// Walk the full buckets of the current table, then the one being migrated from
+bool pomMapIterNextBucket( PomMapIter *_iter ){
+    PomMapBucket * buckets;
+    uint8_t * ctrl;
+    while( _iter->section < POM_MAP_MAX_TABLES ){
+        uint32_t numBuckets = pomMapGetTable( _iter->map, (int) _iter->section, &buckets, &ctrl );
+        while( _iter->pos < numBuckets && !POM_MAP_CTRL_IS_FULL( ctrl[ _iter->pos ] ) ){
+            _iter->pos++;
+        }
+        if( _iter->pos == numBuckets ){
+            _iter->section++;
+            _iter->pos = 0;
+            continue;
+        }
+        PomMapBucket * node = &buckets[ _iter->pos++ ];
+        _iter->key = (PomMapStrView){ pomMapGetNodeKey( _iter->map, node ), node->keyLen };
+        _iter->value = (PomMapStrView){ pomMapGetNodeValue( _iter->map, node ), node->valueLen };
+        return true;
+    }
+    return false;
+}
+
+bool pomMapIterNext( PomMapIter *_iter ){
+    bool found = _iter->order == POM_MAP_ITER_HEAP ? pomMapIterNextHeap( _iter ) : pomMapIterNextBucket( _iter );
+    if( !found ){
+        // Past the end, so there's no current entry
+        _iter->key = (PomMapStrView){ NULL, 0 };
+        _iter->value = (PomMapStrView){ NULL, 0 };
+    }
+    return found;
+}
+
+int pomMapIterRemove( PomMapIter *_iter ){
+    PomMapCtx *ctx = _iter->map;
+    if( !_iter->key.str ){
+        // Not on an entry, either before the first `pomMapIterNext` or after the last
+        return 1;
+    }
+    // Skips the migration/compaction steps of a normal remove, since they'd move
+    // entries out from under the iterator. The removed data stays in place (dead)
+    // until the next compaction, so the current key/value views stay readable
+    uint64_t hash = ctx->hashFunc( _iter->key.str, _iter->key.len, ctx->seed );
+    return pomMapEraseNode( ctx, _iter->key.str, _iter->key.len, hash );
+}
+
+/*******************************************
+* Frozen version - minimal perfect hash
+********************************************/
+
+/*
+Entries are split into groups of ~POM_MAP_FROZEN_GROUP_SIZE by their hash. Each
+group gets a displacement, found at freeze time, that sends all of its entries to
+free slots. Groups are placed largest first, while most slots are still free.
+A salt is mixed into the hash, and a new one is tried if some group can't be placed.
+*/
+
+#define POM_MAP_FROZEN_GROUP_SIZE 4
+#define POM_MAP_FROZEN_MAX_DISP ( 1u << 20 ) // Displacements tried per group before changing salt
+#define POM_MAP_FROZEN_MAX_SALTS 16
+#define POM_MAP_FROZEN_NO_ENTRY UINT32_MAX
+// Byte of the hash kept per slot, so most misses are rejected without reading the slot
+#define POM_MAP_FROZEN_TAG( hash ) ( (uint8_t) (hash) )
+
+// "POMMAPFZ". Also catches files written on a machine with different endianness
+#define POM_MAP_FROZEN_MAGIC 0x5a4650414d4d4f50ull
+#define POM_MAP_FROZEN_VERSION 2
+// Key hashed at freeze time to check a loaded map is used with the same hash function
+#define POM_MAP_FROZEN_CHECK_KEY "PomMapFrozen"
+
+struct PomMapFrozenSlot{
+    uint64_t hash;
+    uint32_t keyLen;
+    uint32_t valueLen;
+    uint64_t keyOffset; // Relative to the data section. Value follows the key's terminator
+};
+
+// Start of the frozen block. Sections are addressed by offset from the block start
+typedef struct PomMapFrozenHeader{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t hashCheck;
+    uint64_t seed;
+    uint64_t salt;
+    uint32_t numSlots;
+    uint32_t numGroups;
+    uint64_t dispOffset;
+    uint64_t tagOffset;
+    uint64_t slotOffset;
+    uint64_t dataOffset;
+    uint64_t blockSize;
+}PomMapFrozenHeader;
+
+inline uint64_t pomMapFrozenMix( uint64_t _x );
+inline uint32_t pomMapFrozenReduce( uint64_t _x, uint32_t _n );
+inline uint32_t pomMapFrozenSlotIdx( uint64_t _h, uint32_t _disp, uint32_t _numSlots );
+
+// Murmur3 64-bit finaliser
+uint64_t pomMapFrozenMix( uint64_t _x ){
+    _x ^= _x >> 33;
+    _x *= 0xff51afd7ed558ccdull;
+    _x ^= _x >> 33;
+    _x *= 0xc4ceb9fe1a85ec53ull;
+    _x ^= _x >> 33;
+    return _x;
+}
+
+// Map the top 32 bits of `_x` onto [0, _n) without a division
+uint32_t pomMapFrozenReduce( uint64_t _x, uint32_t _n ){
+    return (uint32_t) ( ( ( _x >> 32 ) * _n ) >> 32 );
+}
+
+uint32_t pomMapFrozenSlotIdx( uint64_t _h, uint32_t _disp, uint32_t _numSlots ){
+    return pomMapFrozenReduce( pomMapFrozenMix( _h + _disp * 0x9e3779b97f4a7c15ull ), _numSlots );
+}
+
+// Sort entries by where their data sits in the source map's heap
+int pomMapFrozenCompareEntries( const void *_a, const void *_b ){
+    uint64_t a = ( *(PomMapBucket* const*) _a )->keyOffset;
+    uint64_t b = ( *(PomMapBucket* const*) _b )->keyOffset;
+    return ( a > b ) - ( a < b );
+}
+
+// Sort group (size << 32 | index) keys, largest first
+int pomMapFrozenCompareGroups( const void *_a, const void *_b ){
+    uint64_t a = *(const uint64_t*) _a;
+    uint64_t b = *(const uint64_t*) _b;
+    return ( a < b ) - ( a > b );
+}
+
+// Find a displacement for every group using the given salt. Fills `_disp` and
+// `_slotEntry` (the entry index placed in each slot). Returns 0 on success
+int pomMapFrozenPlace( const uint64_t *_hashes, uint32_t _numEntries, uint32_t _numGroups, uint64_t _salt,
+                       uint32_t *_disp, uint32_t *_slotEntry ){
+    // Bucket entries by group
+    uint64_t *mixed = (uint64_t*) malloc( _numEntries * sizeof( uint64_t ) );
+    uint32_t *groupStart = (uint32_t*) calloc( _numGroups + 1, sizeof( uint32_t ) );
+    uint32_t *groupFill = (uint32_t*) malloc( _numGroups * sizeof( uint32_t ) );
+    uint32_t *groupEntries = (uint32_t*) malloc( _numEntries * sizeof( uint32_t ) );
+    uint64_t *order = (uint64_t*) malloc( _numGroups * sizeof( uint64_t ) );
+    for( uint32_t i = 0; i < _numEntries; i++ ){
+        mixed[ i ] = pomMapFrozenMix( _hashes[ i ] ^ _salt );
+        groupStart[ pomMapFrozenReduce( mixed[ i ], _numGroups ) + 1 ]++;
+    }
+    uint32_t maxGroupSize = 0;
+    for( uint32_t g = 0; g < _numGroups; g++ ){
+        uint32_t groupSize = groupStart[ g + 1 ];
+        maxGroupSize = groupSize > maxGroupSize ? groupSize : maxGroupSize;
+        order[ g ] = ( (uint64_t) groupSize << 32 ) | g;
+        groupStart[ g + 1 ] += groupStart[ g ];
+        groupFill[ g ] = groupStart[ g ];
+        _disp[ g ] = 0;
+    }
+    for( uint32_t i = 0; i < _numEntries; i++ ){
+        groupEntries[ groupFill[ pomMapFrozenReduce( mixed[ i ], _numGroups ) ]++ ] = i;
+    }
+    qsort( order, _numGroups, sizeof( uint64_t ), pomMapFrozenCompareGroups );
+
+    for( uint32_t i = 0; i < _numEntries; i++ ){
+        _slotEntry[ i ] = POM_MAP_FROZEN_NO_ENTRY;
+    }
+    uint32_t *groupSlots = (uint32_t*) malloc( ( maxGroupSize + 1 ) * sizeof( uint32_t ) );
+    int ret = 0;
+    for( uint32_t o = 0; o < _numGroups && ret == 0; o++ ){
+        uint32_t g = (uint32_t) order[ o ];
+        uint32_t groupSize = (uint32_t) ( order[ o ] >> 32 );
+        if( groupSize == 0 ){
+            // Sorted, so the rest are empty too
+            break;
+        }
+        const uint32_t *entries = &groupEntries[ groupStart[ g ] ];
+        uint32_t disp;
+        for( disp = 0; disp < POM_MAP_FROZEN_MAX_DISP; disp++ ){
+            // Every entry needs a free slot, distinct from the rest of the group
+            uint32_t e;
+            for( e = 0; e < groupSize; e++ ){
+                uint32_t slot = pomMapFrozenSlotIdx( mixed[ entries[ e ] ], disp, _numEntries );
+                if( _slotEntry[ slot ] != POM_MAP_FROZEN_NO_ENTRY ){
+                    break;
+                }
+                uint32_t p;
+                for( p = 0; p < e && groupSlots[ p ] != slot; p++ );
+                if( p != e ){
+                    break;
+                }
+                groupSlots[ e ] = slot;
+            }
+            if( e == groupSize ){
+                break;
+            }
+        }
+        if( disp == POM_MAP_FROZEN_MAX_DISP ){
+            ret = 1;
+            break;
+        }
+        _disp[ g ] = disp;
+        for( uint32_t e = 0; e < groupSize; e++ ){
+            _slotEntry[ groupSlots[ e ] ] = entries[ e ];
+        }
+    }
+
+    free( groupSlots );
+    free( order );
+    free( groupEntries );
+    free( groupFill );
+    free( groupStart );
+    free( mixed );
+    return ret;
+}
+
+// Point the frozen context at a complete frozen block
+int pomMapFrozenAttach( PomMapFrozenCtx *_frozen, uint8_t *_block, size_t _blockSize, PomMapHashFunc _hashFunc ){
+    const PomMapFrozenHeader *header = (const PomMapFrozenHeader*) _block;
+    _frozen->block = _block;
+    _frozen->blockSize = _blockSize;
+    _frozen->hashFunc = _hashFunc ? _hashFunc : pomMapHashDefault;
+    _frozen->seed = header->seed;
+    _frozen->salt = header->salt;
+    _frozen->numSlots = header->numSlots;
+    _frozen->numGroups = header->numGroups;
+    _frozen->displacements = (const uint32_t*) ( _block + header->dispOffset );
+    _frozen->tags = _block + header->tagOffset;
+    _frozen->slots = (const PomMapFrozenSlot*) ( _block + header->slotOffset );
+    _frozen->data = (const char*) ( _block + header->dataOffset );
+    _frozen->mapped = false;
+    return 0;
+}
+
+// Check a block read from a file is a complete, self-consistent frozen map
+int pomMapFrozenValidate( const uint8_t *_block, size_t _blockSize, PomMapHashFunc _hashFunc ){
+    if( _blockSize < sizeof( PomMapFrozenHeader ) ){
+        return 1;
+    }
+    const PomMapFrozenHeader *header = (const PomMapFrozenHeader*) _block;
+    if( header->magic != POM_MAP_FROZEN_MAGIC || header->version != POM_MAP_FROZEN_VERSION ||
+        header->headerSize != sizeof( PomMapFrozenHeader ) || header->blockSize != _blockSize ){
+        return 1;
+    }
+    if( header->numGroups == 0 ||
+        header->dispOffset + (uint64_t) header->numGroups * sizeof( uint32_t ) > header->tagOffset ||
+        header->tagOffset + header->numSlots > header->slotOffset ||
+        header->slotOffset + (uint64_t) header->numSlots * sizeof( PomMapFrozenSlot ) > header->dataOffset ||
+        header->dataOffset > header->blockSize || ( header->slotOffset & 7 ) ){
+        return 1;
+    }
+    _hashFunc = _hashFunc ? _hashFunc : pomMapHashDefault;
+    if( _hashFunc( POM_MAP_FROZEN_CHECK_KEY, strlen( POM_MAP_FROZEN_CHECK_KEY ), header->seed ) != header->hashCheck ){
+        LOG( "Frozen map was built with a different hash function" );
+        return 1;
+    }
+    return 0;
+}
+
+int pomMapFreeze( PomMapCtx *_ctx, PomMapFrozenCtx *_frozen ){
+    // Gather the live entries from both tables
+    uint32_t numEntries = _ctx->numNodes;
+    uint32_t numGroups = numEntries / POM_MAP_FROZEN_GROUP_SIZE + 1;
+    PomMapBucket **entries = (PomMapBucket**) malloc( ( numEntries + 1 ) * sizeof( PomMapBucket* ) );
+    uint64_t *hashes = (uint64_t*) malloc( ( numEntries + 1 ) * sizeof( uint64_t ) );
+    uint32_t numFound = 0;
+    size_t dataSize = 0;
+    PomMapBucket * buckets;
+    uint8_t * ctrl;
+    for( int t = 0; t < POM_MAP_MAX_TABLES; t++ ){
+        uint32_t numBuckets = pomMapGetTable( _ctx, t, &buckets, &ctrl );
+        for( uint32_t i = 0; i < numBuckets && numFound < numEntries; i++ ){
+            if( POM_MAP_CTRL_IS_FULL( ctrl[ i ] ) ){
+                entries[ numFound ] = &buckets[ i ];
+                dataSize += (size_t) buckets[ i ].keyLen + buckets[ i ].valueLen + 2;
+                numFound++;
+            }
+        }
+    }
+    // Data is laid out in heap (roughly insertion) order, so keys that were added
+    // together, and tend to be looked up together, share cache lines as they do in the map
+    qsort( entries, numEntries, sizeof( PomMapBucket* ), pomMapFrozenCompareEntries );
+    for( uint32_t i = 0; i < numEntries; i++ ){
+        hashes[ i ] = entries[ i ]->hash;
+    }
+
+    uint32_t *disp = (uint32_t*) malloc( numGroups * sizeof( uint32_t ) );
+    uint32_t *slotEntry = (uint32_t*) malloc( ( numEntries + 1 ) * sizeof( uint32_t ) );
+    uint64_t salt = 0;
+    int ret = 1;
+    for( uint32_t s = 0; s < POM_MAP_FROZEN_MAX_SALTS && ret; s++ ){
+        salt = s * 0x9e3779b97f4a7c15ull;
+        ret = pomMapFrozenPlace( hashes, numEntries, numGroups, salt, disp, slotEntry );
+        if( ret ){
+            LOG( "Couldn't freeze map with salt %i, retrying", s );
+        }
+    }
+    if( ret ){
+        free( slotEntry );
+        free( disp );
+        free( hashes );
+        free( entries );
+        return 1;
+    }
+
+    // Lay out header, displacements, tags, slots and data in one block
+    PomMapFrozenHeader header;
+    header.magic = POM_MAP_FROZEN_MAGIC;
+    header.version = POM_MAP_FROZEN_VERSION;
+    header.headerSize = sizeof( PomMapFrozenHeader );
+    header.hashCheck = _ctx->hashFunc( POM_MAP_FROZEN_CHECK_KEY, strlen( POM_MAP_FROZEN_CHECK_KEY ), _ctx->seed );
+    header.seed = _ctx->seed;
+    header.salt = salt;
+    header.numSlots = numEntries;
+    header.numGroups = numGroups;
+    header.dispOffset = sizeof( PomMapFrozenHeader );
+    header.tagOffset = header.dispOffset + numGroups * sizeof( uint32_t );
+    header.slotOffset = ( header.tagOffset + numEntries + 7 ) & ~7ull;
+    header.dataOffset = header.slotOffset + numEntries * sizeof( PomMapFrozenSlot );
+    header.blockSize = header.dataOffset + dataSize;
+    uint8_t *block = (uint8_t*) malloc( header.blockSize );
+    memcpy( block, &header, sizeof( PomMapFrozenHeader ) );
+    memcpy( block + header.dispOffset, disp, numGroups * sizeof( uint32_t ) );
+
+    // Data is written in entry order, with each entry's slot pointing at it
+    PomMapFrozenSlot *slots = (PomMapFrozenSlot*) ( block + header.slotOffset );
+    uint8_t *tags = block + header.tagOffset;
+    memset( tags, 0, header.slotOffset - header.tagOffset );
+    char *data = (char*) ( block + header.dataOffset );
+    uint32_t *entrySlot = (uint32_t*) malloc( ( numEntries + 1 ) * sizeof( uint32_t ) );
+    for( uint32_t i = 0; i < numEntries; i++ ){
+        entrySlot[ slotEntry[ i ] ] = i;
+    }
+    size_t dataOffset = 0;
+    for( uint32_t e = 0; e < numEntries; e++ ){
+        PomMapBucket *node = entries[ e ];
+        PomMapFrozenSlot *slot = &slots[ entrySlot[ e ] ];
+        tags[ entrySlot[ e ] ] = POM_MAP_FROZEN_TAG( node->hash );
+        slot->hash = node->hash;
+        slot->keyLen = node->keyLen;
+        slot->valueLen = node->valueLen;
+        slot->keyOffset = dataOffset;
+        memcpy( data + dataOffset, pomMapGetNodeKey( _ctx, node ), (size_t) node->keyLen + 1 );
+        dataOffset += (size_t) node->keyLen + 1;
+        memcpy( data + dataOffset, pomMapGetNodeValue( _ctx, node ), (size_t) node->valueLen + 1 );
+        dataOffset += (size_t) node->valueLen + 1;
+    }
+
+    free( entrySlot );
+    free( slotEntry );
+    free( disp );
+    free( hashes );
+    free( entries );
+    return pomMapFrozenAttach( _frozen, block, header.blockSize, _ctx->hashFunc );
+}
+
+const char* pomMapFrozenGet( const PomMapFrozenCtx *_frozen, const char * _key, const char * _default ){
+    if( _frozen->numSlots == 0 ){
+        return _default;
+    }
+    size_t keyLen = strlen( _key );
+    uint64_t hash = _frozen->hashFunc( _key, keyLen, _frozen->seed );
+    uint64_t mixed = pomMapFrozenMix( hash ^ _frozen->salt );
+    uint32_t disp = _frozen->displacements[ pomMapFrozenReduce( mixed, _frozen->numGroups ) ];
+    uint32_t slotIdx = pomMapFrozenSlotIdx( mixed, disp, _frozen->numSlots );
+    if( _frozen->tags[ slotIdx ] != POM_MAP_FROZEN_TAG( hash ) ){
+        return _default;
+    }
+    const PomMapFrozenSlot *slot = &_frozen->slots[ slotIdx ];
+    const char *key = _frozen->data + slot->keyOffset;
+    if( slot->hash != hash || slot->keyLen != keyLen || memcmp( key, _key, keyLen ) != 0 ){
+        return _default;
+    }
+    return key + keyLen + 1;
+}
+
+int pomMapFrozenSave( const PomMapFrozenCtx *_frozen, const char *_path ){
+    FILE *file = fopen( _path, "wb" );
+    if( !file ){
+        return 1;
+    }
+    size_t written = fwrite( _frozen->block, 1, _frozen->blockSize, file );
+    if( fclose( file ) != 0 || written != _frozen->blockSize ){
+        return 1;
+    }
+    return 0;
+}
+
+int pomMapFrozenLoad( PomMapFrozenCtx *_frozen, const char *_path, PomMapHashFunc _hashFunc ){
+#ifdef POM_MAP_USE_MMAP
+    int fd = open( _path, O_RDONLY );
+    if( fd < 0 ){
+        return 1;
+    }
+    struct stat fileStat;
+    if( fstat( fd, &fileStat ) != 0 || fileStat.st_size < (off_t) sizeof( PomMapFrozenHeader ) ){
+        close( fd );
+        return 1;
+    }
+    size_t blockSize = (size_t) fileStat.st_size;
+    // The mapping stays valid after the descriptor is closed
+    void *mapping = mmap( NULL, blockSize, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if( mapping == MAP_FAILED ){
+        return 1;
+    }
+    uint8_t *block = (uint8_t*) mapping;
+    if( pomMapFrozenValidate( block, blockSize, _hashFunc ) ){
+        munmap( mapping, blockSize );
+        return 1;
+    }
+    pomMapFrozenAttach( _frozen, block, blockSize, _hashFunc );
+    _frozen->mapped = true;
+    return 0;
+#else
+    FILE *file = fopen( _path, "rb" );
+    if( !file ){
+        return 1;
+    }
+    fseek( file, 0, SEEK_END );
+    long fileSize = ftell( file );
+    fseek( file, 0, SEEK_SET );
+    if( fileSize < (long) sizeof( PomMapFrozenHeader ) ){
+        fclose( file );
+        return 1;
+    }
+    size_t blockSize = (size_t) fileSize;
+    uint8_t *block = (uint8_t*) malloc( blockSize );
+    size_t numRead = fread( block, 1, blockSize, file );
+    fclose( file );
+    if( numRead != blockSize || pomMapFrozenValidate( block, blockSize, _hashFunc ) ){
+        free( block );
+        return 1;
+    }
+    return pomMapFrozenAttach( _frozen, block, blockSize, _hashFunc );
+#endif
+}
+
+int pomMapFrozenClear( PomMapFrozenCtx *_frozen ){
+#ifdef POM_MAP_USE_MMAP
+    if( _frozen->mapped ){
+        munmap( _frozen->block, _frozen->blockSize );
+    }
+    else{
+        free( _frozen->block );
+    }
+#else
+    free( _frozen->block );
+#endif
+    _frozen->block = NULL;
+    _frozen->blockSize = 0;
+    _frozen->numSlots = 0;
+    return 0;
+}
+
+/*******************************************
+* Generic version - fixed-size keys/values
+********************************************/
+
+// Hash for integer keys, mixing the value with the seed
+uint64_t pomGMapHashInt( uint64_t _key, uint64_t _seed ){
+    return pomMapMum( _key ^ _seed ^ 0xa0761d6478bd642full, 0xe7037ed1a0b428dbull );
+}
+
+// Load a 4 or 8 byte integer key
+uint64_t pomGMapLoadInt( const void *_key, uint32_t _keySize ){
+    if( _keySize == sizeof( uint32_t ) ){
+        uint32_t key;
+        memcpy( &key, _key, sizeof( key ) );
+        return key;
+    }
+    uint64_t key;
+    memcpy( &key, _key, sizeof( key ) );
+    return key;
+}
+
+uint64_t pomGMapHashKey( PomGMapCtx *_ctx, const void *_key ){
+    if( _ctx->intKeys ){
+        return pomGMapHashInt( pomGMapLoadInt( _key, _ctx->keySize ), _ctx->seed );
+    }
+    if( _ctx->hashFunc ){
+        return _ctx->hashFunc( _key, _ctx->keySize, _ctx->seed );
+    }
+    return pomMapHashDefault( (const char*) _key, _ctx->keySize, _ctx->seed );
+}
+
+uint8_t * pomGMapSlot( PomGMapCtx *_ctx, uint32_t _idx ){
+    return _ctx->slots + (size_t) _idx * _ctx->slotSize;
+}
+
+// Find the slot holding `_key`, returning POM_MAP_NOT_FOUND if it doesn't exist
+uint32_t pomGMapFindSlot( PomGMapCtx *_ctx, const void *_key, uint64_t _hash ){
+    uint8_t tag = POM_MAP_H2( _hash );
+    uint32_t mask = _ctx->numBuckets - 1;
+    uint32_t pos = POM_MAP_H1( _hash ) & mask;
+    uint32_t stride = 0;
+    uint64_t intKey = _ctx->intKeys ? pomGMapLoadInt( _key, _ctx->keySize ) : 0;
+
+    while( 1 ){
+        PomMapGroupMask match = pomMapGroupMatch( _ctx->ctrl + pos, tag );
+        while( match ){
+            uint32_t idx = ( pos + pomMapMaskLowest( match ) ) & mask;
+            const uint8_t * slotKey = pomGMapSlot( _ctx, idx );
+            bool equal;
+            if( _ctx->intKeys ){
+                equal = pomGMapLoadInt( slotKey, _ctx->keySize ) == intKey;
+            }
+            else if( _ctx->equalFunc ){
+                equal = _ctx->equalFunc( _key, slotKey, _ctx->keySize );
+            }
+            else{
+                equal = memcmp( _key, slotKey, _ctx->keySize ) == 0;
+            }
+            if( equal ){
+                return idx;
+            }
+            match &= match - 1;
+        }
+        if( pomMapGroupMatchEmpty( _ctx->ctrl + pos ) ){
+            return POM_MAP_NOT_FOUND;
+        }
+        stride += POM_MAP_GROUP_WIDTH;
+        pos = ( pos + stride ) & mask;
+    }
+}
+
+int pomGMapRehash( PomGMapCtx *_ctx, uint32_t _size ){
+    uint8_t * oldSlots = _ctx->slots;
+    uint8_t * oldCtrl = _ctx->ctrl;
+    uint32_t oldNumBuckets = _ctx->numBuckets;
+
+    _ctx->slots = (uint8_t*) malloc( (size_t) _size * _ctx->slotSize );
+    _ctx->ctrl = pomMapAllocCtrl( _size );
+    _ctx->numBuckets = _size;
+    _ctx->numTombstones = 0;
+
+    for( uint32_t i = 0; i < oldNumBuckets; i++ ){
+        if( !POM_MAP_CTRL_IS_FULL( oldCtrl[ i ] ) ){
+            continue;
+        }
+        const uint8_t * oldSlot = oldSlots + (size_t) i * _ctx->slotSize;
+        uint64_t hash = pomGMapHashKey( _ctx, oldSlot );
+        uint32_t idx = pomMapFindFree( _ctx->ctrl, _size, hash );
+        pomMapSetCtrl( _ctx->ctrl, _size, idx, POM_MAP_H2( hash ) );
+        memcpy( pomGMapSlot( _ctx, idx ), oldSlot, _ctx->slotSize );
+    }
+
+    free( oldSlots );
+    free( oldCtrl );
+    return 0;
+}
+
+// Insert a key known not to be in the map, returning a pointer to its value
+void * pomGMapInsert( PomGMapCtx *_ctx, const void *_key, uint64_t _hash, const void *_value ){
+    uint32_t idx = pomMapFindFree( _ctx->ctrl, _ctx->numBuckets, _hash );
+    if( _ctx->ctrl[ idx ] == POM_MAP_CTRL_EMPTY ){
+        uint32_t newSize = pomMapGrowSize( _ctx->numBuckets, _ctx->numNodes, _ctx->numTombstones );
+        if( newSize ){
+            pomGMapRehash( _ctx, newSize );
+            idx = pomMapFindFree( _ctx->ctrl, _ctx->numBuckets, _hash );
+        }
+    }
+    if( _ctx->ctrl[ idx ] == POM_MAP_CTRL_DELETED ){
+        _ctx->numTombstones--;
+    }
+    uint8_t * slot = pomGMapSlot( _ctx, idx );
+    memcpy( slot, _key, _ctx->keySize );
+    memcpy( slot + _ctx->valueOffset, _value, _ctx->valueSize );
+    pomMapSetCtrl( _ctx->ctrl, _ctx->numBuckets, idx, POM_MAP_H2( _hash ) );
+    _ctx->numNodes++;
+    return slot + _ctx->valueOffset;
+}
+
+int pomGMapInit( PomGMapCtx *_ctx, uint32_t _size, uint32_t _keySize, uint32_t _valueSize,
+                 PomGMapHashFunc _hashFunc, PomGMapEqualFunc _equalFunc, uint64_t _seed ){
+    if( _keySize == 0 ){
+        return 1;
+    }
+    if( _size == 0 ){
+        _size = POM_MAP_DEFAULT_SIZE;
+    }
+    _size = pomNextPwrTwo( _size );
+    if( _size < POM_MAP_GROUP_WIDTH ){
+        _size = POM_MAP_GROUP_WIDTH;
+    }
+
+    // Slots are key then value, with both padded out to 8 bytes so values are aligned
+    _ctx->keySize = _keySize;
+    _ctx->valueSize = _valueSize;
+    _ctx->valueOffset = ( _keySize + 7 ) & ~7u;
+    _ctx->slotSize = _ctx->valueOffset + ( ( _valueSize + 7 ) & ~7u );
+    _ctx->hashFunc = _hashFunc;
+    _ctx->equalFunc = _equalFunc;
+    _ctx->seed = _seed;
+    // Plain 4/8 byte keys get hashed and compared directly as integers
+    _ctx->intKeys = !_hashFunc && !_equalFunc &&
+                    ( _keySize == sizeof( uint32_t ) || _keySize == sizeof( uint64_t ) );
+
+    _ctx->slots = (uint8_t*) malloc( (size_t) _size * _ctx->slotSize );
+    _ctx->ctrl = pomMapAllocCtrl( _size );
+    _ctx->numBuckets = _size;
+    _ctx->numNodes = 0;
+    _ctx->numTombstones = 0;
+    return 0;
+}
+
+void * pomGMapGet( PomGMapCtx *_ctx, const void *_key ){
+    uint32_t idx = pomGMapFindSlot( _ctx, _key, pomGMapHashKey( _ctx, _key ) );
+    if( idx == POM_MAP_NOT_FOUND ){
+        return NULL;
+    }
+    return pomGMapSlot( _ctx, idx ) + _ctx->valueOffset;
+}
+
+void * pomGMapSet( PomGMapCtx *_ctx, const void *_key, const void *_value ){
+    uint64_t hash = pomGMapHashKey( _ctx, _key );
+    uint32_t idx = pomGMapFindSlot( _ctx, _key, hash );
+    if( idx != POM_MAP_NOT_FOUND ){
+        // Overwrite the existing value in place
+        uint8_t * value = pomGMapSlot( _ctx, idx ) + _ctx->valueOffset;
+        memcpy( value, _value, _ctx->valueSize );
+        return value;
+    }
+    return pomGMapInsert( _ctx, _key, hash, _value );
+}
+
+void * pomGMapGetSet( PomGMapCtx *_ctx, const void *_key, const void *_default ){
+    uint64_t hash = pomGMapHashKey( _ctx, _key );
+    uint32_t idx = pomGMapFindSlot( _ctx, _key, hash );
+    if( idx != POM_MAP_NOT_FOUND ){
+        return pomGMapSlot( _ctx, idx ) + _ctx->valueOffset;
+    }
+    return pomGMapInsert( _ctx, _key, hash, _default );
+}
+
+int pomGMapRemove( PomGMapCtx *_ctx, const void *_key ){
+    uint32_t idx = pomGMapFindSlot( _ctx, _key, pomGMapHashKey( _ctx, _key ) );
+    if( idx == POM_MAP_NOT_FOUND ){
+        return 1;
+    }
+    _ctx->numTombstones += pomMapEraseCtrl( _ctx->ctrl, _ctx->numBuckets, idx );
+    _ctx->numNodes--;
+    return 0;
+}
+
+int pomGMapClear( PomGMapCtx *_ctx ){
+    free( _ctx->slots );
+    free( _ctx->ctrl );
+    _ctx->slots = NULL;
+    _ctx->ctrl = NULL;
+    _ctx->numBuckets = 0;
+    _ctx->numNodes = 0;
+    _ctx->numTombstones = 0;
+    return 0;
+}
+
+/*******************************************
+* Thread-safe version - striped locks
+********************************************/
+
+// Number of writer lock stripes. Also the minimum number of buckets, so that all
+// entries of a bucket always fall under the same stripe
+#define POM_MAP_TS_STRIPES 64
+// Grow the table once there's more than this many entries per bucket on average
+#define POM_MAP_TS_MAX_LOAD 2
+
+// Hazard pointer slots used by each thread
+#define POM_MAP_TS_HP_TABLE 0
+#define POM_MAP_TS_HP_BUCKET 1
+#define POM_MAP_TS_NUM_HP 2
+
+// Retired snapshots are pooled per stripe in power-of-two size classes (64B to 4KB)
+// and handed back out under the stripe lock, so steady-state writes don't reach malloc
+#define POM_MAP_TS_POOL_MIN_SHIFT 6
+#define POM_MAP_TS_POOL_CLASSES 7
+// Most snapshots kept per class per stripe
+#define POM_MAP_TS_POOL_DEPTH 32
+
+// Entry in a bucket snapshot, followed by the NUL-terminated key and value
+typedef struct PomMapTsEntry{
+    uint64_t hash;
+    uint32_t keyLen;
+    uint32_t valueLen;
+}PomMapTsEntry;
+
+// Immutable snapshot of a bucket's entries, which follow the header. The node
+// comes first so snapshots can be protected/retired with the hazard pointer module.
+// Pooled snapshots point `node.data` back at the map
+typedef struct PomMapTsChain{
+    PomCommonNode node;
+    uint32_t numEntries;
+    uint32_t dataSize;
+    uint16_t stripe;
+    uint16_t sizeClass;
+}PomMapTsChain;
+
+// Bucket array follows the table header in the same allocation
+struct PomMapTsTable{
+    PomCommonNode node;
+    uint32_t numBuckets;
+    PomMapTsChain * _Atomic *buckets;
+};
+
+// Stripes are aligned to a cache line each so writers on different stripes don't
+// contend on the same line. The stripe lock also guards its snapshot pool
+struct PomMapTsStripe{
+    _Alignas( POM_CACHE_LINE_SIZE ) mtx_t lock;
+    PomCommonNode *pool[ POM_MAP_TS_POOL_CLASSES ];
+    uint32_t poolCount[ POM_MAP_TS_POOL_CLASSES ];
+};
+
+inline size_t pomMapTsEntrySize( uint32_t _keyLen, uint32_t _valueLen );
+inline PomMapTsEntry * pomMapTsChainEntries( PomMapTsChain *_chain );
+inline PomMapTsEntry * pomMapTsNextEntry( PomMapTsEntry *_entry );
+
+// Entries are padded to keep the following entry's header aligned
+size_t pomMapTsEntrySize( uint32_t _keyLen, uint32_t _valueLen ){
+    return ( sizeof( PomMapTsEntry ) + _keyLen + _valueLen + 2 + 7 ) & ~(size_t) 7;
+}
+
+PomMapTsEntry * pomMapTsChainEntries( PomMapTsChain *_chain ){
+    return (PomMapTsEntry*) ( _chain + 1 );
+}
+
+PomMapTsEntry * pomMapTsNextEntry( PomMapTsEntry *_entry ){
+    return (PomMapTsEntry*) ( (char*) _entry + pomMapTsEntrySize( _entry->keyLen, _entry->valueLen ) );
+}
+
+// Release handler for the hazard pointer context. Tables and oversized snapshots
+// are freed, other snapshots go back to their stripe's pool
+void pomMapTsFreeNode( PomCommonNode *_node ){
+    PomMapTsCtx *ctx = (PomMapTsCtx*) _node->data;
+    if( ctx ){
+        PomMapTsChain *chain = (PomMapTsChain*) _node;
+        PomMapTsStripe *stripe = &ctx->stripes[ chain->stripe ];
+        mtx_lock( &stripe->lock );
+        if( stripe->poolCount[ chain->sizeClass ] < POM_MAP_TS_POOL_DEPTH ){
+            _node->next = stripe->pool[ chain->sizeClass ];
+            stripe->pool[ chain->sizeClass ] = _node;
+            stripe->poolCount[ chain->sizeClass ]++;
+            mtx_unlock( &stripe->lock );
+            return;
+        }
+        mtx_unlock( &stripe->lock );
+    }
+    free( _node );
+}
+
+PomMapTsTable * pomMapTsAllocTable( uint32_t _numBuckets ){
+    PomMapTsTable *table = (PomMapTsTable*) malloc( sizeof( PomMapTsTable ) +
+                                                    sizeof( PomMapTsChain * _Atomic ) * _numBuckets );
+    table->node.next = NULL;
+    table->node.data = NULL;
+    table->numBuckets = _numBuckets;
+    table->buckets = (PomMapTsChain * _Atomic *) ( table + 1 );
+    for( uint32_t i = 0; i < _numBuckets; i++ ){
+        atomic_init( &table->buckets[ i ], NULL );
+    }
+    return table;
+}
+
+// Allocate a snapshot for a bucket in `_stripe`, which the caller must hold
+PomMapTsChain * pomMapTsAllocChain( PomMapTsCtx *_ctx, uint32_t _stripe, uint32_t _numEntries, uint32_t _dataSize ){
+    size_t size = sizeof( PomMapTsChain ) + _dataSize;
+    uint32_t sizeClass = 0;
+    while( sizeClass < POM_MAP_TS_POOL_CLASSES &&
+           ( (size_t) 1 << ( sizeClass + POM_MAP_TS_POOL_MIN_SHIFT ) ) < size ){
+        sizeClass++;
+    }
+    PomMapTsChain *chain;
+    if( sizeClass < POM_MAP_TS_POOL_CLASSES ){
+        PomMapTsStripe *stripe = &_ctx->stripes[ _stripe ];
+        chain = (PomMapTsChain*) stripe->pool[ sizeClass ];
+        if( chain ){
+            stripe->pool[ sizeClass ] = chain->node.next;
+            stripe->poolCount[ sizeClass ]--;
+        }else{
+            // Round up so the snapshot can be reused by anything in its class
+            chain = (PomMapTsChain*) malloc( (size_t) 1 << ( sizeClass + POM_MAP_TS_POOL_MIN_SHIFT ) );
+        }
+        chain->node.data = _ctx;
+    }else{
+        chain = (PomMapTsChain*) malloc( size );
+        chain->node.data = NULL;
+    }
+    chain->node.next = NULL;
+    chain->stripe = (uint16_t) _stripe;
+    chain->sizeClass = (uint16_t) sizeClass;
+    chain->numEntries = _numEntries;
+    chain->dataSize = _dataSize;
+    return chain;
+}
+
+PomMapTsEntry * pomMapTsChainFind( PomMapTsChain *_chain, const char *_key, size_t _keyLen, uint64_t _hash ){
+    if( !_chain ){
+        return NULL;
+    }
+    PomMapTsEntry *entry = pomMapTsChainEntries( _chain );
+    for( uint32_t i = 0; i < _chain->numEntries; i++ ){
+        if( entry->hash == _hash && entry->keyLen == _keyLen &&
+            memcmp( entry + 1, _key, _keyLen ) == 0 ){
+            return entry;
+        }
+        entry = pomMapTsNextEntry( entry );
+    }
+    return NULL;
+}
+
+// Protect the current table with a hazard pointer
+PomMapTsTable * pomMapTsProtectTable( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx ){
+    PomMapTsTable *table;
+    do{
+        table = atomic_load( &_ctx->table );
+        pomHpSetHazard( _lctx, &table->node, POM_MAP_TS_HP_TABLE );
+    }while( table != atomic_load( &_ctx->table ) );
+    return table;
+}
+
+// Grow the table to `_size` buckets. Takes every stripe, so no writer sees a
+// half-built table
+int pomMapTsRehash( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx, uint32_t _size ){
+    for( uint32_t s = 0; s < POM_MAP_TS_STRIPES; s++ ){
+        mtx_lock( &_ctx->stripes[ s ].lock );
+    }
+    PomMapTsTable *oldTable = atomic_load( &_ctx->table );
+    if( _size <= oldTable->numBuckets ){
+        // Someone else grew the table first
+        for( uint32_t s = 0; s < POM_MAP_TS_STRIPES; s++ ){
+            mtx_unlock( &_ctx->stripes[ s ].lock );
+        }
+        return 0;
+    }
+    LOG( "Resizing concurrent map to %u buckets", _size );
+
+    // Size up the new snapshots first so each is only allocated once
+    PomMapTsTable *newTable = pomMapTsAllocTable( _size );
+    uint32_t *counts = (uint32_t*) calloc( _size, sizeof( uint32_t ) );
+    uint32_t *sizes = (uint32_t*) calloc( _size, sizeof( uint32_t ) );
+    for( uint32_t i = 0; i < oldTable->numBuckets; i++ ){
+        PomMapTsChain *chain = atomic_load( &oldTable->buckets[ i ] );
+        if( !chain ){
+            continue;
+        }
+        PomMapTsEntry *entry = pomMapTsChainEntries( chain );
+        for( uint32_t e = 0; e < chain->numEntries; e++ ){
+            uint32_t idx = (uint32_t) ( entry->hash & ( _size - 1 ) );
+            counts[ idx ]++;
+            sizes[ idx ] += pomMapTsEntrySize( entry->keyLen, entry->valueLen );
+            entry = pomMapTsNextEntry( entry );
+        }
+    }
+    for( uint32_t i = 0; i < _size; i++ ){
+        if( counts[ i ] ){
+            atomic_init( &newTable->buckets[ i ], pomMapTsAllocChain( _ctx, i & ( POM_MAP_TS_STRIPES - 1 ),
+                                                                           counts[ i ], sizes[ i ] ) );
+        }
+        sizes[ i ] = 0;
+    }
+
+    // Copy entries across, reusing `sizes` as each snapshot's fill offset
+    for( uint32_t i = 0; i < oldTable->numBuckets; i++ ){
+        PomMapTsChain *chain = atomic_load( &oldTable->buckets[ i ] );
+        if( !chain ){
+            continue;
+        }
+        PomMapTsEntry *entry = pomMapTsChainEntries( chain );
+        for( uint32_t e = 0; e < chain->numEntries; e++ ){
+            uint32_t idx = (uint32_t) ( entry->hash & ( _size - 1 ) );
+            uint32_t entrySize = pomMapTsEntrySize( entry->keyLen, entry->valueLen );
+            PomMapTsChain *newChain = atomic_load( &newTable->buckets[ idx ] );
+            memcpy( (char*) pomMapTsChainEntries( newChain ) + sizes[ idx ], entry, entrySize );
+            sizes[ idx ] += entrySize;
+            entry = pomMapTsNextEntry( entry );
+        }
+    }
+    free( counts );
+    free( sizes );
+
+    atomic_store( &_ctx->table, newTable );
+    for( uint32_t s = 0; s < POM_MAP_TS_STRIPES; s++ ){
+        mtx_unlock( &_ctx->stripes[ s ].lock );
+    }
+
+    // Readers may still be using the old table and snapshots
+    for( uint32_t i = 0; i < oldTable->numBuckets; i++ ){
+        PomMapTsChain *chain = atomic_load( &oldTable->buckets[ i ] );
+        if( chain ){
+            pomHpRetireNode( &_ctx->hpCtx, _lctx, &chain->node );
+        }
+    }
+    pomHpRetireNode( &_ctx->hpCtx, _lctx, &oldTable->node );
+    return 0;
+}
+
+// Replace the key's bucket snapshot with a copy that has the key set to `_value`,
+// or removed if `_value` is NULL. Returns 1 if the key was found
+int pomMapTsUpdate( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx, const char * _key, const char * _value ){
+    size_t keyLen = strlen( _key );
+    size_t valueLen = _value ? strlen( _value ) : 0;
+    uint64_t hash = _ctx->hashFunc( _key, keyLen, _ctx->seed );
+    uint32_t stripe = (uint32_t) ( hash & ( POM_MAP_TS_STRIPES - 1 ) );
+    mtx_t *lock = &_ctx->stripes[ stripe ].lock;
+    mtx_lock( lock );
+
+    // Table can't be swapped out while we hold a stripe, so it doesn't need protecting
+    PomMapTsTable *table = atomic_load( &_ctx->table );
+    PomMapTsChain * _Atomic *bucket = &table->buckets[ hash & ( table->numBuckets - 1 ) ];
+    PomMapTsChain *oldChain = atomic_load( bucket );
+    PomMapTsEntry *oldEntry = pomMapTsChainFind( oldChain, _key, keyLen, hash );
+    if( !_value && !oldEntry ){
+        mtx_unlock( lock );
+        return 0;
+    }
+
+    uint32_t numEntries = oldChain ? oldChain->numEntries : 0;
+    uint32_t dataSize = oldChain ? oldChain->dataSize : 0;
+    if( oldEntry ){
+        numEntries--;
+        dataSize -= pomMapTsEntrySize( oldEntry->keyLen, oldEntry->valueLen );
+    }
+    if( _value ){
+        numEntries++;
+        dataSize += pomMapTsEntrySize( keyLen, valueLen );
+    }
+
+    PomMapTsChain *newChain = NULL;
+    if( numEntries ){
+        newChain = pomMapTsAllocChain( _ctx, stripe, numEntries, dataSize );
+        char *dst = (char*) pomMapTsChainEntries( newChain );
+        // Copy across everything but the entry being replaced/removed
+        if( oldChain ){
+            PomMapTsEntry *entry = pomMapTsChainEntries( oldChain );
+            for( uint32_t i = 0; i < oldChain->numEntries; i++ ){
+                size_t entrySize = pomMapTsEntrySize( entry->keyLen, entry->valueLen );
+                if( entry != oldEntry ){
+                    memcpy( dst, entry, entrySize );
+                    dst += entrySize;
+                }
+                entry = (PomMapTsEntry*) ( (char*) entry + entrySize );
+            }
+        }
+        if( _value ){
+            PomMapTsEntry *entry = (PomMapTsEntry*) dst;
+            entry->hash = hash;
+            entry->keyLen = (uint32_t) keyLen;
+            entry->valueLen = (uint32_t) valueLen;
+            memcpy( entry + 1, _key, keyLen + 1 );
+            memcpy( (char*) ( entry + 1 ) + keyLen + 1, _value, valueLen + 1 );
+        }
+    }
+    atomic_store( bucket, newChain );
+
+    bool grow = false;
+    if( _value && !oldEntry ){
+        uint32_t numNodes = atomic_fetch_add( &_ctx->numNodes, 1 ) + 1;
+        grow = numNodes > table->numBuckets * POM_MAP_TS_MAX_LOAD;
+    }else if( !_value ){
+        atomic_fetch_sub( &_ctx->numNodes, 1 );
+    }
+    uint32_t numBuckets = table->numBuckets;
+    mtx_unlock( lock );
+
+    if( oldChain ){
+        pomHpRetireNode( &_ctx->hpCtx, _lctx, &oldChain->node );
+    }
+    if( grow ){
+        pomMapTsRehash( _ctx, _lctx, numBuckets * 2 );
+    }
+    return oldEntry != NULL;
+}
+
+int pomMapTsInit( PomMapTsCtx *_ctx, uint32_t _size, PomMapHashFunc _hashFunc, uint64_t _seed ){
+    uint32_t numBuckets = pomNextPwrTwo( _size / POM_MAP_TS_MAX_LOAD );
+    if( numBuckets < POM_MAP_TS_STRIPES ){
+        numBuckets = POM_MAP_TS_STRIPES;
+    }
+    atomic_init( &_ctx->table, pomMapTsAllocTable( numBuckets ) );
+    atomic_init( &_ctx->numNodes, 0 );
+    _ctx->hashFunc = _hashFunc ? _hashFunc : pomMapHashDefault;
+    _ctx->seed = _seed;
+
+    _ctx->stripes = (PomMapTsStripe*) aligned_alloc( POM_CACHE_LINE_SIZE,
+                                                     sizeof( PomMapTsStripe ) * POM_MAP_TS_STRIPES );
+    for( uint32_t s = 0; s < POM_MAP_TS_STRIPES; s++ ){
+        mtx_init( &_ctx->stripes[ s ].lock, mtx_plain );
+        for( uint32_t c = 0; c < POM_MAP_TS_POOL_CLASSES; c++ ){
+            _ctx->stripes[ s ].pool[ c ] = NULL;
+            _ctx->stripes[ s ].poolCount[ c ] = 0;
+        }
+    }
+
+    pomHpGlobalInit( &_ctx->hpCtx );
+    pomHpSetReleaseFunc( &_ctx->hpCtx, pomMapTsFreeNode );
+    return 0;
+}
+
+int pomMapTsThreadInit( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx ){
+    return pomHpThreadInit( &_ctx->hpCtx, _lctx, POM_MAP_TS_NUM_HP );
+}
+
+const char* pomMapTsGet( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx, const char * _key, const char * _default ){
+    size_t keyLen = strlen( _key );
+    uint64_t hash = _ctx->hashFunc( _key, keyLen, _ctx->seed );
+    PomMapTsChain *chain;
+    while( 1 ){
+        PomMapTsTable *table = pomMapTsProtectTable( _ctx, _lctx );
+        PomMapTsChain * _Atomic *bucket = &table->buckets[ hash & ( table->numBuckets - 1 ) ];
+        chain = atomic_load( bucket );
+        pomHpSetHazard( _lctx, (PomCommonNode*) chain, POM_MAP_TS_HP_BUCKET );
+        // The snapshot is only safe if it's still in the bucket, and the table is still
+        // current, since a resize retires every snapshot of the old table
+        if( chain == atomic_load( bucket ) && table == atomic_load( &_ctx->table ) ){
+            break;
+        }
+    }
+    pomHpSetHazard( _lctx, NULL, POM_MAP_TS_HP_TABLE );
+
+    PomMapTsEntry *entry = pomMapTsChainFind( chain, _key, keyLen, hash );
+    if( !entry ){
+        pomHpSetHazard( _lctx, NULL, POM_MAP_TS_HP_BUCKET );
+        return _default;
+    }
+    return (const char*) ( entry + 1 ) + entry->keyLen + 1;
+}
+
+int pomMapTsRelease( PomMapTsCtx *UNUSED( _ctx ), PomHpLocalCtx *_lctx ){
+    pomHpSetHazard( _lctx, NULL, POM_MAP_TS_HP_BUCKET );
+    return 0;
+}
+
+int pomMapTsSet( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx, const char * _key, const char * _value ){
+    // Drop any snapshot still held from a previous get
+    pomHpSetHazard( _lctx, NULL, POM_MAP_TS_HP_BUCKET );
+    pomMapTsUpdate( _ctx, _lctx, _key, _value );
+    return 0;
+}
+
+int pomMapTsRemove( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx, const char * _key ){
+    pomHpSetHazard( _lctx, NULL, POM_MAP_TS_HP_BUCKET );
+    return pomMapTsUpdate( _ctx, _lctx, _key, NULL ) ? 0 : 1;
+}
+
+int pomMapTsThreadClear( PomMapTsCtx *_ctx, PomHpLocalCtx *_lctx ){
+    return pomHpThreadClear( &_ctx->hpCtx, _lctx );
+}
+
+int pomMapTsClear( PomMapTsCtx *_ctx ){
+    PomMapTsTable *table = atomic_load( &_ctx->table );
+    for( uint32_t i = 0; i < table->numBuckets; i++ ){
+        free( atomic_load( &table->buckets[ i ] ) );
+    }
+    free( table );
+    atomic_store( &_ctx->table, NULL );
+    atomic_store( &_ctx->numNodes, 0 );
+
+    for( uint32_t s = 0; s < POM_MAP_TS_STRIPES; s++ ){
+        for( uint32_t c = 0; c < POM_MAP_TS_POOL_CLASSES; c++ ){
+            PomCommonNode *node = _ctx->stripes[ s ].pool[ c ];
+            while( node ){
+                PomCommonNode *next = node->next;
+                free( node );
+                node = next;
+            }
+        }
+        mtx_destroy( &_ctx->stripes[ s ].lock );
+    }
+    free( _ctx->stripes );
+    _ctx->stripes = NULL;
+
+    pomHpGlobalClear( &_ctx->hpCtx );
+    return 0;
+}
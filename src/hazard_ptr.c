@@ -28,7 +28,7 @@ int pomHpStackInit( PomHpStackCtx *_ctx );
 PomCommonNode* pomHpStackDestroy( PomHpStackCtx *_ctx );
 
 // Pop a single item off the stack
-PomCommonNode* pomHpStackPop( PomHpStackCtx *_ctx );
+PomCommonNode* pomHpStackPop( PomHpStackCtx *_ctx, PomHpLocalCtx *_lctx );
 
 // Push a single item onto the stack
 int pomHpStackPush( PomHpStackCtx *_ctx, PomCommonNode * _data );
@@ -43,6 +43,12 @@ struct PomHpRec{
 };
 
 int pomHpScan( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx );
+void pomHpReleaseNode( PomHpGlobalCtx *_ctx, PomCommonNode *_node );
+
+// Retired lists end in this sentinel rather than NULL, so a retired node's next pointer
+// never reads as NULL. Lock-free lists (e.g. the queue) CAS a protected node's next from
+// NULL to append, which mustn't succeed on a node that's already been retired
+static PomCommonNode pomHpRetiredEnd;
 
 int pomHpGlobalInit( PomHpGlobalCtx *_ctx ){
     PomHpRec* newHead = (PomHpRec*) malloc( sizeof( PomHpRec ) ); // Dummy node
@@ -52,6 +58,7 @@ int pomHpGlobalInit( PomHpGlobalCtx *_ctx ){
     atomic_init( &_ctx->rNodeThreshold, 10 ); // TODO have a proper threshold
     _ctx->releasedPtrs = (PomHpStackCtx*) malloc( sizeof( PomHpStackCtx ) );
     pomHpStackInit( _ctx->releasedPtrs );
+    _ctx->releaseFunc = NULL;
 
     atomic_init( &_ctx->allocCntr, 0 );
     atomic_init( &_ctx->freeCntr, 0 );
@@ -61,16 +68,16 @@ int pomHpGlobalInit( PomHpGlobalCtx *_ctx ){
 
 int pomHpThreadInit( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx, size_t _numHp ){
     
-    // Create new HP records for this thread
-    PomHpRec *newHps = (PomHpRec*) malloc( sizeof( PomHpRec ) * _numHp );
-    atomic_init( &newHps[ 0 ].hazardPtr, NULL );
-    atomic_init( &newHps[ 0 ].next, NULL );
-    for( uint32_t i = 1; i < _numHp; i++ ){
+    // Create new HP records for this thread, plus one more after the caller's for
+    // popping the released list, so requesting a node never disturbs their hazards
+    size_t numRecs = _numHp + 1;
+    PomHpRec *newHps = (PomHpRec*) malloc( sizeof( PomHpRec ) * numRecs );
+    for( uint32_t i = 1; i < numRecs; i++ ){
         atomic_init( &newHps[ i-1 ].hazardPtr, NULL );
         atomic_init( &newHps[ i-1 ].next, &newHps[ i ] );
     }
-    atomic_init( &newHps[ _numHp - 1 ].hazardPtr, NULL );
-    atomic_init( &newHps[ _numHp - 1 ].next, NULL );
+    atomic_init( &newHps[ numRecs - 1 ].hazardPtr, NULL );
+    atomic_init( &newHps[ numRecs - 1 ].next, NULL );
     // TODO - Make sure the new hazard pointers are set before proceeding
     // (i.e. make sure this fence and the relaxed inits make sense)
     //atomic_thread_fence( memory_order_release );
@@ -78,32 +85,35 @@ int pomHpThreadInit( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx, size_t _numHp )
     _lctx->hp = newHps;
     _lctx->rlist = (PomStackCtx*) malloc( sizeof( PomStackCtx ) );
     pomStackInit( _lctx->rlist );
+    _lctx->rlist->head = &pomHpRetiredEnd;
     _lctx->numHp = _numHp;
     _lctx->rcount = 0;
 
     // Try to emplace the new hazard pointers onto the list
     // TODO - for now we're assuming the global HPrec can't have nodes removed from it
     // so fix that at some point.
-    // TODO - make the next-reads atomic
-    PomHpRec * _Atomic currNode;
+    PomHpRec *currNode;
     PomHpRec *expNode = NULL;
-    currNode = _ctx->hpHead;
+    currNode = atomic_load_explicit( &_ctx->hpHead, POM_MO_ACQUIRE );
     while( 1 ){
-        if( !currNode->next ){
-            // If we think we're at the tail, try slot our nodes into it, provided it's still NULL
-            // TODO - consider making this memory_order_release
-            if( atomic_compare_exchange_weak( &currNode->next, &expNode, newHps ) ){
+        PomHpRec *nextNode = atomic_load_explicit( &currNode->next, POM_MO_ACQUIRE );
+        if( !nextNode ){
+            // If we think we're at the tail, try slot our nodes into it, provided it's still NULL.
+            // Release publishes the initialised records to scanning threads
+            if( atomic_compare_exchange_weak_explicit( &currNode->next, &expNode, newHps,
+                                                       POM_MO_RELEASE, POM_MO_RELAXED ) ){
                 // Tail was set
                 break;
             }
             else{
                 // Tail was not set, so start over
-                currNode = _ctx->hpHead;
+                expNode = NULL;
+                currNode = atomic_load_explicit( &_ctx->hpHead, POM_MO_ACQUIRE );
                 continue;
             }
         }
         else{
-            currNode = currNode->next;
+            currNode = nextNode;
         }
     }
     return 0;
@@ -118,11 +128,11 @@ int pomHpThreadClear( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx ){
     // TODO - ensure theres no double-freeing (might not be a problem)
     PomCommonNode *retireNodes = pomStackPopAll( _lctx->rlist );
     PomCommonNode *currNode = retireNodes;
-    while( currNode ){
-        PomCommonNode * nextNode = currNode->next;
+    while( currNode != &pomHpRetiredEnd ){
+        PomCommonNode * nextNode = atomic_load_explicit( &currNode->aNext, POM_MO_RELAXED );
         // Free the stack node and the queue node hazard pointer)
-        currNode->next = NULL;
-        pomHpStackPush( _ctx->releasedPtrs, currNode );
+        atomic_store_explicit( &currNode->aNext, NULL, POM_MO_RELAXED );
+        pomHpReleaseNode( _ctx, currNode );
         currNode = nextNode;
     }
 
@@ -134,14 +144,37 @@ int pomHpThreadClear( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx ){
 }
 
 PomCommonNode *pomHpRequestNode( PomHpGlobalCtx *_ctx ){
-    PomCommonNode *nNode = pomHpStackPop( _ctx->releasedPtrs );
+    // Popping the released list safely needs a hazard pointer, so always allocate
+    PomCommonNode *nNode = (PomCommonNode*) malloc( sizeof( PomCommonNode ) );
+    atomic_fetch_add_explicit( &_ctx->allocCntr, 1, POM_MO_RELAXED );
+    atomic_store_explicit( &nNode->aNext, NULL, POM_MO_RELAXED );
+    return nNode;
+}
+
+PomCommonNode *pomHpRequestNodeLocal( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx ){
+    PomCommonNode *nNode = pomHpStackPop( _ctx->releasedPtrs, _lctx );
     if( !nNode ){
         nNode = (PomCommonNode*) malloc( sizeof( PomCommonNode ) );
-        atomic_fetch_add( &_ctx->allocCntr, 1 );
+        atomic_fetch_add_explicit( &_ctx->allocCntr, 1, POM_MO_RELAXED );
     }
-    atomic_store( &nNode->aNext, NULL );
+    atomic_store_explicit( &nNode->aNext, NULL, POM_MO_RELAXED );
     return nNode;
 }
+
+int pomHpSetReleaseFunc( PomHpGlobalCtx *_ctx, PomHpReleaseFunc _releaseFunc ){
+    _ctx->releaseFunc = _releaseFunc;
+    return 0;
+}
+
+// Pass a node that's no longer a hazard to the release handler, or back to the released list
+void pomHpReleaseNode( PomHpGlobalCtx *_ctx, PomCommonNode *_node ){
+    if( _ctx->releaseFunc ){
+        _ctx->releaseFunc( _node );
+        return;
+    }
+    pomHpStackPush( _ctx->releasedPtrs, _node );
+}
+
 #include <stdio.h>
 // Clear the global hazard pointer data
 int pomHpGlobalClear( PomHpGlobalCtx *_ctx ){
@@ -150,7 +183,7 @@ int pomHpGlobalClear( PomHpGlobalCtx *_ctx ){
         PomCommonNode *nNode = rNode->next;
         free( rNode );
         rNode = nNode;
-        atomic_fetch_add( &_ctx->freeCntr, 1 );
+        atomic_fetch_add_explicit( &_ctx->freeCntr, 1, POM_MO_RELAXED );
     }
     free( _ctx->releasedPtrs );
     // Just need to free the dummy node at the head of the list
@@ -167,33 +200,33 @@ int pomHpScan( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx ){
     // Stage 1 - scan each thread's hazard pointers and add non-null values to local list
     PomLinkedListCtx plist;
     pomLinkedListInit( &plist );
-    // TODO - consider making the HpRec loads memory_order_acquire
-    // They're current seq_cst so hazardPtr should be loaded OK despite 
-    // being stored with mem_order_relaxed
-    PomHpRec * hpRec = atomic_load( &_ctx->hpHead );
+    // The hazard loads have to be seq_cst to pair with the seq_cst hazard stores and
+    // re-checks. The records themselves only need acquiring
+    PomHpRec * hpRec = atomic_load_explicit( &_ctx->hpHead, POM_MO_ACQUIRE );
     while( hpRec ){
-        void * ptr = atomic_load( &hpRec->hazardPtr );
+        void * ptr = atomic_load_explicit( &hpRec->hazardPtr, POM_MO_SEQ_CST );
         if( ptr ){
             pomLinkedListAdd( &plist, (PllKeyType) ptr );
         }
-        hpRec = atomic_load( &hpRec->next );
+        hpRec = atomic_load_explicit( &hpRec->next, POM_MO_ACQUIRE );
     }
 
     // Stage 2 - check plist for the nodes we're trying to retire
     PomCommonNode *retireNodes = pomStackPopAll( _lctx->rlist );
+    _lctx->rlist->head = &pomHpRetiredEnd;
     _lctx->rcount = 0;
 
     PomCommonNode *currNode = retireNodes;
-    while( currNode ){
-        PomCommonNode * nextNode = currNode->next;
+    while( currNode != &pomHpRetiredEnd ){
+        PomCommonNode * nextNode = atomic_load_explicit( &currNode->aNext, POM_MO_RELAXED );
         if( pomLinkedListFind( &plist, (PllKeyType) currNode ) ){
-            // Pointer to retire is currently used (is a hazard pointer)
-            currNode->next = NULL;
+            // Pointer to retire is currently used (is a hazard pointer). Its next pointer
+            // goes straight from one retired list to the other, never through NULL
             pomStackPush( _lctx->rlist, currNode );
             _lctx->rcount++;
         }else{
             // Can now release/reuse the retired pointer
-            pomHpStackPush( _ctx->releasedPtrs, currNode );
+            pomHpReleaseNode( _ctx, currNode );
         }
         currNode = nextNode;
     }
@@ -210,7 +243,7 @@ int pomHpRetireNode( PomHpGlobalCtx *_ctx, PomHpLocalCtx *_lctx, PomCommonNode *
     pomStackPush( _lctx->rlist, _ptr );
     _lctx->rcount++;
 
-    if( _lctx->rcount > atomic_load( &_ctx->rNodeThreshold ) ){
+    if( _lctx->rcount > atomic_load_explicit( &_ctx->rNodeThreshold, POM_MO_RELAXED ) ){
         pomHpScan( _ctx, _lctx );
     }
     return 0;
@@ -222,8 +255,8 @@ int pomHpSetHazard( PomHpLocalCtx *_lctx, PomCommonNode *_ptr, size_t idx ){
         return 1;
     }
     PomHpRec *hpRecord = _lctx->hp + idx;
-    // TODO - consider setting this to relaxed (?) or release
-    atomic_store( &hpRecord->hazardPtr, _ptr );
+    // Must stay seq_cst, so the re-check that follows can't be reordered before it
+    atomic_store_explicit( &hpRecord->hazardPtr, _ptr, POM_MO_SEQ_CST );
     return 0;
 }
 
@@ -242,40 +275,52 @@ int pomHpStackInit( PomHpStackCtx *_ctx ){
 PomCommonNode* pomHpStackDestroy( PomHpStackCtx *_ctx ){
     // Empty the stack
     PomCommonNode *cNode;
-    do{
-        cNode = atomic_load( &_ctx->head );
-    }while( !atomic_compare_exchange_weak( &_ctx->head, &cNode, NULL ) );
+    cNode = atomic_exchange_explicit( &_ctx->head, NULL, POM_MO_ACQUIRE );
     
     return cNode;
 }
 
 // Push a single item onto the stack
 int pomHpStackPush( PomHpStackCtx *_ctx, PomCommonNode * _node ){
-    // TODO - solve ABA problem here
     PomCommonNode *head;
+    head = atomic_load_explicit( &_ctx->head, POM_MO_RELAXED );
     do{
-        head = atomic_load( &_ctx->head );
-        atomic_store( &_node->aNext, head );
-    }while( !atomic_compare_exchange_weak( &_ctx->head, &head, _node ) );
+        atomic_store_explicit( &_node->aNext, head, POM_MO_RELAXED );
+    }while( !atomic_compare_exchange_weak_explicit( &_ctx->head, &head, _node,
+                                                    POM_MO_RELEASE, POM_MO_RELAXED ) );
 
-    atomic_fetch_add( &_ctx->stackSize, 1 );
+    atomic_fetch_add_explicit( &_ctx->stackSize, 1, POM_MO_RELAXED );
     return 0;
 }
 
-// Pop a single item off the stack
-PomCommonNode * pomHpStackPop( PomHpStackCtx *_ctx ){
+// Pop a single item off the stack. The head is protected with the thread's reserved
+// hazard pointer while we read its next node, so it can't be popped, reused and pushed
+// back in the meantime (nodes only come back to the released list once they're no
+// longer hazards)
+PomCommonNode * pomHpStackPop( PomHpStackCtx *_ctx, PomHpLocalCtx *_lctx ){
     PomCommonNode *head, *next;
-    // TODO - solve ABA problem here
-    do{
-        head = atomic_load( &_ctx->head );
+    // The reserved record sits just past the caller's ones
+    PomHpRec *hpRecord = _lctx->hp + _lctx->numHp;
+    while( 1 ){
+        head = atomic_load_explicit( &_ctx->head, POM_MO_ACQUIRE );
         if( !head ){
+            atomic_store_explicit( &hpRecord->hazardPtr, NULL, POM_MO_RELEASE );
             return NULL;
         }
-        next = atomic_load( &head->next );
-    }while( !atomic_compare_exchange_weak( &_ctx->head, &head, next ) );
+        atomic_store_explicit( &hpRecord->hazardPtr, head, POM_MO_SEQ_CST );
+        if( head != atomic_load_explicit( &_ctx->head, POM_MO_SEQ_CST ) ){
+            continue;
+        }
+        next = atomic_load_explicit( &head->aNext, POM_MO_RELAXED );
+        if( atomic_compare_exchange_weak_explicit( &_ctx->head, &head, next,
+                                                   POM_MO_ACQUIRE, POM_MO_RELAXED ) ){
+            break;
+        }
+    }
+    atomic_store_explicit( &hpRecord->hazardPtr, NULL, POM_MO_RELEASE );
 
-    atomic_store( &head->next, NULL );
-    atomic_fetch_add( &_ctx->stackSize, -1 );
+    atomic_store_explicit( &head->aNext, NULL, POM_MO_RELAXED );
+    atomic_fetch_sub_explicit( &_ctx->stackSize, 1, POM_MO_RELAXED );
     
     return head;
 }
@@ -2,51 +2,70 @@
 #include <stdatomic.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 #define some_threshold 20
 
+// Memory ordering: nodes are published by the release CAS that links them in, and
+// every load that leads to reading a node's fields is an acquire. The hazard pointer
+// re-checks stay seq_cst, since they have to be ordered after the hazard store.
+// Other CASes only move head/tail along nodes that are already published
+
 int pomQueueInit( PomQueueCtx *_ctx ){
     PomCommonNode * dummyNode = (PomCommonNode*) malloc( sizeof( PomCommonNode ) );
     dummyNode->data = NULL;
     atomic_init( &dummyNode->next, NULL );
     _ctx->head = dummyNode;
     _ctx->tail = dummyNode;
-    atomic_init( &_ctx->queueLength, 0 );
+    _ctx->trackLength = true;
+    _ctx->blocking = false;
+    pomEventCountInit( &_ctx->consumers );
+    atomic_init( &_ctx->numPopped, 0 );
+    atomic_init( &_ctx->numPushed, 0 );
     return 0;
     //_ctx->dataLen = _dataLen;
 }
 
 int pomQueuePush( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpgctx, PomHpLocalCtx *_hplctx, void * _data ){
-    PomCommonNode *newNode = (PomCommonNode*) pomHpRequestNode( _hpgctx );
+    PomCommonNode *newNode = (PomCommonNode*) pomHpRequestNodeLocal( _hpgctx, _hplctx );
     PomCommonNode *nullNode = NULL;
-    newNode->next = NULL;
+    atomic_store_explicit( &newNode->aNext, NULL, POM_MO_RELAXED );
     newNode->data = _data;
     PomCommonNode *tail;
     while( 1 ){
-        tail = atomic_load( &_ctx->tail );
+        tail = atomic_load_explicit( &_ctx->tail, POM_MO_ACQUIRE );
         // Ensure this is atomic
         pomHpSetHazard( _hplctx, tail, 0 );
-        if( tail != atomic_load( &_ctx->tail ) ){
+        if( tail != atomic_load_explicit( &_ctx->tail, POM_MO_SEQ_CST ) ){
             // Tail has been updated, reloop
             continue;
         }
-        PomCommonNode * next = atomic_load( &tail->next );
-        if( tail != atomic_load( &_ctx->tail ) ){
+        PomCommonNode * next = atomic_load_explicit( &tail->aNext, POM_MO_ACQUIRE );
+        if( tail != atomic_load_explicit( &_ctx->tail, POM_MO_ACQUIRE ) ){
             continue;
         }
         if( next ){
-            atomic_compare_exchange_strong( &_ctx->tail, &tail, next );
+            atomic_compare_exchange_strong_explicit( &_ctx->tail, &tail, next,
+                                                     POM_MO_RELEASE, POM_MO_RELAXED );
             continue;
         }
-        if( atomic_compare_exchange_strong( &tail->next, &nullNode, newNode ) ){
+        if( atomic_compare_exchange_strong_explicit( &tail->aNext, &nullNode, newNode,
+                                                     POM_MO_RELEASE, POM_MO_RELAXED ) ){
             // Enqueue successful
             break;
         }
+        nullNode = NULL;
     }
 
-    atomic_compare_exchange_strong( &_ctx->tail, &tail, newNode );
+    atomic_compare_exchange_strong_explicit( &_ctx->tail, &tail, newNode,
+                                             POM_MO_RELEASE, POM_MO_RELAXED );
     pomHpSetHazard( _hplctx, NULL, 0 );
-    atomic_fetch_add( &_ctx->queueLength, 1 );
+    if( _ctx->trackLength ){
+        atomic_fetch_add_explicit( &_ctx->numPushed, 1, POM_MO_RELAXED );
+    }
+    if( _ctx->blocking ){
+        pomEventCountNotify( &_ctx->consumers, false );
+    }
     return 0;
 }
 
@@ -54,15 +73,15 @@ void * pomQueuePop( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_h
     PomCommonNode *head, *tail, *next;
     void *data;
     while( 1 ){
-        head = atomic_load( &_ctx->head );
+        head = atomic_load_explicit( &_ctx->head, POM_MO_ACQUIRE );
         pomHpSetHazard( _hplctx, head, 0 );
-        if( head != atomic_load( &_ctx->head ) ){
+        if( head != atomic_load_explicit( &_ctx->head, POM_MO_SEQ_CST ) ){
             continue;
         }
-        tail = atomic_load( &_ctx->tail );
-        next = atomic_load( &head->next );
+        tail = atomic_load_explicit( &_ctx->tail, POM_MO_ACQUIRE );
+        next = atomic_load_explicit( &head->aNext, POM_MO_ACQUIRE );
         pomHpSetHazard( _hplctx, next, 1 );
-        if( head != atomic_load( &_ctx->head ) ){
+        if( head != atomic_load_explicit( &_ctx->head, POM_MO_SEQ_CST ) ){
             continue;
         }
         if( !next ){
@@ -72,11 +91,13 @@ void * pomQueuePop( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_h
             return NULL;
         }
         if( head == tail ){
-            atomic_compare_exchange_strong( &_ctx->tail, &tail, next  );
+            atomic_compare_exchange_strong_explicit( &_ctx->tail, &tail, next,
+                                                     POM_MO_RELEASE, POM_MO_RELAXED );
             continue;
         }
         data = next->data;
-        if( atomic_compare_exchange_strong( &_ctx->head, &head, next ) ){
+        if( atomic_compare_exchange_strong_explicit( &_ctx->head, &head, next,
+                                                     POM_MO_RELEASE, POM_MO_RELAXED ) ){
             break;
         }
     }
@@ -84,12 +105,199 @@ void * pomQueuePop( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_h
     pomHpSetHazard( _hplctx, NULL, 1 );
     pomHpRetireNode( _hpctx, _hplctx, head );
     //pomHpRetireNode( _hpctx, _hplctx, head );
-    atomic_fetch_add( &_ctx->queueLength, -1 );
+    if( _ctx->trackLength ){
+        atomic_fetch_add_explicit( &_ctx->numPopped, 1, POM_MO_RELAXED );
+    }
     return data;
 }
 
+void * pomQueuePopWait( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_hplctx,
+                        const struct timespec *_timeout ){
+    void *data = pomQueuePop( _ctx, _hpctx, _hplctx );
+    if( data || !_ctx->blocking ){
+        return data;
+    }
+    struct timespec deadline;
+    if( _timeout ){
+        timespec_get( &deadline, TIME_UTC );
+        deadline.tv_sec += _timeout->tv_sec;
+        deadline.tv_nsec += _timeout->tv_nsec;
+        if( deadline.tv_nsec >= 1000000000 ){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+    }
+    // Register before re-checking, so a push that lands after the check will wake us
+    uint32_t key = pomEventCountPrepareWait( &_ctx->consumers );
+    data = pomQueuePop( _ctx, _hpctx, _hplctx );
+    if( data ){
+        pomEventCountCancelWait( &_ctx->consumers );
+        return data;
+    }
+    if( !pomEventCountWait( &_ctx->consumers, key, _timeout ? &deadline : NULL ) ){
+        return NULL;
+    }
+    return pomQueuePop( _ctx, _hpctx, _hplctx );
+}
+
+int pomQueuePushMany( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpgctx, PomHpLocalCtx *_hplctx,
+                      void * const *_data, uint32_t _count ){
+    if( !_count ){
+        return 0;
+    }
+    // Build the chain privately first
+    PomCommonNode *first = NULL, *last = NULL;
+    for( uint32_t i = 0; i < _count; i++ ){
+        PomCommonNode *newNode = (PomCommonNode*) pomHpRequestNodeLocal( _hpgctx, _hplctx );
+        atomic_store_explicit( &newNode->aNext, NULL, POM_MO_RELAXED );
+        newNode->data = _data[ i ];
+        if( last ){
+            atomic_store_explicit( &last->aNext, newNode, POM_MO_RELAXED );
+        }else{
+            first = newNode;
+        }
+        last = newNode;
+    }
+
+    PomCommonNode *nullNode = NULL;
+    PomCommonNode *tail;
+    while( 1 ){
+        tail = atomic_load_explicit( &_ctx->tail, POM_MO_ACQUIRE );
+        pomHpSetHazard( _hplctx, tail, 0 );
+        if( tail != atomic_load_explicit( &_ctx->tail, POM_MO_SEQ_CST ) ){
+            continue;
+        }
+        PomCommonNode * next = atomic_load_explicit( &tail->aNext, POM_MO_ACQUIRE );
+        if( tail != atomic_load_explicit( &_ctx->tail, POM_MO_ACQUIRE ) ){
+            continue;
+        }
+        if( next ){
+            atomic_compare_exchange_strong_explicit( &_ctx->tail, &tail, next,
+                                                     POM_MO_RELEASE, POM_MO_RELAXED );
+            continue;
+        }
+        // Release publishes the whole chain
+        if( atomic_compare_exchange_strong_explicit( &tail->aNext, &nullNode, first,
+                                                     POM_MO_RELEASE, POM_MO_RELAXED ) ){
+            break;
+        }
+        nullNode = NULL;
+    }
+
+    // Swing the tail straight to the end of the chain. If another thread has started
+    // helping it along one node at a time this fails, and they finish the job
+    atomic_compare_exchange_strong_explicit( &_ctx->tail, &tail, last,
+                                             POM_MO_RELEASE, POM_MO_RELAXED );
+    pomHpSetHazard( _hplctx, NULL, 0 );
+    if( _ctx->trackLength ){
+        atomic_fetch_add_explicit( &_ctx->numPushed, _count, POM_MO_RELAXED );
+    }
+    if( _ctx->blocking ){
+        pomEventCountNotify( &_ctx->consumers, _count > 1 );
+    }
+    return 0;
+}
+
+uint32_t pomQueuePopMany( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_hplctx,
+                          void **_data, uint32_t _maxCount ){
+    PomCommonNode *head, *tail, *curr;
+    uint32_t count;
+    while( 1 ){
+        head = atomic_load_explicit( &_ctx->head, POM_MO_ACQUIRE );
+        pomHpSetHazard( _hplctx, head, 0 );
+        if( head != atomic_load_explicit( &_ctx->head, POM_MO_SEQ_CST ) ){
+            continue;
+        }
+        tail = atomic_load_explicit( &_ctx->tail, POM_MO_ACQUIRE );
+
+        // Walk forward from the head, moving the second hazard pointer along as we go.
+        // While the head is unchanged nothing after it has been popped, so a node is
+        // safe once it's protected and the head is re-checked
+        bool helpedTail = false;
+        curr = head;
+        count = 0;
+        while( count < _maxCount ){
+            PomCommonNode *next = atomic_load_explicit( &curr->aNext, POM_MO_ACQUIRE );
+            if( !next ){
+                break;
+            }
+            if( curr == tail ){
+                // The head can't pass the tail, so help the tail along first. `curr`
+                // is still protected here, so the CAS can't hit a recycled node
+                atomic_compare_exchange_strong_explicit( &_ctx->tail, &tail, next,
+                                                         POM_MO_RELEASE, POM_MO_RELAXED );
+                helpedTail = true;
+                break;
+            }
+            pomHpSetHazard( _hplctx, next, 1 );
+            if( head != atomic_load_explicit( &_ctx->head, POM_MO_SEQ_CST ) ){
+                break;
+            }
+            _data[ count++ ] = next->data;
+            curr = next;
+        }
+        if( helpedTail || head != atomic_load_explicit( &_ctx->head, POM_MO_ACQUIRE ) ){
+            continue;
+        }
+        if( !count ){
+            // Empty queue
+            pomHpSetHazard( _hplctx, NULL, 0 );
+            pomHpSetHazard( _hplctx, NULL, 1 );
+            return 0;
+        }
+        if( atomic_compare_exchange_strong_explicit( &_ctx->head, &head, curr,
+                                                     POM_MO_RELEASE, POM_MO_RELAXED ) ){
+            break;
+        }
+    }
+    pomHpSetHazard( _hplctx, NULL, 0 );
+    pomHpSetHazard( _hplctx, NULL, 1 );
+
+    // The last popped node is the new dummy head, everything before it is retired
+    PomCommonNode *node = head;
+    while( node != curr ){
+        PomCommonNode *next = atomic_load_explicit( &node->aNext, POM_MO_RELAXED );
+        pomHpRetireNode( _hpctx, _hplctx, node );
+        node = next;
+    }
+    if( _ctx->trackLength ){
+        atomic_fetch_add_explicit( &_ctx->numPopped, count, POM_MO_RELAXED );
+    }
+    return count;
+}
+
 uint32_t pomQueueLength( PomQueueCtx *_ctx ){
-    return atomic_load( &_ctx->queueLength );
+    // Read pops first, so a push/pop pair landing in between can only make us high
+    uint32_t numPopped = atomic_load_explicit( &_ctx->numPopped, POM_MO_RELAXED );
+    uint32_t numPushed = atomic_load_explicit( &_ctx->numPushed, POM_MO_RELAXED );
+    // A pop can be counted before its push is
+    int32_t length = (int32_t) ( numPushed - numPopped );
+    return length > 0 ? (uint32_t) length : 0;
+}
+
+int pomQueueSetBlocking( PomQueueCtx *_ctx, bool _blocking ){
+    _ctx->blocking = _blocking;
+    return 0;
+}
+
+int pomQueueWakeAll( PomQueueCtx *_ctx ){
+    pomEventCountNotify( &_ctx->consumers, true );
+    return 0;
+}
+
+int pomQueueSetTrackLength( PomQueueCtx *_ctx, bool _track ){
+    _ctx->trackLength = _track;
+    return 0;
+}
+
+bool pomQueueIsEmpty( PomQueueCtx *_ctx ){
+    PomCommonNode *head = atomic_load_explicit( &_ctx->head, POM_MO_ACQUIRE );
+    if( head != atomic_load_explicit( &_ctx->tail, POM_MO_ACQUIRE ) ){
+        return false;
+    }
+    // Popped nodes go back to the hazard pointer pool rather than being freed, so the
+    // head is safe to read even if it's popped in the meantime
+    return atomic_load_explicit( &head->aNext, POM_MO_ACQUIRE ) == NULL;
 }
 
 #include <stdio.h>
@@ -99,7 +307,7 @@ int pomQueueClear( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_hp
 
     // Return all the queue nodes to HP handler, i.e. retire them. HP will clear them up
     // later. 
-    if( atomic_load( &_ctx->queueLength ) ){
+    if( !pomQueueIsEmpty( _ctx ) ){
         // Clear any remaining items.
         // Unfreed data is lost (responsibility of queue owner to free them before calling this)
         PomCommonNode * qNode = _ctx->head;
@@ -113,6 +321,305 @@ int pomQueueClear( PomQueueCtx *_ctx, PomHpGlobalCtx *_hpctx, PomHpLocalCtx *_hp
         // Free the dummy node
         free( _ctx->head );
     }
+    pomEventCountClear( &_ctx->consumers );
+
+    return 0;
+}
+
+/*******************************************
+* Event count
+********************************************/
+
+// Waiters bump `numWaiters` and then check their condition, while notifiers publish
+// their change and then check `numWaiters`. The seq_cst fences on both sides mean at
+// least one of them sees the other, so a waiter can't miss a notification and sleep
+// through it
+
+int pomEventCountInit( PomEventCountCtx *_ctx ){
+    atomic_init( &_ctx->numWaiters, 0 );
+    atomic_init( &_ctx->epoch, 0 );
+    mtx_init( &_ctx->mtx, mtx_plain );
+    cnd_init( &_ctx->cnd );
+    return 0;
+}
+
+uint32_t pomEventCountPrepareWait( PomEventCountCtx *_ctx ){
+    atomic_fetch_add_explicit( &_ctx->numWaiters, 1, POM_MO_RELAXED );
+    atomic_thread_fence( POM_MO_SEQ_CST );
+    return atomic_load_explicit( &_ctx->epoch, POM_MO_ACQUIRE );
+}
+
+void pomEventCountCancelWait( PomEventCountCtx *_ctx ){
+    atomic_fetch_sub_explicit( &_ctx->numWaiters, 1, POM_MO_RELAXED );
+}
+
+bool pomEventCountWait( PomEventCountCtx *_ctx, uint32_t _key, const struct timespec *_deadline ){
+    bool notified = true;
+    mtx_lock( &_ctx->mtx );
+    // The epoch only changes under the lock, so a notify can't slip in between this
+    // check and going to sleep
+    while( atomic_load_explicit( &_ctx->epoch, POM_MO_RELAXED ) == _key ){
+        if( !_deadline ){
+            cnd_wait( &_ctx->cnd, &_ctx->mtx );
+        }else if( cnd_timedwait( &_ctx->cnd, &_ctx->mtx, _deadline ) != thrd_success ){
+            // Timed out (compared against success, as tinycthread's error codes differ
+            // from the platform's when both end up linked)
+            notified = atomic_load_explicit( &_ctx->epoch, POM_MO_RELAXED ) != _key;
+            break;
+        }
+    }
+    mtx_unlock( &_ctx->mtx );
+    atomic_fetch_sub_explicit( &_ctx->numWaiters, 1, POM_MO_RELAXED );
+    return notified;
+}
+
+void pomEventCountNotify( PomEventCountCtx *_ctx, bool _all ){
+    atomic_thread_fence( POM_MO_SEQ_CST );
+    if( !atomic_load_explicit( &_ctx->numWaiters, POM_MO_RELAXED ) ){
+        // Nobody's asleep, so no need to touch the lock
+        return;
+    }
+    mtx_lock( &_ctx->mtx );
+    atomic_fetch_add_explicit( &_ctx->epoch, 1, POM_MO_RELEASE );
+    if( _all ){
+        cnd_broadcast( &_ctx->cnd );
+    }else{
+        cnd_signal( &_ctx->cnd );
+    }
+    mtx_unlock( &_ctx->mtx );
+}
+
+int pomEventCountClear( PomEventCountCtx *_ctx ){
+    mtx_destroy( &_ctx->mtx );
+    cnd_destroy( &_ctx->cnd );
+    return 0;
+}
+
+/*******************************************
+* Bounded MPMC ring buffer
+********************************************/
+
+// A cell is free for the producer at position `pos` when its sequence is `pos`, and
+// holds an item for the consumer at `pos` when its sequence is `pos + 1`. Consumers
+// hand the cell on to the next lap by setting it to `pos + capacity`
+
+int pomQueueMpmcInit( PomQueueMpmcCtx *_ctx, size_t _capacity ){
+    size_t capacity = 2;
+    while( capacity < _capacity ){
+        capacity <<= 1;
+    }
+    _ctx->cells = (PomQueueMpmcCell*) aligned_alloc( POM_CACHE_LINE_SIZE,
+                    ( sizeof( PomQueueMpmcCell ) * capacity + POM_CACHE_LINE_SIZE - 1 ) &
+                    ~(size_t) ( POM_CACHE_LINE_SIZE - 1 ) );
+    if( !_ctx->cells ){
+        return 1;
+    }
+    for( size_t i = 0; i < capacity; i++ ){
+        atomic_init( &_ctx->cells[ i ].sequence, i );
+        _ctx->cells[ i ].data = NULL;
+    }
+    _ctx->mask = capacity - 1;
+    atomic_init( &_ctx->enqueuePos, 0 );
+    atomic_init( &_ctx->dequeuePos, 0 );
+    return 0;
+}
+
+int pomQueueMpmcPush( PomQueueMpmcCtx *_ctx, void * _data ){
+    PomQueueMpmcCell *cell;
+    size_t pos = atomic_load_explicit( &_ctx->enqueuePos, POM_MO_RELAXED );
+    while( 1 ){
+        cell = &_ctx->cells[ pos & _ctx->mask ];
+        size_t seq = atomic_load_explicit( &cell->sequence, POM_MO_ACQUIRE );
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if( diff == 0 ){
+            // Cell is free, try to claim it
+            if( atomic_compare_exchange_weak_explicit( &_ctx->enqueuePos, &pos, pos + 1,
+                                                       POM_MO_RELAXED, POM_MO_RELAXED ) ){
+                break;
+            }
+        }else if( diff < 0 ){
+            // Consumer hasn't freed the cell from the last lap yet, so we're full
+            return 1;
+        }else{
+            // Another producer got here first
+            pos = atomic_load_explicit( &_ctx->enqueuePos, POM_MO_RELAXED );
+        }
+    }
+    cell->data = _data;
+    atomic_store_explicit( &cell->sequence, pos + 1, POM_MO_RELEASE );
+    return 0;
+}
+
+void * pomQueueMpmcPop( PomQueueMpmcCtx *_ctx ){
+    PomQueueMpmcCell *cell;
+    size_t pos = atomic_load_explicit( &_ctx->dequeuePos, POM_MO_RELAXED );
+    while( 1 ){
+        cell = &_ctx->cells[ pos & _ctx->mask ];
+        size_t seq = atomic_load_explicit( &cell->sequence, POM_MO_ACQUIRE );
+        intptr_t diff = (intptr_t) seq - (intptr_t) ( pos + 1 );
+        if( diff == 0 ){
+            if( atomic_compare_exchange_weak_explicit( &_ctx->dequeuePos, &pos, pos + 1,
+                                                       POM_MO_RELAXED, POM_MO_RELAXED ) ){
+                break;
+            }
+        }else if( diff < 0 ){
+            // Nothing written to this cell yet, so we're empty
+            return NULL;
+        }else{
+            pos = atomic_load_explicit( &_ctx->dequeuePos, POM_MO_RELAXED );
+        }
+    }
+    void *data = cell->data;
+    atomic_store_explicit( &cell->sequence, pos + _ctx->mask + 1, POM_MO_RELEASE );
+    return data;
+}
+
+int pomQueueMpmcClear( PomQueueMpmcCtx *_ctx ){
+    free( _ctx->cells );
+    _ctx->cells = NULL;
+    _ctx->mask = 0;
+    return 0;
+}
+
+/*******************************************
+* Bounded SPSC ring buffer
+********************************************/
+
+int pomQueueSpscInit( PomQueueSpscCtx *_ctx, size_t _capacity ){
+    size_t capacity = 2;
+    while( capacity < _capacity ){
+        capacity <<= 1;
+    }
+    _ctx->cells = (void**) malloc( sizeof( void* ) * capacity );
+    if( !_ctx->cells ){
+        return 1;
+    }
+    _ctx->mask = capacity - 1;
+    atomic_init( &_ctx->tail, 0 );
+    atomic_init( &_ctx->head, 0 );
+    _ctx->cachedHead = 0;
+    _ctx->cachedTail = 0;
+    return 0;
+}
 
+int pomQueueSpscPush( PomQueueSpscCtx *_ctx, void * _data ){
+    // Only we write the tail, so it doesn't need ordering
+    size_t tail = atomic_load_explicit( &_ctx->tail, POM_MO_RELAXED );
+    if( tail - _ctx->cachedHead > _ctx->mask ){
+        // Looks full, see how far the consumer has got
+        _ctx->cachedHead = atomic_load_explicit( &_ctx->head, POM_MO_ACQUIRE );
+        if( tail - _ctx->cachedHead > _ctx->mask ){
+            return 1;
+        }
+    }
+    _ctx->cells[ tail & _ctx->mask ] = _data;
+    atomic_store_explicit( &_ctx->tail, tail + 1, POM_MO_RELEASE );
+    return 0;
+}
+
+void * pomQueueSpscPop( PomQueueSpscCtx *_ctx ){
+    size_t head = atomic_load_explicit( &_ctx->head, POM_MO_RELAXED );
+    if( head == _ctx->cachedTail ){
+        // Looks empty, see if the producer has added anything since
+        _ctx->cachedTail = atomic_load_explicit( &_ctx->tail, POM_MO_ACQUIRE );
+        if( head == _ctx->cachedTail ){
+            return NULL;
+        }
+    }
+    void *data = _ctx->cells[ head & _ctx->mask ];
+    atomic_store_explicit( &_ctx->head, head + 1, POM_MO_RELEASE );
+    return data;
+}
+
+int pomQueueSpscClear( PomQueueSpscCtx *_ctx ){
+    free( _ctx->cells );
+    _ctx->cells = NULL;
+    _ctx->mask = 0;
+    return 0;
+}
+
+/*******************************************
+* Work-stealing deque
+********************************************/
+
+// After Lê et al., "Correct and Efficient Work-Stealing for Weak Memory Models". The
+// owner and thieves only contend on the top, and only when the deque is down to its
+// last item. The seq_cst fences make the owner's bottom store and a thief's top load
+// (and vice versa) visible in a single order, so they can't both take the last item
+
+int pomQueueWsInit( PomQueueWsCtx *_ctx, size_t _capacity ){
+    size_t capacity = 2;
+    while( capacity < _capacity ){
+        capacity <<= 1;
+    }
+    _ctx->cells = (void * _Atomic *) malloc( sizeof( void * _Atomic ) * capacity );
+    if( !_ctx->cells ){
+        return 1;
+    }
+    for( size_t i = 0; i < capacity; i++ ){
+        atomic_init( &_ctx->cells[ i ], NULL );
+    }
+    _ctx->mask = (int64_t) capacity - 1;
+    atomic_init( &_ctx->top, 0 );
+    atomic_init( &_ctx->bottom, 0 );
     return 0;
-}
\ No newline at end of file
+}
+
+int pomQueueWsPush( PomQueueWsCtx *_ctx, void * _data ){
+    int64_t bottom = atomic_load_explicit( &_ctx->bottom, POM_MO_RELAXED );
+    int64_t top = atomic_load_explicit( &_ctx->top, POM_MO_ACQUIRE );
+    if( bottom - top > _ctx->mask ){
+        return 1;
+    }
+    atomic_store_explicit( &_ctx->cells[ bottom & _ctx->mask ], _data, POM_MO_RELAXED );
+    // Publishes the item (and whatever it points to) to thieves
+    atomic_store_explicit( &_ctx->bottom, bottom + 1, POM_MO_RELEASE );
+    return 0;
+}
+
+void * pomQueueWsPop( PomQueueWsCtx *_ctx ){
+    int64_t bottom = atomic_load_explicit( &_ctx->bottom, POM_MO_RELAXED ) - 1;
+    atomic_store_explicit( &_ctx->bottom, bottom, POM_MO_RELAXED );
+    atomic_thread_fence( POM_MO_SEQ_CST );
+    int64_t top = atomic_load_explicit( &_ctx->top, POM_MO_RELAXED );
+    if( top > bottom ){
+        // Empty, put the bottom back
+        atomic_store_explicit( &_ctx->bottom, bottom + 1, POM_MO_RELAXED );
+        return NULL;
+    }
+    void *data = atomic_load_explicit( &_ctx->cells[ bottom & _ctx->mask ], POM_MO_RELAXED );
+    if( top == bottom ){
+        // Last item, so race any thieves for it
+        if( !atomic_compare_exchange_strong_explicit( &_ctx->top, &top, top + 1,
+                                                      POM_MO_SEQ_CST, POM_MO_RELAXED ) ){
+            data = NULL;
+        }
+        atomic_store_explicit( &_ctx->bottom, bottom + 1, POM_MO_RELAXED );
+    }
+    return data;
+}
+
+void * pomQueueWsSteal( PomQueueWsCtx *_ctx ){
+    int64_t top = atomic_load_explicit( &_ctx->top, POM_MO_ACQUIRE );
+    while( true ){
+        atomic_thread_fence( POM_MO_SEQ_CST );
+        int64_t bottom = atomic_load_explicit( &_ctx->bottom, POM_MO_ACQUIRE );
+        if( top >= bottom ){
+            return NULL;
+        }
+        void *data = atomic_load_explicit( &_ctx->cells[ top & _ctx->mask ], POM_MO_RELAXED );
+        if( atomic_compare_exchange_strong_explicit( &_ctx->top, &top, top + 1,
+                                                     POM_MO_SEQ_CST, POM_MO_ACQUIRE ) ){
+            return data;
+        }
+        // Lost to the owner or another thief, but there may be more. The failed CAS
+        // gave us the new top
+    }
+}
+
+int pomQueueWsClear( PomQueueWsCtx *_ctx ){
+    free( (void*) _ctx->cells );
+    _ctx->cells = NULL;
+    _ctx->mask = 0;
+    return 0;
+}
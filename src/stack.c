@@ -1,5 +1,6 @@
 #include "stack.h"
 #include <stdlib.h>
+#include <stdatomic.h>
 
 // Initialise the stack
 int pomStackInit( PomStackCtx *_ctx ){
@@ -30,7 +31,9 @@ PomCommonNode * pomStackPop( PomStackCtx *_ctx ){
 
 // Push a single item onto the stack
 int pomStackPush( PomStackCtx *_ctx, PomCommonNode * _data ){
-    _data->next = _ctx->head;
+    // Atomic (but unordered) since hazard pointers keep nodes on a retired stack that
+    // other threads may still be reading
+    atomic_store_explicit( &_data->aNext, _ctx->head, POM_MO_RELAXED );
     _ctx->head = _data;
 
     return 0;
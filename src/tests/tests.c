@@ -5,20 +5,38 @@
 #include <stdlib.h>
 #include "threadpool.h"
 #include <time.h>
+#include <string.h>
 
 
 #define LOG( log, ... ) LOG_MODULE( DEBUG, tests, log, ##__VA_ARGS__ )
 
+// Log a test failure. Any failure makes the test run exit non-zero
+#define FAIL( log, ... ) do{ numFailures++; LOG( log, ##__VA_ARGS__ ); }while( 0 )
+
+static uint32_t numFailures = 0;
+
 void testHashmap();
+void testHashmapProfile();
+void testHashmapCompaction();
+void testHashmapIter();
+void testHashmapMigration();
+void testGenericHashmap();
+void testConcurrentHashmap();
+void testFrozenHashmap();
 void testQueues();
+void testQueueMpmc();
+void testQueueSpsc();
+void testQueueWs();
+void testQueueStress();
 void testThreadpool();
+void testParallel();
 
 // Equivalent to b-a
 void timeDiff( struct timespec *a, struct timespec *b, struct timespec *out ){
     int64_t secDiff = b->tv_sec - a->tv_sec;
     int64_t nsDiff = b->tv_nsec - a->tv_nsec;
     if( nsDiff < 0 ){
-        nsDiff = 1e9 - nsDiff;
+        nsDiff = 1e9 + nsDiff;
         secDiff--;
     }
     out->tv_nsec = nsDiff;
@@ -36,11 +54,31 @@ int getTime( struct timespec *_t ){
     return clock_gettime( CLOCK_PROCESS_CPUTIME_ID, _t );
 }
 
-int main(){
-//    testHashmap();
+int main( int argc, char **argv ){
+    if( argc > 1 && strcmp( argv[ 1 ], "stress" ) == 0 ){
+        // Just the concurrency stress tests, e.g. for sanitizer builds
+        testQueueStress();
+        return numFailures ? 1 : 0;
+    }
+    testHashmap();
+    testHashmapProfile();
+    testHashmapCompaction();
+    testHashmapIter();
+    testHashmapMigration();
+    testGenericHashmap();
+    testConcurrentHashmap();
+    testFrozenHashmap();
 //    testConfig();
-//    testQueues();
+    testQueues();
+    testQueueMpmc();
+    testQueueSpsc();
+    testQueueWs();
     testThreadpool();
+    testParallel();
+    if( numFailures ){
+        LOG( "%u tests failed", numFailures );
+        return 1;
+    }
     return 0;
 }
 
@@ -54,14 +92,723 @@ void testHashmap(){
 
     LOG( "%s", str );
 
+    // Push enough keys through to force a few resizes, then remove every other one
+    uint32_t numKeys = 5000;
+    char key[ 32 ], value[ 32 ];
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        snprintf( value, sizeof( value ), "value%u", i );
+        pomMapSet( &hashMapCtx, key, value );
+    }
+    // Growing the heap shouldn't move existing data
+    uint32_t numErrors = pomMapGet( &hashMapCtx, "Test", NULL ) != str;
+    for( uint32_t i = 0; i < numKeys; i += 2 ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        pomMapRemove( &hashMapCtx, key );
+    }
+    // Nor should removing other keys, since compaction isn't automatic by default
+    numErrors += pomMapGet( &hashMapCtx, "Test", NULL ) != str;
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        snprintf( value, sizeof( value ), "value%u", i );
+        const char * got = pomMapGet( &hashMapCtx, key, NULL );
+        if( i % 2 == 0 ? got != NULL : ( !got || strcmp( got, value ) ) ){
+            numErrors++;
+        }
+    }
+
+    // Look keys up straight out of a larger buffer, without terminators
+    const char *buffer = "key1=value1;key3=value3;key4=";
+    PomMapStrView view;
+    numErrors += !pomMapGetView( &hashMapCtx, buffer, 4, &view ) || view.len != 6 ||
+                 strncmp( view.str, buffer + 5, view.len );
+    numErrors += strcmp( pomMapGetN( &hashMapCtx, buffer + 12, 4, "" ), "value3" ) != 0;
+    numErrors += pomMapGetView( &hashMapCtx, buffer + 24, 4, &view );
+    pomMapSetN( &hashMapCtx, buffer + 24, 4, buffer + 5, 6 );
+    numErrors += strcmp( pomMapGet( &hashMapCtx, "key4", "" ), "value1" ) != 0;
+    numErrors += pomMapRemoveN( &hashMapCtx, buffer + 24, 4 );
+
+    // Later pairs win in a bulk load, both within a batch and over keys already in
+    // the map. The first batch goes into an empty map, the second into a populated one
+    PomMapCtx bulkCtx;
+    pomMapInit( &bulkCtx, 0 );
+    PomMapPair firstBatch[] = { { "a", "1" }, { "b", "1" }, { "a", "2" } };
+    PomMapPair secondBatch[] = { { "b", "2" }, { "c", "1" }, { "b", "3" } };
+    pomMapSetMany( &bulkCtx, firstBatch, 3 );
+    pomMapSetMany( &bulkCtx, secondBatch, 3 );
+    numErrors += bulkCtx.numNodes != 3 || strcmp( pomMapGet( &bulkCtx, "a", "" ), "2" ) ||
+                 strcmp( pomMapGet( &bulkCtx, "b", "" ), "3" ) || strcmp( pomMapGet( &bulkCtx, "c", "" ), "1" );
+    pomMapClear( &bulkCtx );
+
+    if( numErrors || hashMapCtx.numNodes != numKeys / 2 + 1 ){
+        FAIL( "Hashmap lookup failed for %u keys", numErrors );
+    }
+    else{
+        LOG( "Hashmap returned correct values for %u keys", numKeys );
+    }
+
     pomMapClear( &hashMapCtx );
     return;
 
 }
 
+void testHashmapIter(){
+    PomMapCtx hashMapCtx;
+    pomMapInit( &hashMapCtx, 0 );
+    uint32_t numKeys = 2000;
+    char key[ 32 ], value[ 32 ];
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        snprintf( value, sizeof( value ), "value%u", i );
+        pomMapSet( &hashMapCtx, key, value );
+    }
+    // Overwrite some keys so the heap has dead data to skip
+    for( uint32_t i = 0; i < numKeys; i += 4 ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        snprintf( value, sizeof( value ), "value%u", i );
+        pomMapSet( &hashMapCtx, key, value );
+    }
+
+    uint32_t numErrors = 0;
+    for( int order = POM_MAP_ITER_HEAP; order <= POM_MAP_ITER_BUCKET; order++ ){
+        // Visit everything, removing every entry whose number is a multiple of 3
+        PomMapIter iter;
+        pomMapIterInit( &hashMapCtx, &iter, (PomMapIterOrder) order );
+        // Nothing to remove before the first entry
+        numErrors += pomMapIterRemove( &iter ) == 0;
+        uint32_t numVisited = 0;
+        while( pomMapIterNext( &iter ) ){
+            uint32_t i = (uint32_t) strtoul( iter.key.str + 3, NULL, 10 );
+            snprintf( value, sizeof( value ), "value%u", i );
+            numErrors += iter.value.len != strlen( value ) || strcmp( iter.value.str, value );
+            if( order == POM_MAP_ITER_HEAP && i % 3 == 0 ){
+                numErrors += pomMapIterRemove( &iter );
+            }
+            numVisited++;
+        }
+        // ...or once every entry has been visited
+        numErrors += pomMapIterRemove( &iter ) == 0;
+        uint32_t expected = order == POM_MAP_ITER_HEAP ? numKeys : numKeys - ( numKeys + 2 ) / 3;
+        numErrors += numVisited != expected;
+    }
+    numErrors += hashMapCtx.numNodes != numKeys - ( numKeys + 2 ) / 3;
+    pomMapClear( &hashMapCtx );
+
+    if( numErrors ){
+        FAIL( "Hashmap iteration failed for %u entries", numErrors );
+    }
+    else{
+        LOG( "Hashmap iteration visited correct entries" );
+    }
+}
+
+// Total bytes allocated for the map's data heap
+size_t hashmapHeapSize( PomMapCtx *_ctx ){
+    size_t heapSize;
+    pomMapHeapStats( _ctx, NULL, &heapSize, NULL );
+    return heapSize;
+}
+
+// Overwrite the same keys over and over, with compaction run manually and automatically
+void testHashmapCompaction(){
+    uint32_t numKeys = 1000, numRounds = 50;
+    char key[ 32 ], value[ 32 ];
+    uint32_t numErrors = 0;
+    for( int automatic = 0; automatic < 2; automatic++ ){
+        PomMapCtx hashMapCtx;
+        pomMapInit( &hashMapCtx, 0 );
+        pomMapSetCompaction( &hashMapCtx, 50, automatic );
+        size_t maxHeap = 0;
+        for( uint32_t r = 0; r < numRounds; r++ ){
+            for( uint32_t i = 0; i < numKeys; i++ ){
+                snprintf( key, sizeof( key ), "key%u", i );
+                snprintf( value, sizeof( value ), "value%u-%u", i, r );
+                pomMapSet( &hashMapCtx, key, value );
+            }
+            size_t heapSize = hashmapHeapSize( &hashMapCtx );
+            maxHeap = heapSize > maxHeap ? heapSize : maxHeap;
+        }
+        size_t beforeSize = hashmapHeapSize( &hashMapCtx );
+        uint32_t numSteps = 0;
+        while( pomMapCompactStep( &hashMapCtx, 4096 ) ){
+            numSteps++;
+        }
+        for( uint32_t i = 0; i < numKeys; i++ ){
+            snprintf( key, sizeof( key ), "key%u", i );
+            snprintf( value, sizeof( value ), "value%u-%u", i, numRounds - 1 );
+            const char *found = pomMapGet( &hashMapCtx, key, NULL );
+            numErrors += !found || strcmp( found, value );
+        }
+        LOG( "%s compaction: peak heap %zu bytes, %zu before idle compaction, %zu after %u steps",
+             automatic ? "Automatic" : "Manual", maxHeap, beforeSize, hashmapHeapSize( &hashMapCtx ), numSteps );
+        // Looking at the heap doesn't move anything. Optimising packs it into one chunk
+        // holding just the live records
+        const char *before = pomMapGet( &hashMapCtx, "key0", NULL );
+        pomMapGetDataHeap( &hashMapCtx, NULL, NULL );
+        numErrors += pomMapGet( &hashMapCtx, "key0", NULL ) != before;
+        size_t heapUsed, liveRecords = 0;
+        pomMapOptimise( &hashMapCtx );
+        const char *heap = pomMapGetDataHeap( &hashMapCtx, &heapUsed, NULL );
+        for( size_t pos = 0; pos < heapUsed; ){
+            uint32_t lens[ 2 ];
+            memcpy( lens, heap + pos, sizeof( lens ) );
+            liveRecords += !( lens[ 0 ] & 0x80000000u );
+            pos += sizeof( lens ) + ( lens[ 0 ] & ~0x80000000u ) + lens[ 1 ] + 2;
+        }
+        numErrors += liveRecords != numKeys || pomMapGetDataHeapChunk( &hashMapCtx, 1, NULL, NULL );
+        pomMapClear( &hashMapCtx );
+    }
+
+    // Churning one key with compaction never run leaves every chunk full of dead data
+    PomMapCtx churnCtx;
+    pomMapInit( &churnCtx, 0 );
+    pomMapSetCompaction( &churnCtx, 50, false );
+    // Nothing moves other keys' data while compaction isn't run
+    const char *untouched = pomMapSet( &churnCtx, "untouched", "value" );
+    char longValue[ 120 ];
+    for( uint32_t r = 0; r < 200; r++ ){
+        memset( longValue, 'a' + r % 26, sizeof( longValue ) - 1 );
+        longValue[ sizeof( longValue ) - 1 ] = '\0';
+        pomMapSet( &churnCtx, "key", longValue );
+    }
+    numErrors += strcmp( pomMapGet( &churnCtx, "key", "" ), longValue ) != 0;
+    numErrors += pomMapGet( &churnCtx, "untouched", NULL ) != untouched;
+
+    // In automatic mode, inserting through pomMapGetSet runs compaction steps too
+    pomMapSetCompaction( &churnCtx, 50, true );
+    for( uint32_t i = 0; i < numKeys && pomMapNeedsCompact( &churnCtx ); i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        pomMapGetSet( &churnCtx, key, "value" );
+    }
+    numErrors += pomMapNeedsCompact( &churnCtx );
+    pomMapClear( &churnCtx );
+
+    if( numErrors ){
+        FAIL( "Hashmap compaction lost %u values", numErrors );
+    }
+    else{
+        LOG( "Hashmap compaction kept correct values" );
+    }
+}
+
+// Insert keys into an incremental map until it's part way through migrating
+// to a new table. Returns the number of keys inserted
+uint32_t hashmapStartMigration( PomMapCtx *_ctx ){
+    char key[ 32 ];
+    uint32_t numKeys = 0;
+    pomMapInit( _ctx, 0 );
+    pomMapSetIncrementalResize( _ctx, true );
+    while( !_ctx->oldBuckets || _ctx->migrateIdx == 0 ){
+        snprintf( key, sizeof( key ), "key%u", numKeys++ );
+        pomMapSet( _ctx, key, "value" );
+    }
+    return numKeys;
+}
+
+uint32_t hashmapCountKeys( PomMapCtx *_ctx, uint32_t _numKeys ){
+    char key[ 32 ];
+    uint32_t numFound = 0;
+    for( uint32_t i = 0; i < _numKeys; i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        numFound += pomMapGet( _ctx, key, NULL ) != NULL;
+    }
+    return numFound;
+}
+
+void testHashmapMigration(){
+    PomMapCtx hashMapCtx;
+    uint32_t numErrors = 0;
+
+    // Explicit resize while a migration is in flight
+    uint32_t numKeys = hashmapStartMigration( &hashMapCtx );
+    pomMapResize( &hashMapCtx, hashMapCtx.numBuckets * 4 );
+    numErrors += numKeys - hashmapCountKeys( &hashMapCtx, numKeys );
+    pomMapClear( &hashMapCtx );
+
+    // Switching incremental mode off should finish the migration there and then
+    numKeys = hashmapStartMigration( &hashMapCtx );
+    pomMapSetIncrementalResize( &hashMapCtx, false );
+    numErrors += hashMapCtx.oldBuckets != NULL;
+    numErrors += numKeys - hashmapCountKeys( &hashMapCtx, numKeys );
+    pomMapClear( &hashMapCtx );
+
+    // Bulk loading big enough to force another resize mid-migration
+    numKeys = hashmapStartMigration( &hashMapCtx );
+    uint32_t numNewKeys = hashMapCtx.numBuckets;
+    char *keys = (char*) malloc( numNewKeys * 16 );
+    PomMapPair *pairs = (PomMapPair*) malloc( numNewKeys * sizeof( PomMapPair ) );
+    for( uint32_t i = 0; i < numNewKeys; i++ ){
+        snprintf( keys + i * 16, 16, "key%u", numKeys + i );
+        pairs[ i ] = (PomMapPair){ keys + i * 16, "value" };
+    }
+    pomMapSetMany( &hashMapCtx, pairs, numNewKeys );
+    numKeys += numNewKeys;
+    numErrors += numKeys - hashmapCountKeys( &hashMapCtx, numKeys );
+    pomMapClear( &hashMapCtx );
+    free( pairs );
+    free( keys );
+
+    if( numErrors ){
+        FAIL( "Hashmap lost %u keys when interrupting a migration", numErrors );
+    }
+    else{
+        LOG( "Hashmap kept every key when interrupting a migration" );
+    }
+}
+
+void hashmapProfileHash( const char *_name, PomMapHashFunc _hashFunc, uint64_t _seed ){
+    uint32_t numKeys = 2e5;
+    uint32_t numLookups = 1e6;
+    char key[ 64 ];
+    struct timespec start, end, diff;
+    PomMapCtx hashMapCtx;
+    pomMapInitHash( &hashMapCtx, 0, _hashFunc, _seed );
+
+    // Config-style keys, which share long prefixes
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        snprintf( key, sizeof( key ), "config.section%u.setting%u", i / 64, i % 64 );
+        pomMapSet( &hashMapCtx, key, "value" );
+    }
+
+    // Half the lookups hit, half miss
+    uint32_t numFound = 0;
+    getTime( &start );
+    for( uint32_t i = 0; i < numLookups; i++ ){
+        uint32_t k = ( i * 7919 ) % ( numKeys * 2 );
+        snprintf( key, sizeof( key ), "config.section%u.setting%u", k / 64, k % 64 );
+        if( pomMapGet( &hashMapCtx, key, NULL ) ){
+            numFound++;
+        }
+    }
+    getTime( &end );
+    timeDiff( &start, &end, &diff );
+
+    uint32_t histogram[ 5 ];
+    pomMapProbeStats( &hashMapCtx, histogram, 5 );
+    LOG( "%s: %u lookups (%u hits) in %fs. Probe lengths 0:%u 1:%u 2:%u 3:%u 4+:%u", _name, numLookups, numFound,
+         concatTime( &diff ), histogram[ 0 ], histogram[ 1 ], histogram[ 2 ], histogram[ 3 ], histogram[ 4 ] );
+
+    pomMapClear( &hashMapCtx );
+}
+
+// Time individual inserts to find the worst case, which is dominated by resizes
+void hashmapProfileResize( bool _incremental ){
+    uint32_t numKeys = 1e5;
+    char key[ 32 ];
+    struct timespec start, end, diff;
+    double maxTime = 0.0, totalTime = 0.0;
+    PomMapCtx hashMapCtx;
+    pomMapInit( &hashMapCtx, 0 );
+    pomMapSetIncrementalResize( &hashMapCtx, _incremental );
+
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        getTime( &start );
+        pomMapSet( &hashMapCtx, key, "value" );
+        getTime( &end );
+        timeDiff( &start, &end, &diff );
+        double t = concatTime( &diff );
+        totalTime += t;
+        if( t > maxTime ){
+            maxTime = t;
+        }
+    }
+    uint32_t numFound = 0;
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        numFound += pomMapGet( &hashMapCtx, key, NULL ) != NULL;
+    }
+    LOG( "%s resize: %u inserts in %fs, worst insert %fus, %u keys found", _incremental ? "Incremental" : "Full",
+         numKeys, totalTime, maxTime * 1e6, numFound );
+    if( numFound != numKeys ){
+        FAIL( "%s resize lost %u keys", _incremental ? "Incremental" : "Full", numKeys - numFound );
+    }
+    pomMapClear( &hashMapCtx );
+}
+
+typedef struct TestPairIter{
+    const PomMapPair *pairs;
+    size_t numPairs, idx;
+}TestPairIter;
+
+bool hashmapPairIter( void *_arg, const char **_key, const char **_value ){
+    TestPairIter *iter = (TestPairIter*) _arg;
+    if( iter->idx == iter->numPairs ){
+        return false;
+    }
+    *_key = iter->pairs[ iter->idx ].key;
+    *_value = iter->pairs[ iter->idx ].value;
+    iter->idx++;
+    return true;
+}
+
+// Compare building a map with pomMapSet against the bulk loaders
+void hashmapProfileBulk(){
+    uint32_t numKeys = 100000;
+    char *strings = (char*) malloc( numKeys * 32 );
+    PomMapPair *pairs = (PomMapPair*) malloc( numKeys * sizeof( PomMapPair ) );
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        char *key = strings + i * 32;
+        snprintf( key, 16, "key%u", i );
+        snprintf( key + 16, 16, "value%u", i );
+        pairs[ i ] = (PomMapPair){ key, key + 16 };
+    }
+
+    // Take the best of a few runs, so one slow run on a busy machine doesn't decide it
+    double times[ 3 ] = { 1e9, 1e9, 1e9 };
+    uint32_t numErrors = 0;
+    for( int run = 0; run < 3; run++ ){
+        for( int method = 0; method < 3; method++ ){
+            PomMapCtx hashMapCtx;
+            pomMapInit( &hashMapCtx, 0 );
+            struct timespec start, end, diff;
+            getTime( &start );
+            if( method == 0 ){
+                for( uint32_t i = 0; i < numKeys; i++ ){
+                    pomMapSet( &hashMapCtx, pairs[ i ].key, pairs[ i ].value );
+                }
+            }
+            else if( method == 1 ){
+                pomMapSetMany( &hashMapCtx, pairs, numKeys );
+            }
+            else{
+                TestPairIter iter = { pairs, numKeys, 0 };
+                pomMapSetManyIter( &hashMapCtx, hashmapPairIter, &iter );
+            }
+            getTime( &end );
+            timeDiff( &start, &end, &diff );
+            double time = concatTime( &diff );
+            times[ method ] = time < times[ method ] ? time : times[ method ];
+            for( uint32_t i = 0; i < numKeys; i++ ){
+                const char *found = pomMapGet( &hashMapCtx, pairs[ i ].key, NULL );
+                numErrors += !found || strcmp( found, pairs[ i ].value );
+            }
+            pomMapClear( &hashMapCtx );
+        }
+    }
+    LOG( "Bulk load %u keys: pomMapSet %fs, pomMapSetMany %fs (%.2fx), pomMapSetManyIter %fs (%.2fx), %u errors",
+         numKeys, times[ 0 ], times[ 1 ], times[ 0 ] / times[ 1 ], times[ 2 ], times[ 0 ] / times[ 2 ], numErrors );
+    if( numErrors ){
+        FAIL( "Bulk load lost %u values", numErrors );
+    }
+    // Sizing everything once and probing once per pair should put the bulk loader
+    // well clear of a pomMapSet loop
+    double minSpeedup = 1.3;
+    if( times[ 1 ] * minSpeedup > times[ 0 ] ){
+        FAIL( "pomMapSetMany isn't %.1fx faster than a pomMapSet loop", minSpeedup );
+    }
+    free( pairs );
+    free( strings );
+}
+
+void testHashmapProfile(){
+    hashmapProfileHash( "sdbm", pomMapHashSdbm, 0 );
+    hashmapProfileHash( "default", NULL, 0 );
+    hashmapProfileHash( "default (seeded)", NULL, pomMapRandomSeed() );
+    hashmapProfileResize( false );
+    hashmapProfileResize( true );
+    hashmapProfileBulk();
+}
+
+typedef struct TestGMapValue{
+    uint64_t id;
+    double weight;
+}TestGMapValue;
+
+void testGenericHashmap(){
+    // u64 -> struct, using the integer key path
+    PomGMapCtx intMap;
+    pomGMapInit( &intMap, 0, sizeof( uint64_t ), sizeof( TestGMapValue ), NULL, NULL, 0 );
+    uint64_t numKeys = 10000;
+    for( uint64_t i = 0; i < numKeys; i++ ){
+        uint64_t key = i * 0x10001;
+        TestGMapValue value = { .id = i, .weight = i * 0.5 };
+        pomGMapSet( &intMap, &key, &value );
+    }
+    for( uint64_t i = 0; i < numKeys; i += 3 ){
+        uint64_t key = i * 0x10001;
+        pomGMapRemove( &intMap, &key );
+    }
+    uint32_t numErrors = 0;
+    for( uint64_t i = 0; i < numKeys; i++ ){
+        uint64_t key = i * 0x10001;
+        TestGMapValue *value = (TestGMapValue*) pomGMapGet( &intMap, &key );
+        if( i % 3 == 0 ? value != NULL : ( !value || value->id != i ) ){
+            numErrors++;
+        }
+    }
+    pomGMapClear( &intMap );
+
+    // Arbitrary 12-byte keys, hashed as raw bytes
+    PomGMapCtx byteMap;
+    pomGMapInit( &byteMap, 0, 12, sizeof( uint32_t ), NULL, NULL, pomMapRandomSeed() );
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        uint32_t key[ 3 ] = { i, ~i, i * 3 };
+        pomGMapSet( &byteMap, key, &i );
+    }
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        uint32_t key[ 3 ] = { i, ~i, i * 3 };
+        uint32_t *value = (uint32_t*) pomGMapGet( &byteMap, key );
+        if( !value || *value != i ){
+            numErrors++;
+        }
+    }
+    pomGMapClear( &byteMap );
+
+    if( numErrors ){
+        FAIL( "Generic hashmap lookup failed for %u keys", numErrors );
+    }
+    else{
+        LOG( "Generic hashmap returned correct values" );
+    }
+}
+
+void testFrozenHashmap(){
+    PomMapCtx hashMapCtx;
+    pomMapInitHash( &hashMapCtx, 0, NULL, pomMapRandomSeed() );
+    uint32_t numKeys = 100000;
+    char key[ 32 ], value[ 32 ];
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        snprintf( value, sizeof( value ), "value%u", i );
+        pomMapSet( &hashMapCtx, key, value );
+    }
+
+    struct timespec start, end, diff;
+    PomMapFrozenCtx frozen;
+    getTime( &start );
+    int ret = pomMapFreeze( &hashMapCtx, &frozen );
+    getTime( &end );
+    timeDiff( &start, &end, &diff );
+    LOG( "Froze %u keys in %fs (%zu bytes)", numKeys, concatTime( &diff ), frozen.blockSize );
+
+    uint32_t numErrors = ret;
+    double mapTime = 0, frozenTime = 0;
+    for( int pass = 0; pass < 2; pass++ ){
+        getTime( &start );
+        for( uint32_t i = 0; i < numKeys; i++ ){
+            snprintf( key, sizeof( key ), "key%u", i );
+            snprintf( value, sizeof( value ), "value%u", i );
+            const char *found = pass ? pomMapFrozenGet( &frozen, key, NULL ) : pomMapGet( &hashMapCtx, key, NULL );
+            if( !found || strcmp( found, value ) ){
+                numErrors++;
+            }
+            snprintf( key, sizeof( key ), "missing%u", i );
+            const char *missing = pass ? pomMapFrozenGet( &frozen, key, NULL ) : pomMapGet( &hashMapCtx, key, NULL );
+            numErrors += missing != NULL;
+        }
+        getTime( &end );
+        timeDiff( &start, &end, &diff );
+        *( pass ? &frozenTime : &mapTime ) = concatTime( &diff );
+    }
+    pomMapClear( &hashMapCtx );
+
+    // Round-trip through a file
+    const char *path = "pom_map_frozen.bin";
+    PomMapFrozenCtx loaded;
+    numErrors += pomMapFrozenSave( &frozen, path );
+    getTime( &start );
+    numErrors += pomMapFrozenLoad( &loaded, path, NULL );
+    getTime( &end );
+    timeDiff( &start, &end, &diff );
+    LOG( "Loaded frozen map in %fs", concatTime( &diff ) );
+    for( uint32_t i = 0; i < numKeys && numErrors == 0; i++ ){
+        snprintf( key, sizeof( key ), "key%u", i );
+        snprintf( value, sizeof( value ), "value%u", i );
+        const char *found = pomMapFrozenGet( &loaded, key, NULL );
+        if( !found || strcmp( found, value ) ){
+            numErrors++;
+        }
+    }
+    // Loading with the wrong hash function should be refused
+    PomMapFrozenCtx mismatched;
+    if( pomMapFrozenLoad( &mismatched, path, pomMapHashSdbm ) == 0 ){
+        numErrors++;
+        pomMapFrozenClear( &mismatched );
+    }
+    pomMapFrozenClear( &loaded );
+    remove( path );
+    pomMapFrozenClear( &frozen );
+
+    if( numErrors ){
+        FAIL( "Frozen hashmap lookup failed for %u keys", numErrors );
+    }
+    else{
+        LOG( "Frozen hashmap returned correct values" );
+    }
+    LOG( "Lookups: map %fs, frozen %fs", mapTime, frozenTime );
+}
+
+typedef struct TestTsMapThread{
+    PomMapTsCtx *map;
+    PomHpLocalCtx *lctx;
+    uint32_t threadIdx;
+    uint32_t numKeys;
+    uint32_t numIter;
+    uint32_t numErrors;
+}TestTsMapThread;
+
+// Write this thread's own keys while checking the shared keys, which never change
+int tsMapWriterThread( void *_data ){
+    TestTsMapThread *data = (TestTsMapThread*) _data;
+    char key[ 32 ], value[ 32 ];
+    for( uint32_t i = 0; i < data->numKeys; i++ ){
+        snprintf( key, sizeof( key ), "t%u-%u", data->threadIdx, i );
+        snprintf( value, sizeof( value ), "v%u", i );
+        pomMapTsSet( data->map, data->lctx, key, value );
+
+        snprintf( key, sizeof( key ), "shared%u", i );
+        snprintf( value, sizeof( value ), "s%u", i );
+        const char *found = pomMapTsGet( data->map, data->lctx, key, NULL );
+        if( !found || strcmp( found, value ) ){
+            data->numErrors++;
+        }
+    }
+    // Remove every other one of our keys again
+    for( uint32_t i = 0; i < data->numKeys; i += 2 ){
+        snprintf( key, sizeof( key ), "t%u-%u", data->threadIdx, i );
+        pomMapTsRemove( data->map, data->lctx, key );
+    }
+    pomMapTsRelease( data->map, data->lctx );
+    return (int) data->threadIdx;
+}
+
+int tsMapReaderThread( void *_data ){
+    TestTsMapThread *data = (TestTsMapThread*) _data;
+    char key[ 32 ];
+    for( uint32_t n = 0; n < data->numIter; n++ ){
+        for( uint32_t i = 0; i < data->numKeys; i++ ){
+            snprintf( key, sizeof( key ), "shared%u", i );
+            data->numErrors += pomMapTsGet( data->map, data->lctx, key, NULL ) == NULL;
+        }
+    }
+    pomMapTsRelease( data->map, data->lctx );
+    return (int) data->threadIdx;
+}
+
+// Repeatedly set and remove this thread's own keys, which should be served from
+// the map's snapshot pools once warmed up
+int tsMapChurnThread( void *_data ){
+    TestTsMapThread *data = (TestTsMapThread*) _data;
+    char key[ 32 ];
+    for( uint32_t n = 0; n < data->numIter; n++ ){
+        for( uint32_t i = 0; i < data->numKeys; i++ ){
+            snprintf( key, sizeof( key ), "c%u-%u", data->threadIdx, i );
+            pomMapTsSet( data->map, data->lctx, key, "churn" );
+        }
+        for( uint32_t i = 0; i < data->numKeys; i++ ){
+            snprintf( key, sizeof( key ), "c%u-%u", data->threadIdx, i );
+            pomMapTsRemove( data->map, data->lctx, key );
+        }
+    }
+    return (int) data->threadIdx;
+}
+
+// Run `_numThreads` threads of `_func` over the map, returning the total error count.
+// Thread contexts are reused between runs, since they can only be cleared once
+// every thread is done with the map
+uint32_t tsMapRunThreads( PomMapTsCtx *_map, thrd_start_t _func, uint32_t _numThreads,
+                          uint32_t _numKeys, uint32_t _numIter, PomHpLocalCtx *_lctxs ){
+    thrd_t threads[ 4 ];
+    TestTsMapThread data[ 4 ];
+    for( uint32_t t = 0; t < _numThreads; t++ ){
+        data[ t ] = (TestTsMapThread){ _map, &_lctxs[ t ], t, _numKeys, _numIter, 0 };
+        thrd_create( &threads[ t ], _func, &data[ t ] );
+    }
+    uint32_t numErrors = 0;
+    for( uint32_t t = 0; t < _numThreads; t++ ){
+        thrd_join( threads[ t ], NULL );
+        numErrors += data[ t ].numErrors;
+    }
+    return numErrors;
+}
+
+void testConcurrentHashmap(){
+    PomMapTsCtx map;
+    pomMapTsInit( &map, 0, NULL, pomMapRandomSeed() );
+    PomHpLocalCtx lctx, threadLctxs[ 4 ];
+    pomMapTsThreadInit( &map, &lctx );
+    for( uint32_t t = 0; t < 4; t++ ){
+        pomMapTsThreadInit( &map, &threadLctxs[ t ] );
+    }
+
+    uint32_t numKeys = 5000;
+    char key[ 32 ], value[ 32 ];
+    for( uint32_t i = 0; i < numKeys; i++ ){
+        snprintf( key, sizeof( key ), "shared%u", i );
+        snprintf( value, sizeof( value ), "s%u", i );
+        pomMapTsSet( &map, &lctx, key, value );
+    }
+
+    // Writers force resizes while readers are running
+    uint32_t numErrors = tsMapRunThreads( &map, tsMapWriterThread, 4, numKeys, 1, threadLctxs );
+    for( uint32_t t = 0; t < 4; t++ ){
+        for( uint32_t i = 0; i < numKeys; i++ ){
+            snprintf( key, sizeof( key ), "t%u-%u", t, i );
+            snprintf( value, sizeof( value ), "v%u", i );
+            const char *found = pomMapTsGet( &map, &lctx, key, NULL );
+            if( i % 2 == 0 ? found != NULL : ( !found || strcmp( found, value ) ) ){
+                numErrors++;
+            }
+        }
+    }
+    if( numErrors ){
+        FAIL( "Concurrent hashmap lookup failed for %u keys", numErrors );
+    }
+    else{
+        LOG( "Concurrent hashmap returned correct values" );
+    }
+
+    // Read throughput as readers are added
+    for( uint32_t numThreads = 1; numThreads <= 4; numThreads *= 2 ){
+        struct timespec start, end, diff;
+        timespec_get( &start, TIME_UTC );
+        numErrors = tsMapRunThreads( &map, tsMapReaderThread, numThreads, numKeys, 20, threadLctxs );
+        timespec_get( &end, TIME_UTC );
+        timeDiff( &start, &end, &diff );
+        double numGets = (double) numThreads * numKeys * 20;
+        LOG( "Concurrent hashmap: %u reader threads, %f Mgets/s, %u misses", numThreads,
+             numGets / concatTime( &diff ) / 1e6, numErrors );
+    }
+
+    // Write throughput under set/remove churn
+    for( uint32_t numThreads = 1; numThreads <= 4; numThreads *= 2 ){
+        struct timespec start, end, diff;
+        timespec_get( &start, TIME_UTC );
+        tsMapRunThreads( &map, tsMapChurnThread, numThreads, 1000, 20, threadLctxs );
+        timespec_get( &end, TIME_UTC );
+        timeDiff( &start, &end, &diff );
+        double numWrites = (double) numThreads * 1000 * 20 * 2;
+        LOG( "Concurrent hashmap: %u writer threads, %f Mwrites/s", numThreads,
+             numWrites / concatTime( &diff ) / 1e6 );
+    }
+
+    for( uint32_t t = 0; t < 4; t++ ){
+        pomMapTsThreadClear( &map, &threadLctxs[ t ] );
+    }
+    pomMapTsThreadClear( &map, &lctx );
+    pomMapTsClear( &map );
+}
+
+typedef struct TestQueueWaiter{
+    PomQueueCtx *queue;
+    PomHpGlobalCtx *hpgctx;
+    PomHpLocalCtx *hplctx;
+    void *value;
+}TestQueueWaiter;
+
+// Wait (indefinitely) for a single item
+int queueWaiterThread( void *_data ){
+    TestQueueWaiter *data = (TestQueueWaiter*) _data;
+    while( !data->value ){
+        data->value = pomQueuePopWait( data->queue, data->hpgctx, data->hplctx, NULL );
+    }
+    return 0;
+}
+
 void testQueues(){
     LOG( "Testing queues" );
-    PomQueueCtx *queueCtx = (PomQueueCtx*) malloc( sizeof( PomQueueCtx ) );
+    PomQueueCtx *queueCtx = (PomQueueCtx*) aligned_alloc( POM_CACHE_LINE_SIZE, sizeof( PomQueueCtx ) );
     pomQueueInit( queueCtx );
 
     PomHpGlobalCtx *hpgctx = (PomHpGlobalCtx*) malloc( sizeof( PomHpGlobalCtx ) );
@@ -71,14 +818,418 @@ void testQueues(){
     pomHpThreadInit( hpgctx, hplctx, 2 );
 
     void * pushVal = (void*) 12345;
+    bool wasEmpty = pomQueueIsEmpty( queueCtx );
     pomQueuePush( queueCtx, hpgctx, hplctx, pushVal );
+    if( !wasEmpty || pomQueueIsEmpty( queueCtx ) || pomQueueLength( queueCtx ) != 1 ){
+        FAIL( "Queue reported wrong length/emptiness" );
+    }
     void * val = pomQueuePop( queueCtx, hpgctx, hplctx );
     if( val != pushVal ){
-        LOG( "Queue didn't pop same value as was pushed" );
+        FAIL( "Queue didn't pop same value as was pushed" );
     }
     else{
         LOG( "Queue popped same value as was pushed" );
     }
+    if( !pomQueueIsEmpty( queueCtx ) || pomQueueLength( queueCtx ) != 0 ){
+        FAIL( "Queue reported wrong length/emptiness" );
+    }
+
+    // Blocking pops should time out on an empty queue, and sleep rather than spin
+    pomQueueSetBlocking( queueCtx, true );
+    struct timespec start, end, diff, cpuStart, cpuEnd, cpuDiff;
+    timespec_get( &start, TIME_UTC );
+    getTime( &cpuStart );
+    val = pomQueuePopWait( queueCtx, hpgctx, hplctx, &(struct timespec){ .tv_sec = 0, .tv_nsec = 50e6 } );
+    getTime( &cpuEnd );
+    timespec_get( &end, TIME_UTC );
+    timeDiff( &start, &end, &diff );
+    timeDiff( &cpuStart, &cpuEnd, &cpuDiff );
+    if( val || concatTime( &diff ) < 0.045 ){
+        FAIL( "Blocking pop didn't time out properly" );
+    }
+    LOG( "Blocking pop waited %fs, using %fs CPU", concatTime( &diff ), concatTime( &cpuDiff ) );
+
+    // ...and wake up for a push from another thread
+    PomHpLocalCtx *waiterLctx = (PomHpLocalCtx*) malloc( sizeof( PomHpLocalCtx ) );
+    pomHpThreadInit( hpgctx, waiterLctx, 2 );
+    TestQueueWaiter waiter = { queueCtx, hpgctx, waiterLctx, NULL };
+    thrd_t waiterThread;
+    thrd_create( &waiterThread, queueWaiterThread, &waiter );
+    thrd_sleep( &(struct timespec){ .tv_sec = 0, .tv_nsec = 10e6 }, NULL );
+    pomQueuePush( queueCtx, hpgctx, hplctx, pushVal );
+    thrd_join( waiterThread, NULL );
+    if( waiter.value != pushVal ){
+        FAIL( "Blocking pop wasn't woken by a push" );
+    }
+    else{
+        LOG( "Blocking pop was woken by a push" );
+    }
+
+    pomQueueClear( queueCtx, hpgctx, hplctx );
+    pomHpThreadClear( hpgctx, waiterLctx );
+    pomHpThreadClear( hpgctx, hplctx );
+    pomHpGlobalClear( hpgctx );
+    free( waiterLctx );
+    free( hplctx );
+    free( hpgctx );
+    free( queueCtx );
+}
+
+// Shared between the producer/consumer threads of one queue profile run
+typedef struct TestQueueShared{
+    PomQueueCtx *queue;
+    PomHpGlobalCtx *hpgctx;
+    PomQueueMpmcCtx *ring;
+    uint32_t numItems;
+    uint32_t numProducers;
+    // Linked queue only, push/pop this many at a time when above 1
+    uint32_t batchSize;
+    _Atomic uint32_t numPopped;
+    _Atomic uint64_t popSum;
+}TestQueueShared;
+
+typedef struct TestQueueThread{
+    TestQueueShared *shared;
+    PomHpLocalCtx *hplctx;
+    uint32_t threadIdx;
+}TestQueueThread;
+
+// Producers push `numItems` values each, all non-zero so they can't be mistaken for
+// an empty pop
+int queueProducerThread( void *_data ){
+    TestQueueThread *data = (TestQueueThread*) _data;
+    TestQueueShared *shared = data->shared;
+    void *batch[ 64 ];
+    for( uint32_t i = 0; i < shared->numItems; i++ ){
+        void *value = (void*) (uintptr_t) ( i + 1 );
+        if( shared->batchSize > 1 ){
+            batch[ i % shared->batchSize ] = value;
+            if( ( i + 1 ) % shared->batchSize == 0 || i + 1 == shared->numItems ){
+                pomQueuePushMany( shared->queue, shared->hpgctx, data->hplctx, batch,
+                                  i % shared->batchSize + 1 );
+            }
+        }else if( shared->ring ){
+            while( pomQueueMpmcPush( shared->ring, value ) ){
+                thrd_yield();
+            }
+        }else{
+            pomQueuePush( shared->queue, shared->hpgctx, data->hplctx, value );
+        }
+    }
+    return 0;
+}
+
+// Consumers pop until every producer's items have been seen
+int queueConsumerThread( void *_data ){
+    TestQueueThread *data = (TestQueueThread*) _data;
+    TestQueueShared *shared = data->shared;
+    uint32_t total = shared->numItems * shared->numProducers;
+    uint64_t sum = 0;
+    void *batch[ 64 ];
+    while( shared->batchSize > 1 && atomic_load( &shared->numPopped ) < total ){
+        uint32_t count = pomQueuePopMany( shared->queue, shared->hpgctx, data->hplctx, batch,
+                                          shared->batchSize );
+        for( uint32_t i = 0; i < count; i++ ){
+            sum += (uintptr_t) batch[ i ];
+        }
+        if( count ){
+            atomic_fetch_add( &shared->numPopped, count );
+        }else{
+            thrd_yield();
+        }
+    }
+    while( atomic_load( &shared->numPopped ) < total ){
+        void *value = shared->ring ? pomQueueMpmcPop( shared->ring ) :
+                      pomQueuePop( shared->queue, shared->hpgctx, data->hplctx );
+        if( value ){
+            sum += (uintptr_t) value;
+            atomic_fetch_add( &shared->numPopped, 1 );
+        }else{
+            thrd_yield();
+        }
+    }
+    atomic_fetch_add( &shared->popSum, sum );
+    return 0;
+}
+
+// Run `_numThreads` producers and as many consumers over one of the queues, returning
+// the wall-clock time taken
+double queueProfileRun( TestQueueShared *_shared, PomHpLocalCtx *_hplctxs, uint32_t _numThreads ){
+    thrd_t threads[ 16 ];
+    TestQueueThread data[ 16 ];
+    _shared->numProducers = _numThreads;
+    atomic_store( &_shared->numPopped, 0 );
+    atomic_store( &_shared->popSum, 0 );
+    struct timespec start, end, diff;
+    timespec_get( &start, TIME_UTC );
+    for( uint32_t t = 0; t < _numThreads * 2; t++ ){
+        bool producer = t < _numThreads;
+        data[ t ] = (TestQueueThread){ _shared, _hplctxs ? &_hplctxs[ t ] : NULL, t };
+        thrd_create( &threads[ t ], producer ? queueProducerThread : queueConsumerThread, &data[ t ] );
+    }
+    for( uint32_t t = 0; t < _numThreads * 2; t++ ){
+        thrd_join( threads[ t ], NULL );
+    }
+    timespec_get( &end, TIME_UTC );
+    timeDiff( &start, &end, &diff );
+
+    uint64_t expected = (uint64_t) _numThreads * _shared->numItems * ( _shared->numItems + 1 ) / 2;
+    if( atomic_load( &_shared->popSum ) != expected ){
+        FAIL( "Queue lost or duplicated items" );
+    }
+    return concatTime( &diff );
+}
+
+void testQueueMpmc(){
+    PomQueueMpmcCtx ring;
+    pomQueueMpmcInit( &ring, 4 );
+    uint32_t numPushed = 0;
+    while( !pomQueueMpmcPush( &ring, (void*) (uintptr_t) ( numPushed + 1 ) ) ){
+        numPushed++;
+    }
+    uint32_t numErrors = numPushed != 4;
+    for( uint32_t i = 0; i < numPushed; i++ ){
+        numErrors += pomQueueMpmcPop( &ring ) != (void*) (uintptr_t) ( i + 1 );
+    }
+    numErrors += pomQueueMpmcPop( &ring ) != NULL;
+    pomQueueMpmcClear( &ring );
+    if( numErrors ){
+        FAIL( "MPMC ring returned wrong values" );
+    }
+    else{
+        LOG( "MPMC ring returned correct values" );
+    }
+
+    // 8 producers and 8 consumers against the ring and the linked queue
+    uint32_t numThreads = 8;
+    TestQueueShared shared = { .numItems = 100000 };
+    pomQueueMpmcInit( &ring, 1024 );
+    shared.ring = &ring;
+    double ringTime = queueProfileRun( &shared, NULL, numThreads );
+    pomQueueMpmcClear( &ring );
+
+    PomQueueCtx queue;
+    PomHpGlobalCtx hpgctx;
+    PomHpLocalCtx hplctxs[ 16 ];
+    pomQueueInit( &queue );
+    pomHpGlobalInit( &hpgctx );
+    for( uint32_t t = 0; t < numThreads * 2; t++ ){
+        pomHpThreadInit( &hpgctx, &hplctxs[ t ], 2 );
+    }
+    shared.ring = NULL;
+    shared.queue = &queue;
+    shared.hpgctx = &hpgctx;
+    double queueTime = queueProfileRun( &shared, hplctxs, numThreads );
+    shared.batchSize = 16;
+    double batchTime = queueProfileRun( &shared, hplctxs, numThreads );
+    pomQueueClear( &queue, &hpgctx, &hplctxs[ 0 ] );
+    for( uint32_t t = 0; t < numThreads * 2; t++ ){
+        pomHpThreadClear( &hpgctx, &hplctxs[ t ] );
+    }
+    pomHpGlobalClear( &hpgctx );
+
+    double numOps = (double) numThreads * shared.numItems;
+    LOG( "%uP/%uC: ring %f Mitems/s, linked queue %f Mitems/s, batches of %u %f Mitems/s",
+         numThreads, numThreads, numOps / ringTime / 1e6, numOps / queueTime / 1e6,
+         shared.batchSize, numOps / batchTime / 1e6 );
+}
+
+typedef struct TestSpscThread{
+    PomQueueSpscCtx *ring;
+    uint32_t numItems;
+}TestSpscThread;
+
+int spscProducerThread( void *_data ){
+    TestSpscThread *data = (TestSpscThread*) _data;
+    for( uint32_t i = 1; i <= data->numItems; i++ ){
+        while( pomQueueSpscPush( data->ring, (void*) (uintptr_t) i ) ){
+            thrd_yield();
+        }
+    }
+    return 0;
+}
+
+// Push `_numItems` through an SPSC ring from another thread, returning the wall-clock
+// time taken. Items should come out in order, with nothing lost
+double spscRun( uint32_t _numItems, uint32_t *_numErrors ){
+    PomQueueSpscCtx ring;
+    pomQueueSpscInit( &ring, 4096 );
+    TestSpscThread data = { &ring, _numItems };
+    struct timespec start, end, diff;
+    timespec_get( &start, TIME_UTC );
+    thrd_t producer;
+    thrd_create( &producer, spscProducerThread, &data );
+    for( uint32_t i = 1; i <= _numItems; i++ ){
+        void *value;
+        while( !( value = pomQueueSpscPop( &ring ) ) ){
+            thrd_yield();
+        }
+        *_numErrors += value != (void*) (uintptr_t) i;
+    }
+    thrd_join( producer, NULL );
+    timespec_get( &end, TIME_UTC );
+    timeDiff( &start, &end, &diff );
+    *_numErrors += pomQueueSpscPop( &ring ) != NULL;
+    pomQueueSpscClear( &ring );
+    return concatTime( &diff );
+}
+
+void testQueueSpsc(){
+    uint32_t numItems = 10000000;
+    uint32_t numErrors = 0;
+    double time = spscRun( numItems, &numErrors );
+    if( numErrors ){
+        FAIL( "SPSC ring returned %u wrong values", numErrors );
+    }
+    else{
+        LOG( "SPSC ring returned correct values" );
+    }
+    LOG( "SPSC ring: %f Mitems/s", numItems / time / 1e6 );
+}
+
+typedef struct TestWsShared{
+    PomQueueWsCtx deque;
+    uint32_t numItems;
+    _Atomic bool ownerDone;
+    // How many times each item came out
+    _Atomic uint8_t *taken;
+}TestWsShared;
+
+int wsThiefThread( void *_data ){
+    TestWsShared *shared = (TestWsShared*) _data;
+    while( true ){
+        void *value = pomQueueWsSteal( &shared->deque );
+        if( value ){
+            atomic_fetch_add( &shared->taken[ (uintptr_t) value - 1 ], 1 );
+        }else if( atomic_load( &shared->ownerDone ) ){
+            return 0;
+        }else{
+            thrd_yield();
+        }
+    }
+}
+
+// The owner pushes `_numItems` items and pops some of them back while `_numThieves`
+// threads steal. Every item should come out exactly once. Returns the wall-clock time
+double wsRun( uint32_t _numItems, uint32_t _numThieves, uint32_t *_numErrors ){
+    TestWsShared shared = { .numItems = _numItems };
+    // Small enough that the owner regularly finds it full
+    pomQueueWsInit( &shared.deque, 256 );
+    atomic_init( &shared.ownerDone, false );
+    shared.taken = (_Atomic uint8_t*) calloc( _numItems, sizeof( _Atomic uint8_t ) );
+    thrd_t thieves[ 8 ];
+    struct timespec start, end, diff;
+    timespec_get( &start, TIME_UTC );
+    for( uint32_t t = 0; t < _numThieves; t++ ){
+        thrd_create( &thieves[ t ], wsThiefThread, &shared );
+    }
+    for( uint32_t i = 1; i <= _numItems; i++ ){
+        while( pomQueueWsPush( &shared.deque, (void*) (uintptr_t) i ) ){
+            void *value = pomQueueWsPop( &shared.deque );
+            if( value ){
+                atomic_fetch_add( &shared.taken[ (uintptr_t) value - 1 ], 1 );
+            }
+        }
+        if( i % 3 == 0 ){
+            void *value = pomQueueWsPop( &shared.deque );
+            if( value ){
+                atomic_fetch_add( &shared.taken[ (uintptr_t) value - 1 ], 1 );
+            }
+        }
+    }
+    void *value;
+    while( ( value = pomQueueWsPop( &shared.deque ) ) ){
+        atomic_fetch_add( &shared.taken[ (uintptr_t) value - 1 ], 1 );
+    }
+    atomic_store( &shared.ownerDone, true );
+    for( uint32_t t = 0; t < _numThieves; t++ ){
+        thrd_join( thieves[ t ], NULL );
+    }
+    timespec_get( &end, TIME_UTC );
+    timeDiff( &start, &end, &diff );
+    for( uint32_t i = 0; i < _numItems; i++ ){
+        *_numErrors += atomic_load( &shared.taken[ i ] ) != 1;
+    }
+    free( (void*) shared.taken );
+    pomQueueWsClear( &shared.deque );
+    return concatTime( &diff );
+}
+
+void testQueueWs(){
+    // Owner pops newest first, thieves take oldest first
+    PomQueueWsCtx deque;
+    pomQueueWsInit( &deque, 4 );
+    bool orderOk = !pomQueueWsPop( &deque ) && !pomQueueWsSteal( &deque );
+    for( uintptr_t i = 1; i <= 4; i++ ){
+        orderOk &= !pomQueueWsPush( &deque, (void*) i );
+    }
+    orderOk &= pomQueueWsPush( &deque, (void*) 5 ) == 1;
+    orderOk &= pomQueueWsSteal( &deque ) == (void*) 1;
+    orderOk &= pomQueueWsPop( &deque ) == (void*) 4;
+    orderOk &= pomQueueWsPop( &deque ) == (void*) 3;
+    orderOk &= pomQueueWsSteal( &deque ) == (void*) 2;
+    orderOk &= !pomQueueWsPop( &deque ) && !pomQueueWsSteal( &deque );
+    pomQueueWsClear( &deque );
+    if( !orderOk ){
+        FAIL( "Work-stealing deque returned items in the wrong order" );
+    }
+
+    uint32_t numItems = 2000000;
+    uint32_t numErrors = 0;
+    double time = wsRun( numItems, 4, &numErrors );
+    if( numErrors ){
+        FAIL( "Work-stealing deque lost or duplicated %u items", numErrors );
+    }
+    else{
+        LOG( "Work-stealing deque returned every item once" );
+    }
+    LOG( "Work-stealing deque, 1 owner + 4 thieves: %f Mitems/s", numItems / time / 1e6 );
+}
+
+// Short runs of every lock-free queue variant, meant for running under ThreadSanitizer
+// (`make tsan`) rather than for timing
+void testQueueStress(){
+    uint32_t numThreads = 4;
+    uint32_t numErrors = 0;
+    PomQueueMpmcCtx ring;
+    PomQueueCtx queue;
+    PomHpGlobalCtx hpgctx;
+    PomHpLocalCtx hplctxs[ 8 ];
+    pomQueueInit( &queue );
+    pomHpGlobalInit( &hpgctx );
+    for( uint32_t t = 0; t < numThreads * 2; t++ ){
+        pomHpThreadInit( &hpgctx, &hplctxs[ t ], 2 );
+    }
+
+    for( uint32_t round = 0; round < 4; round++ ){
+        TestQueueShared shared = { .numItems = 20000 };
+        // Small ring so producers regularly find it full
+        pomQueueMpmcInit( &ring, 16 );
+        shared.ring = &ring;
+        queueProfileRun( &shared, NULL, numThreads );
+        pomQueueMpmcClear( &ring );
+
+        shared.ring = NULL;
+        shared.queue = &queue;
+        shared.hpgctx = &hpgctx;
+        shared.batchSize = round % 2 ? 7 : 1;
+        queueProfileRun( &shared, hplctxs, numThreads );
+
+        spscRun( 100000, &numErrors );
+        wsRun( 50000, 3, &numErrors );
+    }
+
+    pomQueueClear( &queue, &hpgctx, &hplctxs[ 0 ] );
+    for( uint32_t t = 0; t < numThreads * 2; t++ ){
+        pomHpThreadClear( &hpgctx, &hplctxs[ t ] );
+    }
+    pomHpGlobalClear( &hpgctx );
+    if( numErrors ){
+        FAIL( "Queue stress test: SPSC ring/work-stealing deque returned %u wrong values", numErrors );
+    }
+    else{
+        LOG( "Queue stress test finished" );
+    }
 }
 
 void testThreadFuncSanity( void* UNUSED( _data ) ){
@@ -160,6 +1311,187 @@ struct timespec threadpoolProfile( void *data ){
     return sjTime;
 }
 
+// A binary tree of jobs, where each job schedules its two children from inside the pool
+typedef struct TestFanOut TestFanOut;
+typedef struct TestFanOutNode{
+    TestFanOut *tree;
+    uint32_t idx;
+    PomThreadpoolJob job;
+}TestFanOutNode;
+
+struct TestFanOut{
+    PomThreadpoolCtx *ctx;
+    TestFanOutNode *nodes;
+    uint32_t numNodes;
+    _Atomic uint32_t numRun;
+};
+
+void testFanOutJob( void *_data ){
+    TestFanOutNode *node = (TestFanOutNode*) _data;
+    TestFanOut *tree = node->tree;
+    for( uint32_t child = node->idx * 2 + 1; child <= node->idx * 2 + 2 && child < tree->numNodes; child++ ){
+        pomThreadpoolScheduleJob( tree->ctx, &tree->nodes[ child ].job );
+    }
+    // A small amount of work per job
+    for( volatile int i = 0; i < 100; i++ ){
+    }
+    atomic_fetch_add_explicit( &tree->numRun, 1, memory_order_relaxed );
+}
+
+// Run a tree of fine-grained jobs through pools of different sizes, returning the
+// number of jobs that didn't run
+uint32_t threadpoolFanOutProfile(){
+    uint32_t numNodes = ( 1 << 17 ) - 1;
+    uint32_t numErrors = 0;
+    TestFanOut tree = { .numNodes = numNodes };
+    tree.nodes = (TestFanOutNode*) malloc( sizeof( TestFanOutNode ) * numNodes );
+    for( uint32_t i = 0; i < numNodes; i++ ){
+        tree.nodes[ i ] = (TestFanOutNode){ &tree, i, { .func = testFanOutJob, .args = &tree.nodes[ i ] } };
+    }
+    for( uint16_t numThreads = 1; numThreads <= 8; numThreads *= 2 ){
+        PomThreadpoolCtx ctx;
+        pomThreadpoolInit( &ctx, numThreads );
+        tree.ctx = &ctx;
+        atomic_store( &tree.numRun, 0 );
+        struct timespec start, end, diff;
+        timespec_get( &start, TIME_UTC );
+        pomThreadpoolScheduleJob( &ctx, &tree.nodes[ 0 ].job );
+        pomThreadpoolJoinAll( &ctx );
+        timespec_get( &end, TIME_UTC );
+        timeDiff( &start, &end, &diff );
+        numErrors += numNodes - atomic_load( &tree.numRun );
+        LOG( "Fan-out of %u jobs on %u threads: %f Mjobs/s", numNodes, numThreads,
+             numNodes / concatTime( &diff ) / 1e6 );
+        pomThreadpoolClear( &ctx );
+    }
+    free( tree.nodes );
+    return numErrors;
+}
+
+typedef struct TestSubmitter{
+    PomThreadpoolCtx *ctx;
+    PomThreadpoolJob *job;
+    uint32_t numJobs;
+}TestSubmitter;
+
+void testCountJob( void *_data ){
+    atomic_fetch_add_explicit( (_Atomic uint32_t*) _data, 1, memory_order_relaxed );
+}
+
+// Schedule jobs from outside the pool, then wait for them
+int threadpoolSubmitterThread( void *_data ){
+    TestSubmitter *submitter = (TestSubmitter*) _data;
+    for( uint32_t i = 0; i < submitter->numJobs; i++ ){
+        pomThreadpoolScheduleJob( submitter->ctx, submitter->job );
+    }
+    pomThreadpoolJoinAll( submitter->ctx );
+    return 0;
+}
+
+// Several outside threads scheduling on the same pool at once. Returns the number of
+// jobs that didn't run
+uint32_t threadpoolMultiSubmit(){
+    uint32_t numSubmitters = 4;
+    uint32_t numJobs = 20000;
+    _Atomic uint32_t numRun = 0;
+    PomThreadpoolJob job = { .func = testCountJob, .args = &numRun };
+    PomThreadpoolCtx ctx;
+    pomThreadpoolInit( &ctx, 2 );
+    TestSubmitter submitter = { &ctx, &job, numJobs };
+    thrd_t submitters[ 4 ];
+    for( uint32_t t = 0; t < numSubmitters; t++ ){
+        thrd_create( &submitters[ t ], threadpoolSubmitterThread, &submitter );
+    }
+    for( uint32_t t = 0; t < numSubmitters; t++ ){
+        thrd_join( submitters[ t ], NULL );
+    }
+    pomThreadpoolJoinAll( &ctx );
+    pomThreadpoolClear( &ctx );
+    return numSubmitters * numJobs - atomic_load( &numRun );
+}
+
+typedef struct TestSlowJob{
+    _Atomic uint32_t numStarted;
+}TestSlowJob;
+
+void testSlowJob( void *_data ){
+    TestSlowJob *slow = (TestSlowJob*) _data;
+    atomic_fetch_add( &slow->numStarted, 1 );
+    thrd_sleep( &(struct timespec){ .tv_sec = 0, .tv_nsec = 200e6 }, NULL );
+}
+
+void testSquareJob( void *_data ){
+    uint64_t *value = (uint64_t*) _data;
+    *value *= *value;
+}
+
+// Sums the squares of 1..16 using a group of sub-jobs, waited on from inside the pool
+void * testSumSquaresFuture( void *_data ){
+    PomThreadpoolCtx *ctx = (PomThreadpoolCtx*) _data;
+    uint64_t values[ 16 ];
+    PomThreadpoolJob jobs[ 16 ];
+    PomThreadpoolGroup group;
+    pomThreadpoolGroupInit( &group, ctx );
+    for( uint32_t i = 0; i < 16; i++ ){
+        values[ i ] = i + 1;
+        jobs[ i ] = (PomThreadpoolJob){ .func = testSquareJob, .args = &values[ i ] };
+        pomThreadpoolGroupScheduleJob( &group, &jobs[ i ] );
+    }
+    pomThreadpoolGroupWait( &group );
+    uint64_t sum = 0;
+    for( uint32_t i = 0; i < 16; i++ ){
+        sum += values[ i ];
+    }
+    return (void*) (uintptr_t) sum;
+}
+
+// Waiting on a group of quick jobs shouldn't have to wait for slow jobs in another
+// group, and futures should give back their results. Returns the number of failures
+uint32_t threadpoolGroups(){
+    uint32_t numErrors = 0;
+    PomThreadpoolCtx ctx;
+    pomThreadpoolInit( &ctx, 2 );
+
+    // Tie up both workers with slow jobs
+    TestSlowJob slow;
+    atomic_init( &slow.numStarted, 0 );
+    PomThreadpoolJob slowJobs[ 2 ];
+    PomThreadpoolGroup slowGroup;
+    pomThreadpoolGroupInit( &slowGroup, &ctx );
+    for( uint32_t i = 0; i < 2; i++ ){
+        slowJobs[ i ] = (PomThreadpoolJob){ .func = testSlowJob, .args = &slow };
+        pomThreadpoolGroupScheduleJob( &slowGroup, &slowJobs[ i ] );
+    }
+    while( atomic_load( &slow.numStarted ) < 2 ){
+        thrd_yield();
+    }
+
+    _Atomic uint32_t numRun = 0;
+    PomThreadpoolJob quickJob = { .func = testCountJob, .args = &numRun };
+    PomThreadpoolGroup quickGroup;
+    pomThreadpoolGroupInit( &quickGroup, &ctx );
+    for( uint32_t i = 0; i < 100; i++ ){
+        pomThreadpoolGroupScheduleJob( &quickGroup, &quickJob );
+    }
+    pomThreadpoolGroupWait( &quickGroup );
+    // The slow jobs should still be going
+    numErrors += atomic_load( &numRun ) != 100;
+    numErrors += !atomic_load( &slowGroup.numPending );
+    pomThreadpoolGroupWait( &slowGroup );
+
+    PomThreadpoolFuture futures[ 4 ];
+    for( uint32_t i = 0; i < 4; i++ ){
+        pomThreadpoolFutureSchedule( &futures[ i ], &ctx, testSumSquaresFuture, &ctx );
+    }
+    for( uint32_t i = 0; i < 4; i++ ){
+        numErrors += (uintptr_t) pomThreadpoolFutureGet( &futures[ i ] ) != 1496;
+        numErrors += !pomThreadpoolFutureIsReady( &futures[ i ] );
+    }
+
+    pomThreadpoolClear( &ctx );
+    return numErrors;
+}
+
 void seqProfile( int numIter, void * data ){
     for( int i = 0; i < numIter; i++){
         testThreadFuncSanity( data );
@@ -193,5 +1525,157 @@ void testThreadpool(){
     float tpToSeqRatio = tpTimeMs / seqTimeMs ;
     LOG( "Threaded time: %f. Seq time %f. Tp is %f times slower or %f time faster.", tpTimeMs, seqTimeMs, tpToSeqRatio, 1/tpToSeqRatio );
     LOG( "SJ Time %f", sjTimeMs );
+    if( threadpoolFanOutProfile() ){
+        FAIL( "Not every job in the fan-out ran" );
+    }
+    if( threadpoolGroups() ){
+        FAIL( "Threadpool groups/futures failed" );
+    }
+    else{
+        LOG( "Threadpool group waited only on its own jobs, futures returned correct results" );
+    }
+    if( threadpoolMultiSubmit() ){
+        FAIL( "Not every job from multiple submitting threads ran" );
+    }
+    else{
+        LOG( "Every job from multiple submitting threads ran" );
+    }
+}
+
+
+void testDoubleRange( size_t _begin, size_t _end, void *_arg ){
+    uint64_t *values = (uint64_t*) _arg;
+    for( size_t i = _begin; i < _end; i++ ){
+        values[ i ] = i * 2;
+    }
+}
+
+void testSumRange( size_t _begin, size_t _end, void *_arg, void *_result ){
+    uint64_t *values = (uint64_t*) _arg;
+    uint64_t *sum = (uint64_t*) _result;
+    for( size_t i = _begin; i < _end; i++ ){
+        *sum += values[ i ];
+    }
+}
+
+void testSumCombine( void *_result, const void *_other, void *UNUSED( _arg ) ){
+    *(uint64_t*) _result += *(const uint64_t*) _other;
+}
+
+// Tracks which indices a piece covered, to check pieces are combined in order
+typedef struct TestSpan{
+    size_t first, last;
+    bool ok;
+}TestSpan;
+
+void testSpanRange( size_t _begin, size_t _end, void *UNUSED( _arg ), void *_result ){
+    TestSpan *span = (TestSpan*) _result;
+    span->ok &= span->first == SIZE_MAX;
+    *span = (TestSpan){ _begin, _end - 1, span->ok };
 }
 
+void testSpanCombine( void *_result, const void *_other, void *UNUSED( _arg ) ){
+    TestSpan *span = (TestSpan*) _result;
+    const TestSpan *other = (const TestSpan*) _other;
+    span->ok &= other->ok && span->last + 1 == other->first;
+    span->last = other->last;
+}
+
+// Work that grows with the index, so equal-sized chunks take very different times
+void testIrregularRange( size_t _begin, size_t _end, void *_arg ){
+    _Atomic uint64_t *total = (_Atomic uint64_t*) _arg;
+    uint64_t sum = 0;
+    for( size_t i = _begin; i < _end; i++ ){
+        for( volatile size_t j = 0; j < i; j++ ){
+            sum++;
+        }
+    }
+    atomic_fetch_add_explicit( total, sum, memory_order_relaxed );
+}
+
+typedef struct TestChunk{
+    size_t begin, end;
+    void *arg;
+}TestChunk;
+
+void testIrregularChunk( void *_data ){
+    TestChunk *chunk = (TestChunk*) _data;
+    testIrregularRange( chunk->begin, chunk->end, chunk->arg );
+}
+
+void testParallel(){
+    uint16_t numThreads = 4;
+    PomThreadpoolCtx ctx;
+    pomThreadpoolInit( &ctx, numThreads );
+
+    // Results should match a sequential run
+    size_t numValues = 1000000;
+    uint64_t *values = (uint64_t*) malloc( sizeof( uint64_t ) * numValues );
+    pomParallelFor( &ctx, 0, numValues, 0, testDoubleRange, values );
+    uint64_t sum, zero = 0;
+    pomParallelReduce( &ctx, 0, numValues, 1000, testSumRange, testSumCombine, values,
+                       &sum, sizeof( sum ), &zero );
+    uint64_t expectedSum = (uint64_t) numValues * ( numValues - 1 );
+    TestSpan span, spanIdentity = { SIZE_MAX, 0, true };
+    pomParallelReduce( &ctx, 10, 100000, 7, testSpanRange, testSpanCombine, NULL,
+                       &span, sizeof( span ), &spanIdentity );
+    bool ok = sum == expectedSum && span.ok && span.first == 10 && span.last == 99999;
+    pomParallelReduce( &ctx, 5, 5, 0, testSumRange, testSumCombine, values, &sum, sizeof( sum ), &zero );
+    ok &= sum == 0;
+    if( ok ){
+        LOG( "Parallel for/reduce gave correct results" );
+    }
+    else{
+        FAIL( "Parallel for/reduce gave wrong results" );
+    }
+    free( values );
+
+    // Irregular work: binary splitting vs one chunk per thread
+    size_t numIrregular = 20000;
+    _Atomic uint64_t total = 0;
+    struct timespec start, end, diff;
+    TestChunk chunks[ 5 ];
+    PomThreadpoolJob chunkJobs[ 5 ];
+    timespec_get( &start, TIME_UTC );
+    for( uint32_t c = 0; c < numThreads + 1u; c++ ){
+        chunks[ c ] = (TestChunk){ numIrregular * c / ( numThreads + 1 ), numIrregular * ( c + 1 ) / ( numThreads + 1 ), &total };
+        chunkJobs[ c ] = (PomThreadpoolJob){ .func = testIrregularChunk, .args = &chunks[ c ] };
+        pomThreadpoolScheduleJob( &ctx, &chunkJobs[ c ] );
+    }
+    pomThreadpoolJoinAll( &ctx );
+    timespec_get( &end, TIME_UTC );
+    timeDiff( &start, &end, &diff );
+    double chunkedTime = concatTime( &diff );
+    uint64_t chunkedTotal = atomic_load( &total );
+    atomic_store( &total, 0 );
+    timespec_get( &start, TIME_UTC );
+    pomParallelFor( &ctx, 0, numIrregular, 0, testIrregularRange, &total );
+    timespec_get( &end, TIME_UTC );
+    timeDiff( &start, &end, &diff );
+    if( atomic_load( &total ) != chunkedTotal ){
+        FAIL( "Parallel for on irregular work gave the wrong total" );
+    }
+    LOG( "Irregular work on %u threads: manual chunks %fs, parallel for %fs", numThreads,
+         chunkedTime, concatTime( &diff ) );
+
+    // Tiny ranges should cost about the same as a plain loop
+    uint64_t small[ 8 ];
+    uint32_t numReps = 100000;
+    timespec_get( &start, TIME_UTC );
+    for( uint32_t r = 0; r < numReps; r++ ){
+        pomParallelFor( &ctx, 0, 8, 0, testDoubleRange, small );
+    }
+    timespec_get( &end, TIME_UTC );
+    timeDiff( &start, &end, &diff );
+    double parallelTime = concatTime( &diff );
+    timespec_get( &start, TIME_UTC );
+    for( uint32_t r = 0; r < numReps; r++ ){
+        testDoubleRange( 0, 8, small );
+    }
+    timespec_get( &end, TIME_UTC );
+    timeDiff( &start, &end, &diff );
+    LOG( "8-item range: parallel for %fns, direct call %fns", parallelTime / numReps * 1e9,
+         concatTime( &diff ) / numReps * 1e9 );
+
+    pomThreadpoolClear( &ctx );
+}
@@ -2,6 +2,8 @@
 #include <stdatomic.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 
 #if defined(__STDC_NO_THREADS__) || defined(_WIN32) || defined(__CYGWIN__)
 #include "tinycthread.h"
@@ -9,137 +11,331 @@
 #include <threads.h>
 #endif
 
+// Jobs a worker can have scheduled on its own deque before they spill over into the
+// shared job queue
+#define POM_THREADPOOL_DEQUE_SIZE 1024
+
+// Partial results of a parallel reduce up to this size live on the stack
+#define POM_PARALLEL_INLINE_RESULT 64
+
+// Automatic grain sizes aim for this many pieces per thread, so there's something to
+// steal when the work's uneven
+#define POM_PARALLEL_PIECES_PER_THREAD 8
+
+// ...but never below this many indices, so tiny loops aren't worth waking a worker for
+// and just run inline. Pass an explicit grain for loops with a few expensive indices
+#define POM_PARALLEL_MIN_GRAIN 64
+
 struct PomThreadpoolThreadCtx{
+    // Only this worker pushes/pops, everyone else steals
+    PomQueueWsCtx deque;
+    PomThreadpoolCtx *pool;
     uint16_t tId;
-    _Atomic bool busy;
+    // For picking victims to steal from
+    uint32_t rngState;
     _Atomic bool shouldLive, isLive;
     PomHpLocalCtx *hplctx;
     thrd_t tCtx;
 };
 
-typedef struct PomThreadHouseArg{
-    PomThreadpoolCtx * ctx;
-    PomThreadpoolThreadCtx *tctx;
-}PomThreadHouseArg;
+// A thread from outside the pool that has scheduled jobs on it
+struct PomThreadpoolExtCtx{
+    PomHpLocalCtx hplctx;
+    // The owning thread's `pomThreadpoolThreadToken`
+    const void *owner;
+    PomThreadpoolExtCtx *next;
+};
+
+// The worker running on this thread, or NULL if it's not a worker
+static _Thread_local PomThreadpoolThreadCtx *pomThreadpoolCurrWorker = NULL;
+
+// Only its address is used, to tell threads apart. A new thread can get a dead
+// thread's address, and then just takes over the dead thread's registrations
+static _Thread_local char pomThreadpoolThreadToken;
+
+// The pool this thread last used from outside, and its registration with it
+static _Thread_local uint64_t pomThreadpoolCachedId = 0;
+static _Thread_local PomThreadpoolExtCtx *pomThreadpoolCachedExt = NULL;
+
+static _Atomic uint64_t pomThreadpoolNextId = 1;
 
 // Where the thread lives
 int threadHouse( void *_arg );
 
 int pomThreadpoolInit( PomThreadpoolCtx *_ctx, uint16_t _numThreads ){
     _ctx->numThreads = _numThreads;
-    _ctx->threadData = (PomThreadpoolThreadCtx*) malloc( sizeof( PomThreadpoolThreadCtx ) * ( _numThreads + 1 ) );
-    PomQueueCtx *jobQueue = (PomQueueCtx*) malloc( sizeof( PomQueueCtx ) );
+    _ctx->id = atomic_fetch_add_explicit( &pomThreadpoolNextId, 1, POM_MO_RELAXED );
+    // Over-aligned for the deques
+    _ctx->threadData = (PomThreadpoolThreadCtx*) aligned_alloc( POM_CACHE_LINE_SIZE,
+                                                                sizeof( PomThreadpoolThreadCtx ) * ( _numThreads ? _numThreads : 1 ) );
+    PomQueueCtx *jobQueue = (PomQueueCtx*) aligned_alloc( POM_CACHE_LINE_SIZE, sizeof( PomQueueCtx ) );
     atomic_store( &_ctx->jobQueue, jobQueue );
 
     pomQueueInit( _ctx->jobQueue );
+    // Workers only need to know if there's anything to do
+    pomQueueSetTrackLength( _ctx->jobQueue, false );
     _ctx->hpgctx = (PomHpGlobalCtx*) malloc( sizeof( PomHpGlobalCtx ) );
     pomHpGlobalInit( _ctx->hpgctx );
-    cnd_init( &_ctx->tWaitCond );
-    cnd_init( &_ctx->tJoinCond );
-    for( int tId = 0; tId < _numThreads+1; tId++ ){
-        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ tId ];
+    atomic_init( &_ctx->numPending, 0 );
+    pomEventCountInit( &_ctx->idle );
+    pomEventCountInit( &_ctx->joiners );
+    atomic_init( &_ctx->externals, NULL );
+    for( int i = 0; i < _numThreads; i++ ){
+        int tId = i+1;
+        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ i ];
         currThread->hplctx = (PomHpLocalCtx*) malloc( sizeof( PomHpLocalCtx ) );
         pomHpThreadInit( _ctx->hpgctx, currThread->hplctx, 2 );
+        pomQueueWsInit( &currThread->deque, POM_THREADPOOL_DEQUE_SIZE );
+        currThread->pool = _ctx;
+        currThread->tId = tId;
+        // Any non-zero seed will do
+        currThread->rngState = (uint32_t) tId * 2654435761u | 1;
+        atomic_init( &currThread->shouldLive, true );
+        atomic_init( &currThread->isLive, true );
     }
+    // Workers steal from each other straight away, so only start them once every
+    // deque is set up
     for( int i = 0; i < _numThreads; i++ ){
-        int tId = i+1;
-        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ tId ];
-        atomic_init( &currThread->busy, false );
-        atomic_init( &currThread->shouldLive, true );
-        currThread->tId = tId;
-        PomThreadHouseArg * hArg = (PomThreadHouseArg*) malloc( sizeof( PomThreadHouseArg ) );
-        hArg->ctx = _ctx;
-        hArg->tctx = currThread;
-        thrd_create( &currThread->tCtx, threadHouse, hArg );
+        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ i ];
+        thrd_create( &currThread->tCtx, threadHouse, currThread );
     }
     return 0;
 }
 
+// The calling thread's hazard pointer context for this pool. Workers have their own,
+// other threads get registered with the pool the first time they use it. Lookups
+// are cached for the last pool used, so repeat calls skip the list walk
+static PomHpLocalCtx * pomThreadpoolLocalHp( PomThreadpoolCtx *_ctx ){
+    PomThreadpoolThreadCtx *worker = pomThreadpoolCurrWorker;
+    if( worker && worker->pool == _ctx ){
+        return worker->hplctx;
+    }
+    // Ids are never reused, so a cached registration can't belong to an old pool
+    // that happened to be at the same address
+    if( pomThreadpoolCachedId == _ctx->id ){
+        return &pomThreadpoolCachedExt->hplctx;
+    }
+    // Registrations are only ever added (until the pool's cleared), so the list can
+    // be walked without protection
+    PomThreadpoolExtCtx *ext = atomic_load_explicit( &_ctx->externals, POM_MO_ACQUIRE );
+    while( ext && ext->owner != &pomThreadpoolThreadToken ){
+        ext = ext->next;
+    }
+    if( !ext ){
+        ext = (PomThreadpoolExtCtx*) malloc( sizeof( PomThreadpoolExtCtx ) );
+        pomHpThreadInit( _ctx->hpgctx, &ext->hplctx, 2 );
+        ext->owner = &pomThreadpoolThreadToken;
+        ext->next = atomic_load_explicit( &_ctx->externals, POM_MO_RELAXED );
+        while( !atomic_compare_exchange_weak_explicit( &_ctx->externals, &ext->next, ext,
+                                                       POM_MO_RELEASE, POM_MO_RELAXED ) ){
+        }
+    }
+    pomThreadpoolCachedId = _ctx->id;
+    pomThreadpoolCachedExt = ext;
+    return &ext->hplctx;
+}
+
+// Push a job to wherever it should go, and wake a worker for it
+static void pomThreadpoolPushJob( PomThreadpoolCtx *_ctx, PomThreadpoolJob *_job ){
+    atomic_fetch_add_explicit( &_ctx->numPending, 1, POM_MO_RELAXED );
+    PomThreadpoolThreadCtx *worker = pomThreadpoolCurrWorker;
+    if( worker && worker->pool == _ctx ){
+        // Scheduled from one of our own jobs, so keep it local unless the deque's full
+        if( pomQueueWsPush( &worker->deque, _job ) ){
+            pomQueuePush( atomic_load( &_ctx->jobQueue ), _ctx->hpgctx, worker->hplctx, _job );
+        }
+    }
+    else{
+        pomQueuePush( atomic_load( &_ctx->jobQueue ), _ctx->hpgctx, pomThreadpoolLocalHp( _ctx ), _job );
+    }
+    // Wake a sleeping worker, if there is one
+    pomEventCountNotify( &_ctx->idle, false );
+}
+
 int pomThreadpoolScheduleJob( PomThreadpoolCtx *_ctx, PomThreadpoolJob *_job ){
-    pomQueuePush( atomic_load( &_ctx->jobQueue ), _ctx->hpgctx, _ctx->threadData[ 0 ].hplctx, _job );
-    cnd_signal( &_ctx->tWaitCond );
+    // Only write if needed, as the same job can be scheduled many times at once
+    if( _job->group ){
+        _job->group = NULL;
+    }
+    pomThreadpoolPushJob( _ctx, _job );
     return 0;
 }
 
-// Where the thread lives
-int threadHouse( void *_arg ){
-    PomThreadHouseArg * arg = (PomThreadHouseArg*) _arg;
-    // Show we're busy while we set up
-    atomic_store( &arg->tctx->busy, true );
-    atomic_init( &arg->tctx->isLive, true );
-
-    PomThreadpoolCtx *ctx = arg->ctx;
-    PomThreadpoolThreadCtx *tctx = arg->tctx;
-    free( _arg );
-    PomQueueCtx *jobQueue = atomic_load( &ctx->jobQueue );
-    atomic_store( &tctx->busy, false );
-    mtx_t waitMtx;
-    mtx_init( &waitMtx, mtx_plain );
-    
-    while( atomic_load( &tctx->shouldLive ) ){
-
-        if( pomQueueLength( jobQueue ) == 0 ){
-            // Tell main thread (if waiting) that we're sleeping
-            cnd_signal( &ctx->tJoinCond );
-            cnd_timedwait( &ctx->tWaitCond, &waitMtx, &(struct timespec){.tv_sec=0, .tv_nsec=500} );
-        }
+static void pomThreadpoolRunJob( PomThreadpoolCtx *_ctx, PomThreadpoolJob *_job ){
+    // Whoever's waiting on the group can free it (and the job) as soon as its count
+    // drops, so read everything first
+    PomThreadpoolGroup *group = _job->group;
+    _job->func( _job->args );
+    bool lastJob = group && atomic_fetch_sub_explicit( &group->numPending, 1, POM_MO_ACQ_REL ) == 1;
+    lastJob |= atomic_fetch_sub_explicit( &_ctx->numPending, 1, POM_MO_ACQ_REL ) == 1;
+    if( lastJob ){
+        // That was the last one in the group or pool. Waiters share the event count,
+        // so wake them all to re-check their own counts
+        pomEventCountNotify( &_ctx->joiners, true );
+    }
+}
 
-        PomThreadpoolJob *job = pomQueuePop( jobQueue, ctx->hpgctx, tctx->hplctx );
+// Steal from the workers in turn, starting at a random one so thieves spread out
+static PomThreadpoolJob * pomThreadpoolSteal( PomThreadpoolCtx *_ctx, PomThreadpoolThreadCtx *_thief ){
+    uint16_t numThreads = _ctx->numThreads;
+    if( !numThreads ){
+        return NULL;
+    }
+    uint32_t start = 0;
+    if( _thief ){
+        // xorshift32
+        _thief->rngState ^= _thief->rngState << 13;
+        _thief->rngState ^= _thief->rngState >> 17;
+        _thief->rngState ^= _thief->rngState << 5;
+        start = _thief->rngState % numThreads;
+    }
+    for( uint16_t i = 0; i < numThreads; i++ ){
+        PomThreadpoolThreadCtx *victim = &_ctx->threadData[ ( start + i ) % numThreads ];
+        if( victim == _thief ){
+            continue;
+        }
+        PomThreadpoolJob *job = (PomThreadpoolJob*) pomQueueWsSteal( &victim->deque );
         if( job ){
-            atomic_store( &tctx->busy, true );
-            // We have a job to execute
-            job->func( job->args );
-            atomic_store( &tctx->busy, false );
+            return job;
         }
+    }
+    return NULL;
+}
 
-
+// Own deque first (newest job, likely still in cache), then the shared queue, then
+// other workers' deques. `_worker` is NULL if called from outside the pool
+static PomThreadpoolJob * pomThreadpoolFindJob( PomThreadpoolCtx *_ctx, PomThreadpoolThreadCtx *_worker,
+                                                PomHpLocalCtx *_hplctx ){
+    PomThreadpoolJob *job = NULL;
+    if( _worker ){
+        job = (PomThreadpoolJob*) pomQueueWsPop( &_worker->deque );
     }
-    mtx_destroy( &waitMtx );
-    atomic_store( &tctx->isLive, false );
-    return 0;
+    if( !job ){
+        job = (PomThreadpoolJob*) pomQueuePop( atomic_load( &_ctx->jobQueue ), _ctx->hpgctx, _hplctx );
+    }
+    if( !job ){
+        job = pomThreadpoolSteal( _ctx, _worker );
+    }
+    return job;
 }
 
-// Block the calling thread until the jobqueue is empty.
-int pomThreadpoolJoinAll( PomThreadpoolCtx *_ctx ){
-    mtx_t wMtx;
-    mtx_init( &wMtx, mtx_plain );
-
-    // Wait for the current jobqueue to clear and tasks to finish
-    while( pomQueueLength( atomic_load( &_ctx->jobQueue ) ) ){
-        // One of the worker threads should broadcast on this signal
-        // when the queue is empty
-        //cnd_timedwait( &_ctx->tJoinCond, &wMtx, &(struct timespec){.tv_sec=0, .tv_nsec=500} );
-        PomThreadpoolJob *job = pomQueuePop( _ctx->jobQueue, _ctx->hpgctx, _ctx->threadData[ 0 ].hplctx );
+// Where the thread lives
+int threadHouse( void *_arg ){
+    PomThreadpoolThreadCtx *tctx = (PomThreadpoolThreadCtx*) _arg;
+    PomThreadpoolCtx *ctx = tctx->pool;
+    pomThreadpoolCurrWorker = tctx;
+
+    while( atomic_load_explicit( &tctx->shouldLive, POM_MO_ACQUIRE ) ){
+        PomThreadpoolJob *job = pomThreadpoolFindJob( ctx, tctx, tctx->hplctx );
+        if( job ){
+            pomThreadpoolRunJob( ctx, job );
+            continue;
+        }
+        // Nothing to do. Register as idle before looking again, so anything scheduled
+        // after that look will wake us
+        uint32_t key = pomEventCountPrepareWait( &ctx->idle );
+        job = pomThreadpoolFindJob( ctx, tctx, tctx->hplctx );
         if( job ){
-            // We have a job to execute
-            job->func( job->args );
+            pomEventCountCancelWait( &ctx->idle );
+            pomThreadpoolRunJob( ctx, job );
+            continue;
         }
+        if( !atomic_load_explicit( &tctx->shouldLive, POM_MO_ACQUIRE ) ){
+            pomEventCountCancelWait( &ctx->idle );
+            break;
+        }
+        pomEventCountWait( &ctx->idle, key, NULL );
+    }
+    atomic_store_explicit( &tctx->isLive, false, POM_MO_RELEASE );
+    return 0;
+}
 
+// Block until `_numPending` drops to zero, running jobs in the meantime
+static void pomThreadpoolWaitFor( PomThreadpoolCtx *_ctx, _Atomic uint32_t *_numPending ){
+    PomThreadpoolThreadCtx *worker = pomThreadpoolCurrWorker;
+    if( worker && worker->pool != _ctx ){
+        worker = NULL;
     }
-    // Make sure all the threads are idle before continuing
-    for( int i = 0; i < _ctx->numThreads; i++ ){
-        int tId = i + 1;
-        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ tId ];
-        while( atomic_load( &currThread->busy ) ){
-            cnd_timedwait( &_ctx->tJoinCond, &wMtx, &(struct timespec){.tv_sec=0, .tv_nsec=500} );
+    PomHpLocalCtx *hplctx = pomThreadpoolLocalHp( _ctx );
+
+    while( atomic_load_explicit( _numPending, POM_MO_ACQUIRE ) ){
+        // Help out while there are jobs waiting
+        PomThreadpoolJob *job = pomThreadpoolFindJob( _ctx, worker, hplctx );
+        if( job ){
+            pomThreadpoolRunJob( _ctx, job );
+            continue;
+        }
+        // The rest are already running, so sleep until the last one finishes
+        uint32_t key = pomEventCountPrepareWait( &_ctx->joiners );
+        if( !atomic_load_explicit( _numPending, POM_MO_ACQUIRE ) ){
+            pomEventCountCancelWait( &_ctx->joiners );
+            break;
         }
+        pomEventCountWait( &_ctx->joiners, key, NULL );
     }
-    mtx_destroy( &wMtx );
-    
+}
+
+// Block the calling thread until every scheduled job has finished.
+int pomThreadpoolJoinAll( PomThreadpoolCtx *_ctx ){
+    pomThreadpoolWaitFor( _ctx, &_ctx->numPending );
+    return 0;
+}
+
+/*******************************************
+* Groups and futures
+********************************************/
+
+int pomThreadpoolGroupInit( PomThreadpoolGroup *_group, PomThreadpoolCtx *_ctx ){
+    _group->pool = _ctx;
+    atomic_init( &_group->numPending, 0 );
+    return 0;
+}
+
+int pomThreadpoolGroupScheduleJob( PomThreadpoolGroup *_group, PomThreadpoolJob *_job ){
+    atomic_fetch_add_explicit( &_group->numPending, 1, POM_MO_RELAXED );
+    _job->group = _group;
+    pomThreadpoolPushJob( _group->pool, _job );
+    return 0;
+}
+
+int pomThreadpoolGroupWait( PomThreadpoolGroup *_group ){
+    pomThreadpoolWaitFor( _group->pool, &_group->numPending );
     return 0;
 }
 
-#include <stdio.h>
+static void pomThreadpoolFutureRun( void *_future ){
+    PomThreadpoolFuture *future = (PomThreadpoolFuture*) _future;
+    // Published by the group count dropping
+    future->result = future->func( future->args );
+}
+
+int pomThreadpoolFutureSchedule( PomThreadpoolFuture *_future, PomThreadpoolCtx *_ctx,
+                                 void * (*_func)(void*), void *_args ){
+    _future->func = _func;
+    _future->args = _args;
+    _future->result = NULL;
+    _future->job = (PomThreadpoolJob){ .func = pomThreadpoolFutureRun, .args = _future };
+    pomThreadpoolGroupInit( &_future->group, _ctx );
+    return pomThreadpoolGroupScheduleJob( &_future->group, &_future->job );
+}
+
+bool pomThreadpoolFutureIsReady( PomThreadpoolFuture *_future ){
+    return !atomic_load_explicit( &_future->group.numPending, POM_MO_ACQUIRE );
+}
+
+void * pomThreadpoolFutureGet( PomThreadpoolFuture *_future ){
+    pomThreadpoolGroupWait( &_future->group );
+    return _future->result;
+}
 
 int pomThreadpoolClear( PomThreadpoolCtx *_ctx ){
     // Tell all threads to exit
     for( int i = 0; i < _ctx->numThreads; i++ ){
-        int tId = i + 1;
-        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ tId ];
-        atomic_store( &currThread->shouldLive, false );
+        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ i ];
+        atomic_store_explicit( &currThread->shouldLive, false, POM_MO_RELEASE );
     }
 
-    // Wait for all the threads to finish their jobs
+    // Wait for all the jobs to finish
     pomThreadpoolJoinAll( _ctx );
 
     // Any waiting threads should now continue and exit
@@ -148,42 +344,165 @@ int pomThreadpoolClear( PomThreadpoolCtx *_ctx ){
 
     // Wait for all the threads to exit, then free their data
     for( int i = startIdx; i < _ctx->numThreads; i++ ){
-        int tId = i + 1;
-        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ tId ];
-        // TODO - Verify there's no error here. Valgrind gave an free'd-block access error
-        // on this atomic_load
-        while( atomic_load( &currThread->isLive ) ){
-            // Keep broadcasting on the offchance the thread is
-            // stuck waiting
-            cnd_broadcast( &_ctx->tWaitCond );
+        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ i ];
+        while( atomic_load_explicit( &currThread->isLive, POM_MO_ACQUIRE ) ){
+            // Keep waking sleepers on the offchance the thread went
+            // to sleep after the last wake-up
+            pomEventCountNotify( &_ctx->idle, true );
+            thrd_yield();
         }
         // Block till the thread dies
         thrd_join( currThread->tCtx, NULL );
+    }
 
-        // Free the thread data
+    // Free the thread data, now nobody's left to steal from the deques
+    for( int i = startIdx; i < _ctx->numThreads; i++ ){
+        PomThreadpoolThreadCtx * currThread = &_ctx->threadData[ i ];
         pomHpThreadClear( _ctx->hpgctx, currThread->hplctx );
+        pomQueueWsClear( &currThread->deque );
 
         free( currThread->hplctx );
     }
 
-    
-    PomThreadpoolThreadCtx *headThread = &_ctx->threadData[ 0 ];
 
-    // Clear reamining queue data to main threads retired list
-    pomQueueClear( _ctx->jobQueue, _ctx->hpgctx, headThread->hplctx );
-    
-    // Now clear the main threads HP data
-    pomHpThreadClear( _ctx->hpgctx, headThread->hplctx );\
+    // Clear reamining queue data to this thread's retired list
+    pomQueueClear( _ctx->jobQueue, _ctx->hpgctx, pomThreadpoolLocalHp( _ctx ) );
+
+    // Now clear the HP data of every outside thread that used the pool (including this
+    // one). Their threads must be done with the pool by now
+    PomThreadpoolExtCtx *ext = atomic_load_explicit( &_ctx->externals, POM_MO_ACQUIRE );
+    while( ext ){
+        PomThreadpoolExtCtx *next = ext->next;
+        pomHpThreadClear( _ctx->hpgctx, &ext->hplctx );
+        free( ext );
+        ext = next;
+    }
 
     // Finally clear the HP data
     pomHpGlobalClear( _ctx->hpgctx );
 
-    free( headThread->hplctx );
-
     // Free threadpool pointers
+    pomEventCountClear( &_ctx->idle );
+    pomEventCountClear( &_ctx->joiners );
     free( _ctx->hpgctx );
     free( _ctx->jobQueue );
     free( _ctx->threadData );
 
     return 0;
-}
\ No newline at end of file
+}
+
+/*******************************************
+* Parallel loops
+********************************************/
+
+typedef struct PomParallelRange{
+    PomThreadpoolCtx *ctx;
+    size_t begin, end, grain;
+    void *arg;
+    PomParallelForFunc forFunc;
+    // Reduce only
+    PomParallelReduceFunc reduceFunc;
+    PomParallelCombineFunc combine;
+    void *result;
+    size_t resultSize;
+    const void *identity;
+}PomParallelRange;
+
+static void pomParallelRun( PomParallelRange *_range );
+
+static void pomParallelRunJob( void *_range ){
+    pomParallelRun( (PomParallelRange*) _range );
+}
+
+// Fork-join binary splitting. The right half goes on this worker's deque, where it's
+// either stolen or popped straight back by the group wait once the left half's done.
+// Everything lives on the stack, as each level waits for its right half before
+// returning
+static void pomParallelRun( PomParallelRange *_range ){
+    if( _range->end - _range->begin <= _range->grain ){
+        if( _range->reduceFunc ){
+            _range->reduceFunc( _range->begin, _range->end, _range->arg, _range->result );
+        }
+        else{
+            _range->forFunc( _range->begin, _range->end, _range->arg );
+        }
+        return;
+    }
+    size_t mid = _range->begin + ( _range->end - _range->begin ) / 2;
+    PomParallelRange right = *_range;
+    right.begin = mid;
+    _Alignas( max_align_t ) unsigned char localResult[ POM_PARALLEL_INLINE_RESULT ];
+    if( _range->reduceFunc ){
+        right.result = _range->resultSize <= sizeof( localResult ) ? localResult : malloc( _range->resultSize );
+        memcpy( right.result, _range->identity, _range->resultSize );
+    }
+    PomThreadpoolJob job = { .func = pomParallelRunJob, .args = &right };
+    PomThreadpoolGroup group;
+    pomThreadpoolGroupInit( &group, _range->ctx );
+    pomThreadpoolGroupScheduleJob( &group, &job );
+
+    // The left half folds straight into our result
+    PomParallelRange left = *_range;
+    left.end = mid;
+    pomParallelRun( &left );
+    pomThreadpoolGroupWait( &group );
+
+    if( _range->reduceFunc ){
+        _range->combine( _range->result, right.result, _range->arg );
+        if( right.result != localResult ){
+            free( right.result );
+        }
+    }
+}
+
+static size_t pomParallelGrain( PomThreadpoolCtx *_ctx, size_t _begin, size_t _end, size_t _grain ){
+    if( _grain ){
+        return _grain;
+    }
+    if( !_ctx->numThreads ){
+        // Nobody to share with
+        return _end - _begin;
+    }
+    size_t grain = ( _end - _begin ) / ( POM_PARALLEL_PIECES_PER_THREAD * ( (size_t) _ctx->numThreads + 1 ) );
+    return grain > POM_PARALLEL_MIN_GRAIN ? grain : POM_PARALLEL_MIN_GRAIN;
+}
+
+int pomParallelFor( PomThreadpoolCtx *_ctx, size_t _begin, size_t _end, size_t _grain,
+                    PomParallelForFunc _func, void *_arg ){
+    if( _begin >= _end ){
+        return 0;
+    }
+    PomParallelRange range = {
+        .ctx = _ctx,
+        .begin = _begin,
+        .end = _end,
+        .grain = pomParallelGrain( _ctx, _begin, _end, _grain ),
+        .arg = _arg,
+        .forFunc = _func
+    };
+    pomParallelRun( &range );
+    return 0;
+}
+
+int pomParallelReduce( PomThreadpoolCtx *_ctx, size_t _begin, size_t _end, size_t _grain,
+                       PomParallelReduceFunc _func, PomParallelCombineFunc _combine, void *_arg,
+                       void *_result, size_t _resultSize, const void *_identity ){
+    memcpy( _result, _identity, _resultSize );
+    if( _begin >= _end ){
+        return 0;
+    }
+    PomParallelRange range = {
+        .ctx = _ctx,
+        .begin = _begin,
+        .end = _end,
+        .grain = pomParallelGrain( _ctx, _begin, _end, _grain ),
+        .arg = _arg,
+        .reduceFunc = _func,
+        .combine = _combine,
+        .result = _result,
+        .resultSize = _resultSize,
+        .identity = _identity
+    };
+    pomParallelRun( &range );
+    return 0;
+}